@@ -0,0 +1,384 @@
+#include "bench-common.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define STREAM_READ_CHUNK (64 * 1024)
+#define STREAM_MAX_FDS 64
+
+MessageStream::~MessageStream() {
+    for (int queued_fd : fds) {
+        close(queued_fd);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+bool MessageStream::fill() {
+    uint8_t chunk[STREAM_READ_CHUNK];
+    alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int) * STREAM_MAX_FDS)];
+    struct iovec iov = { chunk, sizeof(chunk) };
+    struct msghdr msg = {};
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t res;
+    do {
+        res = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (res < 0 && errno == EINTR);
+
+    if (res <= 0) {
+        broken = true;
+        return false;
+    }
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            size_t n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const int *received = reinterpret_cast<const int *>(CMSG_DATA(cmsg));
+            fds.insert(fds.end(), received, received + n_fds);
+        }
+    }
+
+    input.insert(input.end(), chunk, chunk + res);
+    return true;
+}
+
+bool MessageStream::pop_line(std::string *line) {
+    for (size_t i = 0; i + 1 < input.size(); ++i) {
+        if (input[i] == '\r' && input[i + 1] == '\n') {
+            line->assign(input.begin(), input.begin() + i);
+            input.erase(input.begin(), input.begin() + i + 2);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool MessageStream::read_line(std::string *line) {
+    while (!pop_line(line)) {
+        if (!fill()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool MessageStream::write_all(const void *data, size_t len, GUnixFDList *fd_list) {
+    const uint8_t *ptr = static_cast<const uint8_t *>(data);
+    bool fds_sent = (fd_list == nullptr || g_unix_fd_list_get_length(fd_list) == 0);
+
+    while (len > 0) {
+        struct iovec iov = { const_cast<uint8_t *>(ptr), len };
+        struct msghdr msg = {};
+        alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int) * STREAM_MAX_FDS)];
+
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        if (!fds_sent) {
+            int n_fds = g_unix_fd_list_get_length(fd_list);
+            const int *fd_array = g_unix_fd_list_peek_fds(fd_list, nullptr);
+
+            msg.msg_control = control;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * n_fds);
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n_fds);
+            memcpy(CMSG_DATA(cmsg), fd_array, sizeof(int) * n_fds);
+        }
+
+        ssize_t res = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            broken = true;
+            return false;
+        }
+
+        fds_sent = true;
+        ptr += res;
+        len -= static_cast<size_t>(res);
+    }
+    return true;
+}
+
+bool MessageStream::write_line(const std::string& line) {
+    std::string data = line + "\r\n";
+    return write_all(data.data(), data.size());
+}
+
+GDBusMessage *MessageStream::pop_message() {
+    if (input.size() < 16) {
+        return nullptr;
+    }
+
+    GError *error = nullptr;
+    gssize needed = g_dbus_message_bytes_needed(input.data(), 16, &error);
+    if (needed < 0) {
+        std::cerr << "Invalid message header: " << error->message << "\n";
+        g_error_free(error);
+        broken = true;
+        return nullptr;
+    }
+
+    if (input.size() < static_cast<size_t>(needed)) {
+        return nullptr;
+    }
+
+    GDBusMessage *message = g_dbus_message_new_from_blob(
+        input.data(), needed, G_DBUS_CAPABILITY_FLAGS_UNIX_FD_PASSING, &error);
+    input.erase(input.begin(), input.begin() + needed);
+
+    if (message == nullptr) {
+        std::cerr << "Failed to parse message: " << error->message << "\n";
+        g_error_free(error);
+        broken = true;
+        return nullptr;
+    }
+
+    uint32_t n_fds = g_dbus_message_get_num_unix_fds(message);
+    if (n_fds > 0) {
+        GUnixFDList *fd_list = g_unix_fd_list_new();
+        for (uint32_t i = 0; i < n_fds && !fds.empty(); ++i) {
+            g_unix_fd_list_append(fd_list, fds.front(), nullptr);
+            close(fds.front());
+            fds.pop_front();
+        }
+        g_dbus_message_set_unix_fd_list(message, fd_list);
+        g_object_unref(fd_list);
+    }
+
+    return message;
+}
+
+GDBusMessage *MessageStream::read_message() {
+    while (true) {
+        GDBusMessage *message = pop_message();
+        if (message || broken) {
+            return message;
+        }
+        if (!fill()) {
+            return nullptr;
+        }
+    }
+}
+
+bool MessageStream::send(GDBusMessage *message) {
+    if (g_dbus_message_get_serial(message) == 0) {
+        g_dbus_message_set_serial(message, next_serial());
+    }
+
+    GError *error = nullptr;
+    gsize size = 0;
+    guchar *blob = g_dbus_message_to_blob(message, &size, G_DBUS_CAPABILITY_FLAGS_UNIX_FD_PASSING, &error);
+    if (blob == nullptr) {
+        std::cerr << "Failed to serialize message: " << error->message << "\n";
+        g_error_free(error);
+        return false;
+    }
+
+    bool res = write_all(blob, size, g_dbus_message_get_unix_fd_list(message));
+    g_free(blob);
+    return res;
+}
+
+int connect_unix(const std::string& path) {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "Socket path too long: " << path << "\n";
+        return -1;
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+std::string client_handshake(MessageStream& stream, bool negotiate_fds) {
+    std::string uid = std::to_string(getuid());
+    std::string hex_uid;
+    std::string line;
+
+    for (char ch : uid) {
+        char hex[3];
+        snprintf(hex, sizeof(hex), "%02x", static_cast<unsigned char>(ch));
+        hex_uid += hex;
+    }
+
+    if (!stream.write_all("", 1) ||
+        !stream.write_line("AUTH EXTERNAL " + hex_uid) ||
+        !stream.read_line(&line) || !line.starts_with("OK ")) {
+        return "";
+    }
+
+    if (negotiate_fds) {
+        if (!stream.write_line("NEGOTIATE_UNIX_FD") ||
+            !stream.read_line(&line) || line != "AGREE_UNIX_FD") {
+            return "";
+        }
+    }
+
+    if (!stream.write_line("BEGIN")) {
+        return "";
+    }
+
+    GDBusMessage *hello = g_dbus_message_new_method_call(
+        "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus", "Hello");
+    bool sent = stream.send(hello);
+    uint32_t hello_serial = g_dbus_message_get_serial(hello);
+    g_object_unref(hello);
+    if (!sent) {
+        return "";
+    }
+
+    while (GDBusMessage *message = stream.read_message()) {
+        bool is_reply = g_dbus_message_get_reply_serial(message) == hello_serial;
+        std::string unique_name;
+
+        if (is_reply && g_dbus_message_get_message_type(message) == G_DBUS_MESSAGE_TYPE_METHOD_RETURN) {
+            const gchar *name = nullptr;
+            g_variant_get(g_dbus_message_get_body(message), "(&s)", &name);
+            unique_name = name;
+        }
+        g_object_unref(message);
+
+        if (is_reply) {
+            return unique_name;
+        }
+    }
+    return "";
+}
+
+bool spawn_proxy(ProxyProcess *proxy,
+                 const std::string& proxy_path,
+                 const std::string& bus_path,
+                 const std::string& socket_path,
+                 const std::vector<std::string>& extra_args,
+                 bool verbose) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        std::cerr << "socketpair failed: " << strerror(errno) << "\n";
+        return false;
+    }
+
+    std::vector<std::string> args = {
+        proxy_path,
+        "--fd=" + std::to_string(sv[1]),
+        "unix:path=" + bus_path,
+        socket_path,
+    };
+    args.insert(args.end(), extra_args.begin(), extra_args.end());
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        std::cerr << "fork failed: " << strerror(errno) << "\n";
+        close(sv[0]);
+        close(sv[1]);
+        return false;
+    }
+
+    if (pid == 0) {
+        std::vector<char *> argv;
+        for (auto &arg : args) {
+            argv.push_back(arg.data());
+        }
+        argv.push_back(nullptr);
+
+        fcntl(sv[1], F_SETFD, 0);
+        if (!verbose) {
+            int null_fd = open("/dev/null", O_WRONLY);
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+        }
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+
+    close(sv[1]);
+
+    char ready = 0;
+    ssize_t res;
+    do {
+        res = read(sv[0], &ready, 1);
+    } while (res < 0 && errno == EINTR);
+
+    proxy->pid = pid;
+    proxy->sync_fd = sv[0];
+
+    if (res != 1 || ready != 'x') {
+        std::cerr << "Proxy " << proxy_path << " failed to start\n";
+        stop_proxy(proxy);
+        return false;
+    }
+    return true;
+}
+
+void stop_proxy(ProxyProcess *proxy) {
+    if (proxy->sync_fd >= 0) {
+        close(proxy->sync_fd);
+        proxy->sync_fd = -1;
+    }
+    if (proxy->pid > 0) {
+        int status;
+        while (waitpid(proxy->pid, &status, 0) < 0 && errno == EINTR) {
+        }
+        proxy->pid = -1;
+    }
+}
+
+size_t process_rss(pid_t pid) {
+    std::string path = pid > 0 ? "/proc/" + std::to_string(pid) + "/statm" : "/proc/self/statm";
+    std::ifstream statm(path);
+    size_t total_pages = 0;
+    size_t resident_pages = 0;
+
+    if (!(statm >> total_pages >> resident_pages)) {
+        return 0;
+    }
+    return resident_pages * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+std::string make_temp_dir() {
+    GError *error = nullptr;
+    gchar *dir = g_dir_make_tmp("xdg-dbus-proxy-bench-XXXXXX", &error);
+    if (dir == nullptr) {
+        std::cerr << "Failed to create temporary directory: " << error->message << "\n";
+        g_error_free(error);
+        return "";
+    }
+
+    std::string result = dir;
+    g_free(dir);
+    return result;
+}
+
+void write_latency_json(std::ostream& out, const LatencyHistogram& histogram) {
+    out << "{\"n\":" << histogram.count()
+        << ",\"p50_ns\":" << histogram.percentile(0.5)
+        << ",\"p90_ns\":" << histogram.percentile(0.9)
+        << ",\"p99_ns\":" << histogram.percentile(0.99)
+        << ",\"p999_ns\":" << histogram.percentile(0.999)
+        << ",\"max_ns\":" << histogram.maximum() << "}";
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <glib.h>
+#include <gio/gio.h>
+#include <gio/gunixfdlist.h>
+
+#include "../headers/latency-histogram.h"
+
+#define BENCH_ECHO_NAME "org.bench.Echo"
+#define BENCH_ECHO_PATH "/org/bench/Echo"
+#define BENCH_ECHO_OWNER ":1.0"
+
+// Blocking D-Bus message stream over a connected Unix socket. Used on both
+// ends of the benchmark: by the mock bus for each accepted connection and by
+// the benchmark clients. Received fds are queued until the message that
+// carries them has been framed.
+class MessageStream {
+public:
+    explicit MessageStream(int fd) : fd(fd) {}
+    ~MessageStream();
+
+    MessageStream(const MessageStream&) = delete;
+    MessageStream& operator=(const MessageStream&) = delete;
+
+    // Pulls whatever is available from the socket into `input`. Returns
+    // false on EOF or error.
+    bool fill();
+
+    // Takes one "\r\n"-terminated auth line out of `input`; read_line()
+    // blocks until one is available.
+    bool pop_line(std::string *line);
+    bool read_line(std::string *line);
+    bool write_all(const void *data, size_t len, GUnixFDList *fds = nullptr);
+    bool write_line(const std::string& line);
+
+    // Frames the next complete message from `input` without reading, or
+    // returns nullptr if none is buffered yet.
+    GDBusMessage *pop_message();
+    // Blocks until a full message arrives; nullptr on EOF or garbage.
+    GDBusMessage *read_message();
+    bool send(GDBusMessage *message);
+
+    uint32_t next_serial() {
+        return ++serial;
+    }
+
+    int fd;
+    std::vector<uint8_t> input;
+    std::deque<int> fds;
+    uint32_t serial = 0;
+    bool broken = false;
+};
+
+// Client-side handshake: SASL EXTERNAL, optional fd negotiation and Hello.
+// Returns the unique name assigned by the bus, or "" on failure.
+int connect_unix(const std::string& path);
+std::string client_handshake(MessageStream& stream, bool negotiate_fds);
+
+struct ProxyProcess {
+    pid_t pid = -1;
+    int sync_fd = -1;
+};
+
+// Starts `proxy_path` in front of `bus_path`, listening on `socket_path`,
+// and waits for it to report readiness on its --fd socket.
+bool spawn_proxy(ProxyProcess *proxy,
+                 const std::string& proxy_path,
+                 const std::string& bus_path,
+                 const std::string& socket_path,
+                 const std::vector<std::string>& extra_args,
+                 bool verbose);
+void stop_proxy(ProxyProcess *proxy);
+
+// Resident set size of `pid` (0 for ourselves) in bytes, from /proc.
+size_t process_rss(pid_t pid);
+
+std::string make_temp_dir();
+void write_latency_json(std::ostream& out, const LatencyHistogram& histogram);
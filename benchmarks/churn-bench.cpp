@@ -0,0 +1,276 @@
+#include "bench-common.h"
+#include "mock-bus.h"
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <sys/resource.h>
+#include <unistd.h>
+
+// Connection-scale and churn benchmark. One proxy sits in front of the mock
+// bus; the benchmark first holds N idle clients open at once, then connects
+// and disconnects clients at a target rate for a while. It reports how fast
+// clients get through SASL and Hello, what each idle client costs in proxy
+// RSS before and after the proxy's idle trim, and whether RSS comes back
+// down once the clients are gone.
+
+#define SETTLE_TIMEOUT_MS 10000
+#define SETTLE_POLL_MS 10
+// The proxy runs with --idle-trim=IDLE_TRIM_SECONDS; a client is trimmed on
+// the first timer tick after it has been idle that long, so two intervals
+// and a little slack cover every client.
+#define IDLE_TRIM_SECONDS 1
+#define IDLE_TRIM_WAIT_MS (2 * IDLE_TRIM_SECONDS * 1000 + 500)
+
+struct ChurnOptions {
+    std::string proxy_path;
+    std::string output;
+    size_t clients = 1000;
+    double churn_rate = 500;
+    double churn_seconds = 5;
+    bool filter = false;
+    bool verbose = false;
+};
+
+struct PhaseResult {
+    size_t connections = 0;
+    size_t failures = 0;
+    int64_t elapsed_ns = 0;
+    LatencyHistogram hello_latency;
+};
+
+static void usage(const char *argv0, int ecode) {
+    (ecode == EXIT_SUCCESS ? std::cout : std::cerr)
+        << "usage: " << argv0 << " [OPTIONS...]\n\n"
+        << "    --proxy=PATH          xdg-dbus-proxy binary to benchmark\n"
+        << "    --clients=N           Concurrent idle clients to open (default 1000)\n"
+        << "    --churn-rate=N        Connect/disconnect cycles per second (default 500)\n"
+        << "    --churn-seconds=N     Length of the churn phase (default 5)\n"
+        << "    --filter              Run the proxy with --filter --talk=" BENCH_ECHO_NAME "\n"
+        << "    --output=FILE         Append the JSON result to FILE\n"
+        << "    --verbose             Keep the proxy's stderr\n";
+    exit(ecode);
+}
+
+static bool parse_args(int argc, char *argv[], ChurnOptions *options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        char *endptr = nullptr;
+
+        if (arg == "--help") {
+            usage(argv[0], EXIT_SUCCESS);
+        } else if (arg == "--proxy" && i + 1 < argc) {
+            options->proxy_path = argv[++i];
+        } else if (arg.starts_with("--proxy=")) {
+            options->proxy_path = arg.substr(strlen("--proxy="));
+        } else if (arg.starts_with("--output=")) {
+            options->output = arg.substr(strlen("--output="));
+        } else if (arg.starts_with("--clients=")) {
+            options->clients = strtoul(arg.c_str() + strlen("--clients="), &endptr, 10);
+        } else if (arg.starts_with("--churn-rate=")) {
+            options->churn_rate = strtod(arg.c_str() + strlen("--churn-rate="), &endptr);
+        } else if (arg.starts_with("--churn-seconds=")) {
+            options->churn_seconds = strtod(arg.c_str() + strlen("--churn-seconds="), &endptr);
+        } else if (arg == "--filter") {
+            options->filter = true;
+        } else if (arg == "--verbose") {
+            options->verbose = true;
+        } else {
+            std::cerr << "Unknown argument " << arg << "\n";
+            return false;
+        }
+
+        if (endptr && *endptr != '\0') {
+            std::cerr << "Invalid value in " << arg << "\n";
+            return false;
+        }
+    }
+
+    if (options->proxy_path.empty()) {
+        std::cerr << "--proxy=PATH is required\n";
+        return false;
+    }
+    return true;
+}
+
+// Every idle client holds a socket here, two in the proxy and one in the
+// mock bus, so the default soft limit runs out long before 10k clients.
+static void raise_fd_limit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+// Connects one client through the proxy and completes SASL and Hello,
+// recording how long that took.
+static std::unique_ptr<MessageStream> connect_client(const std::string& socket_path, PhaseResult *result) {
+    int64_t start = monotonic_ns();
+    int fd = connect_unix(socket_path);
+    if (fd < 0) {
+        ++result->failures;
+        return nullptr;
+    }
+
+    auto stream = std::make_unique<MessageStream>(fd);
+    if (client_handshake(*stream, false).empty()) {
+        ++result->failures;
+        return nullptr;
+    }
+
+    result->hello_latency.record(monotonic_ns() - start);
+    ++result->connections;
+    return stream;
+}
+
+// Waits until the proxy has dropped every bus connection, so the RSS that
+// follows is measured with no clients left.
+static bool wait_for_bus_idle(const MockBus& bus) {
+    for (int waited = 0; waited < SETTLE_TIMEOUT_MS; waited += SETTLE_POLL_MS) {
+        if (bus.n_connections == 0) {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(SETTLE_POLL_MS));
+    }
+    return false;
+}
+
+// Gives the proxy time to finish the per-client name tracking traffic it
+// starts after Hello before RSS is sampled.
+static void settle() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+}
+
+static void write_phase(std::ostream& out, const PhaseResult& phase) {
+    double seconds = std::max(static_cast<double>(phase.elapsed_ns) / 1e9, 1e-9);
+
+    out << "{\"connections\":" << phase.connections
+        << ",\"failures\":" << phase.failures
+        << ",\"seconds\":" << seconds
+        << ",\"connections_per_second\":" << static_cast<double>(phase.connections) / seconds
+        << ",\"hello_latency\":";
+    write_latency_json(out, phase.hello_latency);
+    out << "}";
+}
+
+int main(int argc, char *argv[]) {
+    ChurnOptions options;
+    if (!parse_args(argc, argv, &options)) {
+        usage(argv[0], EXIT_FAILURE);
+    }
+
+    raise_fd_limit();
+
+    std::string dir = make_temp_dir();
+    if (dir.empty()) {
+        return EXIT_FAILURE;
+    }
+
+    std::string bus_path = dir + "/bus";
+    std::string proxy_socket = dir + "/proxy";
+    std::vector<std::string> proxy_args = {"--idle-trim=" + std::to_string(IDLE_TRIM_SECONDS)};
+    if (options.filter) {
+        proxy_args.insert(proxy_args.end(), {"--filter", "--talk=" BENCH_ECHO_NAME});
+    }
+
+    MockBus bus;
+    ProxyProcess proxy;
+
+    if (!bus.start(bus_path) ||
+        !spawn_proxy(&proxy, options.proxy_path, bus_path, proxy_socket, proxy_args, options.verbose)) {
+        std::filesystem::remove_all(dir);
+        return EXIT_FAILURE;
+    }
+
+    size_t rss_baseline = process_rss(proxy.pid);
+
+    // Scale: open every client and keep it idle.
+    PhaseResult scale;
+    std::vector<std::unique_ptr<MessageStream>> idle_clients;
+    idle_clients.reserve(options.clients);
+
+    int64_t start = monotonic_ns();
+    for (size_t i = 0; i < options.clients; ++i) {
+        auto stream = connect_client(proxy_socket, &scale);
+        if (stream) {
+            idle_clients.push_back(std::move(stream));
+        }
+    }
+    scale.elapsed_ns = monotonic_ns() - start;
+
+    settle();
+    size_t rss_loaded = process_rss(proxy.pid);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(IDLE_TRIM_WAIT_MS));
+    size_t rss_trimmed = process_rss(proxy.pid);
+
+    idle_clients.clear();
+    bool drained_after_scale = wait_for_bus_idle(bus);
+    settle();
+    size_t rss_after_scale = process_rss(proxy.pid);
+
+    // Churn: connect, Hello and disconnect at a fixed rate.
+    PhaseResult churn;
+    size_t target = static_cast<size_t>(options.churn_rate * options.churn_seconds);
+    int64_t interval_ns = options.churn_rate > 0 ? static_cast<int64_t>(1e9 / options.churn_rate) : 0;
+
+    start = monotonic_ns();
+    for (size_t i = 0; i < target; ++i) {
+        int64_t due = start + static_cast<int64_t>(i) * interval_ns;
+        int64_t now = monotonic_ns();
+        if (due > now) {
+            std::this_thread::sleep_for(std::chrono::nanoseconds(due - now));
+        }
+        connect_client(proxy_socket, &churn);
+    }
+    churn.elapsed_ns = monotonic_ns() - start;
+
+    bool drained_after_churn = wait_for_bus_idle(bus);
+    settle();
+    size_t rss_after_churn = process_rss(proxy.pid);
+
+    size_t idle_clients_opened = scale.connections ? scale.connections : 1;
+    size_t per_client = rss_loaded > rss_baseline ? (rss_loaded - rss_baseline) / idle_clients_opened : 0;
+    size_t per_client_trimmed = rss_trimmed > rss_baseline ? (rss_trimmed - rss_baseline) / idle_clients_opened : 0;
+    // Allocator caches keep RSS above the pre-client baseline once the
+    // scale phase has run, so churn is judged against the post-scale level:
+    // growth within 10% of it (or 1MiB) counts as having returned.
+    size_t tolerance = std::max<size_t>(rss_after_scale / 10, 1024 * 1024);
+    bool returned = rss_after_churn <= rss_after_scale + tolerance;
+
+    std::ostringstream json;
+    json << "{\"benchmark\":\"churn\""
+         << ",\"filter\":" << (options.filter ? "true" : "false")
+         << ",\"clients\":" << options.clients
+         << ",\"churn_rate\":" << options.churn_rate
+         << ",\"scale\":";
+    write_phase(json, scale);
+    json << ",\"churn\":";
+    write_phase(json, churn);
+    json << ",\"rss\":{\"baseline_bytes\":" << rss_baseline
+         << ",\"loaded_bytes\":" << rss_loaded
+         << ",\"per_idle_client_bytes\":" << per_client
+         << ",\"trimmed_bytes\":" << rss_trimmed
+         << ",\"per_trimmed_client_bytes\":" << per_client_trimmed
+         << ",\"after_scale_bytes\":" << rss_after_scale
+         << ",\"after_churn_bytes\":" << rss_after_churn
+         << ",\"returned_after_churn\":" << (returned ? "true" : "false")
+         << "},\"drained\":" << (drained_after_scale && drained_after_churn ? "true" : "false")
+         << "}\n";
+
+    std::cout << json.str();
+    if (!options.output.empty()) {
+        std::ofstream(options.output, std::ios::app) << json.str();
+    }
+
+    stop_proxy(&proxy);
+    bus.stop();
+    std::filesystem::remove_all(dir);
+
+    return scale.failures == 0 && churn.failures == 0 && drained_after_scale && drained_after_churn
+        ? EXIT_SUCCESS : EXIT_FAILURE;
+}
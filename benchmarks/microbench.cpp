@@ -0,0 +1,285 @@
+#include "../headers/flatpak-proxy-client.h"
+#include <benchmark/benchmark.h>
+
+// Microbenchmarks for the per-message hot paths. They link the proxy core
+// directly and feed it pre-serialized messages, so no sockets are involved.
+// The proxy's debug logging is silenced in main() so the numbers reflect the
+// code paths rather than stderr.
+
+bool filter_matches(Filter *filter, FilterTypeMask type, const std::string& path,
+                    const std::string& interface, const std::string& member);
+bool any_filter_matches(const std::vector<Filter *>& filters, FilterTypeMask type,
+                        const std::string& path, const std::string& interface, const std::string& member);
+BusHandler get_dbus_method_handler(FlatpakProxyClient *client, Header *header, FlatpakPolicy *policy_out);
+Buffer *filter_names_list(FlatpakProxyClient *client, Buffer *buffer, Header *header);
+Buffer *message_to_buffer(GDBusMessage *message);
+
+typedef enum {
+    SAMPLE_BUS_CALL,
+    SAMPLE_APP_CALL,
+    SAMPLE_SIGNAL,
+    SAMPLE_REPLY,
+    SAMPLE_LARGE_CALL,
+    N_SAMPLES,
+} SampleMessage;
+
+static const char *sample_names[N_SAMPLES] = {
+    "bus_call",
+    "app_call",
+    "properties_changed",
+    "reply",
+    "large_call",
+};
+
+static GDBusMessage *new_sample_message(SampleMessage sample) {
+    GDBusMessage *message = nullptr;
+
+    switch (sample) {
+        case SAMPLE_BUS_CALL:
+            message = g_dbus_message_new_method_call(
+                "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus", "AddMatch");
+            g_dbus_message_set_body(message, g_variant_new(
+                "(s)", "type='signal',sender='org.example.App',path_namespace='/org/example'"));
+            break;
+        case SAMPLE_APP_CALL:
+            message = g_dbus_message_new_method_call(
+                "org.example.App5", "/org/example/App5/Window/1", "org.example.App5.Window", "Activate");
+            g_dbus_message_set_body(message, g_variant_new("(su)", "startup-id", 42u));
+            break;
+        case SAMPLE_SIGNAL: {
+            GVariantBuilder changed;
+            g_variant_builder_init(&changed, G_VARIANT_TYPE_VARDICT);
+            g_variant_builder_add(&changed, "{sv}", "Volume", g_variant_new_double(0.5));
+            g_variant_builder_add(&changed, "{sv}", "Muted", g_variant_new_boolean(FALSE));
+            g_variant_builder_add(&changed, "{sv}", "Title", g_variant_new_string("Some track title"));
+            message = g_dbus_message_new_signal(
+                "/org/mpris/MediaPlayer2", "org.freedesktop.DBus.Properties", "PropertiesChanged");
+            g_dbus_message_set_sender(message, ":1.42");
+            g_dbus_message_set_body(message, g_variant_new(
+                "(sa{sv}as)", "org.mpris.MediaPlayer2.Player", &changed, nullptr));
+            break;
+        }
+        case SAMPLE_REPLY:
+            message = g_dbus_message_new();
+            g_dbus_message_set_message_type(message, G_DBUS_MESSAGE_TYPE_METHOD_RETURN);
+            g_dbus_message_set_reply_serial(message, 17);
+            g_dbus_message_set_sender(message, ":1.42");
+            g_dbus_message_set_destination(message, ":1.7");
+            g_dbus_message_set_body(message, g_variant_new("(s)", ":1.42"));
+            break;
+        case SAMPLE_LARGE_CALL: {
+            std::vector<uint8_t> payload(64 * 1024, 0x5a);
+            message = g_dbus_message_new_method_call(
+                "org.example.App5", "/org/example/App5", "org.example.App5", "Upload");
+            g_dbus_message_set_body(message, g_variant_new(
+                "(@ay)", g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, payload.data(), payload.size(), 1)));
+            break;
+        }
+        default:
+            break;
+    }
+
+    g_dbus_message_set_serial(message, 1234);
+    return message;
+}
+
+static Buffer *new_sample_buffer(SampleMessage sample) {
+    GDBusMessage *message = new_sample_message(sample);
+    Buffer *buffer = message_to_buffer(message);
+    g_object_unref(message);
+    return buffer;
+}
+
+// A proxy with `n_rules` talk policies on org.example.App0..N, a see
+// policy on the org.example.Service subtree and one call rule per app, and
+// a client that knows a couple of unique names.
+struct PolicyFixture {
+    explicit PolicyFixture(size_t n_rules) : proxy("unix:path=/nonexistent", "") {
+        proxy.set_filter(true);
+        for (size_t i = 0; i < n_rules; ++i) {
+            std::string name = "org.example.App" + std::to_string(i);
+            proxy.add_policy(name, false, FLATPAK_POLICY_TALK);
+            proxy.add_call_rule(name, false, name + ".Window.*@/org/example/" + name.substr(12) + "/*");
+        }
+        proxy.add_policy("org.example.Service", true, FLATPAK_POLICY_SEE);
+
+        client = std::make_shared<FlatpakProxyClient>(&proxy, nullptr);
+        client->add_unique_id_owned_name(":1.42", "org.example.App5");
+        client->add_unique_id_owned_name(":1.43", "org.example.Service.Child");
+    }
+
+    FlatpakProxy proxy;
+    std::shared_ptr<FlatpakProxyClient> client;
+};
+
+static void BM_HeaderParse(benchmark::State& state) {
+    SampleMessage sample = static_cast<SampleMessage>(state.range(0));
+    Buffer *buffer = new_sample_buffer(sample);
+
+    for (auto _ : state) {
+        Header header;
+        header.parse(buffer);
+        benchmark::DoNotOptimize(header.type);
+    }
+
+    state.SetLabel(sample_names[sample]);
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * static_cast<int64_t>(buffer->size));
+    buffer->unref();
+}
+BENCHMARK(BM_HeaderParse)->DenseRange(0, N_SAMPLES - 1);
+
+static void BM_GetMaxPolicy(benchmark::State& state) {
+    PolicyFixture fixture(static_cast<size_t>(state.range(0)));
+    const char *names[] = {
+        "org.example.App5",
+        "org.example.Service.Child.Grandchild",
+        "org.unrelated.Name",
+        ":1.42",
+    };
+    size_t i = 0;
+
+    for (auto _ : state) {
+        std::vector<Filter *> matched;
+        FlatpakPolicy policy = fixture.client->get_max_policy_and_matched(names[i++ % 4], &matched);
+        benchmark::DoNotOptimize(policy);
+    }
+}
+BENCHMARK(BM_GetMaxPolicy)->Arg(10)->Arg(1000);
+
+static void BM_FilterMatches(benchmark::State& state) {
+    Filter filter("org.example.App5", false, FILTER_TYPE_CALL, "org.example.App5.Window.*@/org/example/App5/*");
+    std::string path = "/org/example/App5/Window/1";
+    std::string interface = "org.example.App5.Window";
+    std::string member = "Activate";
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(filter_matches(&filter, FILTER_TYPE_CALL, path, interface, member));
+    }
+}
+BENCHMARK(BM_FilterMatches);
+
+// Only the last filter matches, so every call walks the whole list.
+static void BM_AnyFilterMatches(benchmark::State& state) {
+    std::vector<Filter *> filters;
+    for (int64_t i = 0; i < state.range(0); ++i) {
+        std::string interface = "org.example.App5.Iface" + std::to_string(i);
+        filters.push_back(new Filter("org.example.App5", false, FILTER_TYPE_CALL, interface + ".*@/org/example/App5/*"));
+    }
+    filters.push_back(new Filter("org.example.App5", false, FILTER_TYPE_CALL, "org.example.App5.Window.Activate"));
+
+    std::string path = "/org/example/App5/Window/1";
+    std::string interface = "org.example.App5.Window";
+    std::string member = "Activate";
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(any_filter_matches(filters, FILTER_TYPE_CALL, path, interface, member));
+    }
+
+    for (auto *filter : filters) {
+        delete filter;
+    }
+}
+BENCHMARK(BM_AnyFilterMatches)->Arg(1)->Arg(16)->Arg(256);
+
+// Signals from a unique name owning an app name, from a subtree name and
+// from a name with no rules. After the first round every per-name decision
+// comes from the policy table's cache.
+static void BM_BroadcastAllowed(benchmark::State& state) {
+    PolicyFixture fixture(static_cast<size_t>(state.range(0)));
+    Header headers[3];
+    headers[0].sender = ":1.42";
+    headers[0].path = "/org/example/App5/Window/1";
+    headers[0].interface = "org.example.App5.Window";
+    headers[0].member = "Changed";
+    headers[1].sender = "org.example.Service.Child";
+    headers[1].path = "/org/example/Service";
+    headers[1].interface = "org.example.Service";
+    headers[1].member = "Changed";
+    headers[2].sender = "org.unrelated.Name";
+    headers[2].path = "/org/unrelated/Name";
+    headers[2].interface = "org.unrelated.Name";
+    headers[2].member = "Changed";
+    size_t i = 0;
+
+    for (auto _ : state) {
+        FlatpakPolicy policy = FLATPAK_POLICY_NONE;
+        benchmark::DoNotOptimize(fixture.client->broadcast_allowed(&headers[i++ % 3], &policy));
+    }
+}
+BENCHMARK(BM_BroadcastAllowed)->Arg(10)->Arg(1000);
+
+static void BM_GetDbusMethodHandler(benchmark::State& state) {
+    PolicyFixture fixture(static_cast<size_t>(state.range(0)));
+    Buffer *app_call = new_sample_buffer(SAMPLE_APP_CALL);
+    Buffer *bus_call = new_sample_buffer(SAMPLE_BUS_CALL);
+    Header app_header;
+    Header bus_header;
+    size_t i = 0;
+
+    app_header.parse(app_call);
+    bus_header.parse(bus_call);
+
+    for (auto _ : state) {
+        Header *header = (i++ & 1) ? &bus_header : &app_header;
+        benchmark::DoNotOptimize(get_dbus_method_handler(fixture.client.get(), header, nullptr));
+    }
+
+    app_call->unref();
+    bus_call->unref();
+}
+BENCHMARK(BM_GetDbusMethodHandler)->Arg(10)->Arg(1000);
+
+// A ListNames reply where every other name is visible to the client.
+static void BM_FilterNamesList(benchmark::State& state) {
+    PolicyFixture fixture(16);
+    fixture.proxy.add_policy("org.example.Visible", true, FLATPAK_POLICY_SEE);
+
+    GVariantBuilder names;
+    g_variant_builder_init(&names, G_VARIANT_TYPE_STRING_ARRAY);
+    for (int64_t i = 0; i < state.range(0); ++i) {
+        std::string name = (i & 1 ? "org.example.Visible.N" : "org.example.Hidden.N") + std::to_string(i);
+        g_variant_builder_add(&names, "s", name.c_str());
+    }
+
+    GDBusMessage *reply = new_sample_message(SAMPLE_REPLY);
+    g_dbus_message_set_body(reply, g_variant_new("(as)", &names));
+    Buffer *buffer = message_to_buffer(reply);
+    g_object_unref(reply);
+    Header header;
+    header.parse(buffer);
+
+    for (auto _ : state) {
+        Buffer *filtered = filter_names_list(fixture.client.get(), buffer, &header);
+        benchmark::DoNotOptimize(filtered);
+        if (filtered) {
+            filtered->unref();
+        }
+    }
+
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * state.range(0));
+    buffer->unref();
+}
+BENCHMARK(BM_FilterNamesList)->Arg(1000)->Arg(10000);
+
+static void BM_BufferLifecycle(benchmark::State& state) {
+    size_t size = static_cast<size_t>(state.range(0));
+
+    for (auto _ : state) {
+        Buffer *buffer = new Buffer(size);
+        benchmark::DoNotOptimize(buffer->data.data());
+        buffer->unref();
+    }
+}
+BENCHMARK(BM_BufferLifecycle)->Arg(16)->Arg(4096)->Arg(64 * 1024);
+
+int main(int argc, char **argv) {
+    std::cerr.setstate(std::ios::badbit);
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,300 @@
+#include "mock-bus.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <vector>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define MOCK_BUS_GUID "0123456789abcdef0123456789abcdef"
+#define BUS_NAME "org.freedesktop.DBus"
+
+MockBus::~MockBus() {
+    stop();
+}
+
+bool MockBus::start(const std::string& path) {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "Bus socket path too long: " << path << "\n";
+        return false;
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+    this->path = path;
+    unlink(path.c_str());
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0 ||
+        bind(listen_fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0 ||
+        listen(listen_fd, SOMAXCONN) < 0 ||
+        pipe2(wake_fd, O_CLOEXEC) < 0) {
+        std::cerr << "Failed to start mock bus at " << path << ": " << strerror(errno) << "\n";
+        return false;
+    }
+
+    thread = std::thread(&MockBus::run, this);
+    return true;
+}
+
+void MockBus::stop() {
+    if (!thread.joinable()) {
+        return;
+    }
+
+    ssize_t res = write(wake_fd[1], "q", 1);
+    (void) res;
+    thread.join();
+
+    connections.clear();
+    close(listen_fd);
+    close(wake_fd[0]);
+    close(wake_fd[1]);
+    listen_fd = -1;
+    unlink(path.c_str());
+}
+
+void MockBus::run() {
+    std::vector<struct pollfd> fds;
+
+    while (true) {
+        fds.clear();
+        fds.push_back({ wake_fd[0], POLLIN, 0 });
+        fds.push_back({ listen_fd, POLLIN, 0 });
+        for (auto &entry : connections) {
+            fds.push_back({ entry.first, POLLIN, 0 });
+        }
+
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Mock bus poll failed: " << strerror(errno) << "\n";
+            return;
+        }
+
+        if (fds[0].revents) {
+            return;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd >= 0) {
+                connections[fd] = std::make_unique<Connection>(fd);
+                ++n_connections;
+            }
+        }
+
+        for (size_t i = 2; i < fds.size(); ++i) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+
+            auto it = connections.find(fds[i].fd);
+            Connection &conn = *it->second;
+            if (!conn.stream.fill()) {
+                connections.erase(it);
+                --n_connections;
+                continue;
+            }
+
+            handle_input(conn);
+            if (conn.stream.broken) {
+                connections.erase(it);
+                --n_connections;
+            }
+        }
+    }
+}
+
+void MockBus::handle_input(Connection& conn) {
+    if (!conn.authenticated) {
+        handle_auth(conn);
+    }
+
+    while (conn.authenticated && !conn.stream.broken) {
+        GDBusMessage *message = conn.stream.pop_message();
+        if (message == nullptr) {
+            break;
+        }
+        handle_message(conn, message);
+        g_object_unref(message);
+    }
+}
+
+void MockBus::handle_auth(Connection& conn) {
+    std::string line;
+
+    while (!conn.authenticated && conn.stream.pop_line(&line)) {
+        if (conn.first_line) {
+            if (line.empty() || line[0] != '\0') {
+                conn.stream.broken = true;
+                return;
+            }
+            line.erase(0, 1);
+            conn.first_line = false;
+        }
+
+        if (line.starts_with("AUTH EXTERNAL")) {
+            conn.stream.write_line("OK " MOCK_BUS_GUID);
+        } else if (line.starts_with("AUTH")) {
+            conn.stream.write_line("REJECTED EXTERNAL");
+        } else if (line == "NEGOTIATE_UNIX_FD") {
+            conn.stream.write_line("AGREE_UNIX_FD");
+        } else if (line == "BEGIN") {
+            conn.authenticated = true;
+        } else {
+            conn.stream.write_line("ERROR");
+        }
+    }
+}
+
+void MockBus::handle_message(Connection& conn, GDBusMessage *message) {
+    if (g_dbus_message_get_message_type(message) != G_DBUS_MESSAGE_TYPE_METHOD_CALL) {
+        return;
+    }
+
+    const char *destination = g_dbus_message_get_destination(message);
+    if (g_strcmp0(destination, BUS_NAME) == 0) {
+        handle_bus_call(conn, message);
+    } else if (g_strcmp0(destination, BENCH_ECHO_NAME) == 0 ||
+               g_strcmp0(destination, BENCH_ECHO_OWNER) == 0) {
+        handle_echo_call(conn, message);
+    } else {
+        reply_error(conn, message, "org.freedesktop.DBus.Error.ServiceUnknown", BUS_NAME);
+    }
+}
+
+void MockBus::handle_bus_call(Connection& conn, GDBusMessage *message) {
+    std::string member = g_dbus_message_get_member(message) ? g_dbus_message_get_member(message) : "";
+    GVariant *body = g_dbus_message_get_body(message);
+
+    if (member == "Hello") {
+        conn.unique_name = ":1." + std::to_string(next_unique_id++);
+        reply(conn, message, g_variant_new("(s)", conn.unique_name.c_str()), BUS_NAME);
+
+        GDBusMessage *acquired = g_dbus_message_new_signal("/org/freedesktop/DBus", BUS_NAME, "NameAcquired");
+        g_dbus_message_set_sender(acquired, BUS_NAME);
+        g_dbus_message_set_destination(acquired, conn.unique_name.c_str());
+        g_dbus_message_set_body(acquired, g_variant_new("(s)", conn.unique_name.c_str()));
+        conn.stream.send(acquired);
+        g_object_unref(acquired);
+    } else if (member == "AddMatch" || member == "RemoveMatch") {
+        reply(conn, message, nullptr, BUS_NAME);
+    } else if (member == "GetNameOwner" || member == "NameHasOwner") {
+        const gchar *name = nullptr;
+        if (body == nullptr || !g_variant_is_of_type(body, G_VARIANT_TYPE("(s)"))) {
+            reply_error(conn, message, "org.freedesktop.DBus.Error.InvalidArgs", BUS_NAME);
+            return;
+        }
+        g_variant_get(body, "(&s)", &name);
+
+        std::string owner;
+        if (g_strcmp0(name, BUS_NAME) == 0) {
+            owner = BUS_NAME;
+        } else if (g_strcmp0(name, BENCH_ECHO_NAME) == 0 || g_strcmp0(name, BENCH_ECHO_OWNER) == 0) {
+            owner = BENCH_ECHO_OWNER;
+        } else if (name == conn.unique_name) {
+            owner = conn.unique_name;
+        }
+
+        if (member == "NameHasOwner") {
+            reply(conn, message, g_variant_new("(b)", !owner.empty()), BUS_NAME);
+        } else if (owner.empty()) {
+            reply_error(conn, message, "org.freedesktop.DBus.Error.NameHasNoOwner", BUS_NAME);
+        } else {
+            reply(conn, message, g_variant_new("(s)", owner.c_str()), BUS_NAME);
+        }
+    } else if (member == "ListNames" || member == "ListActivatableNames") {
+        GVariantBuilder builder;
+        g_variant_builder_init(&builder, G_VARIANT_TYPE("as"));
+        g_variant_builder_add(&builder, "s", BUS_NAME);
+        if (member == "ListNames") {
+            g_variant_builder_add(&builder, "s", BENCH_ECHO_OWNER);
+            g_variant_builder_add(&builder, "s", BENCH_ECHO_NAME);
+            if (!conn.unique_name.empty()) {
+                g_variant_builder_add(&builder, "s", conn.unique_name.c_str());
+            }
+            for (size_t i = 0; i < extra_names; ++i) {
+                std::string name = "org.bench.Extra" + std::to_string(i);
+                g_variant_builder_add(&builder, "s", name.c_str());
+            }
+        }
+        reply(conn, message, g_variant_new("(as)", &builder), BUS_NAME);
+    } else {
+        reply_error(conn, message, "org.freedesktop.DBus.Error.UnknownMethod", BUS_NAME);
+    }
+}
+
+void MockBus::handle_echo_call(Connection& conn, GDBusMessage *message) {
+    std::string member = g_dbus_message_get_member(message) ? g_dbus_message_get_member(message) : "";
+    GVariant *body = g_dbus_message_get_body(message);
+
+    if (member == "Ping") {
+        GDBusMessage *pong = g_dbus_message_new_method_reply(message);
+        g_dbus_message_set_sender(pong, BENCH_ECHO_OWNER);
+        if (body) {
+            g_dbus_message_set_body(pong, body);
+        }
+        if (g_dbus_message_get_unix_fd_list(message)) {
+            g_dbus_message_set_unix_fd_list(pong, g_dbus_message_get_unix_fd_list(message));
+        }
+        if (!(g_dbus_message_get_flags(message) & G_DBUS_MESSAGE_FLAGS_NO_REPLY_EXPECTED)) {
+            conn.stream.send(pong);
+        }
+        g_object_unref(pong);
+    } else if (member == "Flood") {
+        guint32 count = 0;
+        guint32 size = 0;
+        if (body == nullptr || !g_variant_is_of_type(body, G_VARIANT_TYPE("(uu)"))) {
+            reply_error(conn, message, "org.freedesktop.DBus.Error.InvalidArgs", BENCH_ECHO_OWNER);
+            return;
+        }
+        g_variant_get(body, "(uu)", &count, &size);
+
+        std::vector<uint8_t> payload(size, 0x5a);
+        for (guint32 i = 0; i < count && !conn.stream.broken; ++i) {
+            GDBusMessage *tick = g_dbus_message_new_signal(BENCH_ECHO_PATH, BENCH_ECHO_NAME, "Tick");
+            GVariant *bytes = g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, payload.data(), payload.size(), 1);
+            g_dbus_message_set_sender(tick, BENCH_ECHO_OWNER);
+            g_dbus_message_set_body(tick, g_variant_new("(t@ay)", static_cast<guint64>(monotonic_ns()), bytes));
+            conn.stream.send(tick);
+            g_object_unref(tick);
+        }
+        reply(conn, message, nullptr, BENCH_ECHO_OWNER);
+    } else {
+        reply_error(conn, message, "org.freedesktop.DBus.Error.UnknownMethod", BENCH_ECHO_OWNER);
+    }
+}
+
+void MockBus::reply(Connection& conn, GDBusMessage *call, GVariant *body, const char *sender) {
+    if (g_dbus_message_get_flags(call) & G_DBUS_MESSAGE_FLAGS_NO_REPLY_EXPECTED) {
+        if (body) {
+            g_variant_unref(g_variant_ref_sink(body));
+        }
+        return;
+    }
+
+    GDBusMessage *reply = g_dbus_message_new_method_reply(call);
+    g_dbus_message_set_sender(reply, sender);
+    if (body) {
+        g_dbus_message_set_body(reply, body);
+    }
+    conn.stream.send(reply);
+    g_object_unref(reply);
+}
+
+void MockBus::reply_error(Connection& conn, GDBusMessage *call, const char *error_name, const char *sender) {
+    if (g_dbus_message_get_flags(call) & G_DBUS_MESSAGE_FLAGS_NO_REPLY_EXPECTED) {
+        return;
+    }
+
+    GDBusMessage *reply = g_dbus_message_new_method_error(call, error_name, "Not supported by the mock bus");
+    g_dbus_message_set_sender(reply, sender);
+    conn.stream.send(reply);
+    g_object_unref(reply);
+}
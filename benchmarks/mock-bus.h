@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "bench-common.h"
+
+// Minimal stand-in for the message bus, run on its own thread. It speaks
+// just enough of the protocol for the proxy and the benchmark clients:
+// SASL EXTERNAL with fd negotiation, Hello, AddMatch/RemoveMatch,
+// GetNameOwner, NameHasOwner and ListNames. The well-known name
+// BENCH_ECHO_NAME is owned by the bus itself, which echoes every Ping back
+// (fds included) and answers Flood(count, size) with `count` Tick signals
+// carrying a send timestamp and `size` payload bytes.
+class MockBus {
+public:
+    struct Connection {
+        explicit Connection(int fd) : stream(fd) {}
+
+        MessageStream stream;
+        bool authenticated = false;
+        bool first_line = true;
+        std::string unique_name;
+    };
+
+    ~MockBus();
+
+    bool start(const std::string& path);
+    void stop();
+
+    // Extra well-known names reported by ListNames, to give the proxy's
+    // name filtering something to chew on.
+    size_t extra_names = 0;
+
+    std::atomic<size_t> n_connections{0};
+
+private:
+    void run();
+    void handle_input(Connection& conn);
+    void handle_auth(Connection& conn);
+    void handle_message(Connection& conn, GDBusMessage *message);
+    void handle_bus_call(Connection& conn, GDBusMessage *message);
+    void handle_echo_call(Connection& conn, GDBusMessage *message);
+    void reply(Connection& conn, GDBusMessage *call, GVariant *body, const char *sender);
+    void reply_error(Connection& conn, GDBusMessage *call, const char *error_name, const char *sender);
+
+    std::string path;
+    int listen_fd = -1;
+    int wake_fd[2] = {-1, -1};
+    uint32_t next_unique_id = 1;
+    std::unordered_map<int, std::unique_ptr<Connection>> connections;
+    std::thread thread;
+};
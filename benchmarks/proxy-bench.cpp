@@ -0,0 +1,318 @@
+#include "bench-common.h"
+#include "mock-bus.h"
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <unistd.h>
+
+// End-to-end benchmark: a mock bus on a background thread, the real
+// xdg-dbus-proxy binary in front of it, and a single client driving one
+// workload through the proxy (or straight at the bus with --direct, for a
+// baseline). Results are printed as one JSON object per run.
+
+struct BenchOptions {
+    std::string proxy_path;
+    std::string workload = "pingpong";
+    std::string output;
+    size_t count = 10000;
+    size_t warmup = 100;
+    size_t size = 0;
+    size_t cut_through = 0;
+    bool filter = false;
+    bool direct = false;
+    bool verbose = false;
+};
+
+struct BenchResult {
+    size_t messages = 0;
+    size_t bytes = 0;
+    int64_t elapsed_ns = 0;
+    LatencyHistogram latency;
+};
+
+static void usage(const char *argv0, int ecode) {
+    (ecode == EXIT_SUCCESS ? std::cout : std::cerr)
+        << "usage: " << argv0 << " [OPTIONS...]\n\n"
+        << "    --proxy=PATH          xdg-dbus-proxy binary to benchmark\n"
+        << "    --workload=NAME       pingpong, large, fds or signals\n"
+        << "    --count=N             Number of calls or signals to measure\n"
+        << "    --warmup=N            Unmeasured calls before the run\n"
+        << "    --size=BYTES          Payload size per message (default 64, 1MiB for large)\n"
+        << "    --filter              Run the proxy with --filter --talk=" BENCH_ECHO_NAME "\n"
+        << "    --cut-through=BYTES   Run the proxy with --cut-through=BYTES\n"
+        << "    --direct              Connect straight to the mock bus\n"
+        << "    --output=FILE         Append the JSON result to FILE\n"
+        << "    --verbose             Keep the proxy's stderr\n";
+    exit(ecode);
+}
+
+static bool parse_count(const std::string& value, size_t *out) {
+    char *endptr = nullptr;
+    unsigned long long parsed = strtoull(value.c_str(), &endptr, 10);
+    if (value.empty() || *endptr != '\0') {
+        return false;
+    }
+    *out = static_cast<size_t>(parsed);
+    return true;
+}
+
+static bool parse_args(int argc, char *argv[], BenchOptions *options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+
+        if (arg == "--help") {
+            usage(argv[0], EXIT_SUCCESS);
+        } else if (arg == "--proxy" && i + 1 < argc) {
+            options->proxy_path = argv[++i];
+        } else if (arg.starts_with("--proxy=")) {
+            options->proxy_path = arg.substr(strlen("--proxy="));
+        } else if (arg.starts_with("--workload=")) {
+            options->workload = arg.substr(strlen("--workload="));
+        } else if (arg.starts_with("--output=")) {
+            options->output = arg.substr(strlen("--output="));
+        } else if (arg.starts_with("--count=")) {
+            if (!parse_count(arg.substr(strlen("--count=")), &options->count))
+                return false;
+        } else if (arg.starts_with("--warmup=")) {
+            if (!parse_count(arg.substr(strlen("--warmup=")), &options->warmup))
+                return false;
+        } else if (arg.starts_with("--size=")) {
+            if (!parse_count(arg.substr(strlen("--size=")), &options->size))
+                return false;
+        } else if (arg.starts_with("--cut-through=")) {
+            if (!parse_count(arg.substr(strlen("--cut-through=")), &options->cut_through))
+                return false;
+        } else if (arg == "--filter") {
+            options->filter = true;
+        } else if (arg == "--direct") {
+            options->direct = true;
+        } else if (arg == "--verbose") {
+            options->verbose = true;
+        } else {
+            std::cerr << "Unknown argument " << arg << "\n";
+            return false;
+        }
+    }
+
+    if (options->workload != "pingpong" && options->workload != "large" &&
+        options->workload != "fds" && options->workload != "signals") {
+        std::cerr << "Unknown workload " << options->workload << "\n";
+        return false;
+    }
+
+    if (!options->direct && options->proxy_path.empty()) {
+        std::cerr << "--proxy=PATH is required unless --direct is given\n";
+        return false;
+    }
+    return true;
+}
+
+static GDBusMessage *new_ping(const std::vector<uint8_t>& payload, int fd) {
+    GDBusMessage *call = g_dbus_message_new_method_call(BENCH_ECHO_NAME, BENCH_ECHO_PATH, BENCH_ECHO_NAME, "Ping");
+    GVariant *bytes = g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, payload.data(), payload.size(), 1);
+
+    if (fd >= 0) {
+        GUnixFDList *fd_list = g_unix_fd_list_new();
+        gint index = g_unix_fd_list_append(fd_list, fd, nullptr);
+        g_dbus_message_set_body(call, g_variant_new("(h@ay)", index, bytes));
+        g_dbus_message_set_unix_fd_list(call, fd_list);
+        g_object_unref(fd_list);
+    } else {
+        g_dbus_message_set_body(call, g_variant_new("(@ay)", bytes));
+    }
+    return call;
+}
+
+// Reads until the reply to `serial` arrives. Returns false if the
+// connection broke or the call failed.
+static bool wait_reply(MessageStream& stream, uint32_t serial) {
+    while (GDBusMessage *message = stream.read_message()) {
+        bool is_reply = g_dbus_message_get_reply_serial(message) == serial;
+        bool ok = g_dbus_message_get_message_type(message) == G_DBUS_MESSAGE_TYPE_METHOD_RETURN;
+
+        if (is_reply && !ok) {
+            const char *error_name = g_dbus_message_get_error_name(message);
+            std::cerr << "Call failed: " << (error_name ? error_name : "unknown error") << "\n";
+        }
+        g_object_unref(message);
+
+        if (is_reply) {
+            return ok;
+        }
+    }
+    return false;
+}
+
+static bool run_calls(MessageStream& stream, const BenchOptions& options, bool pass_fd, BenchResult *result) {
+    std::vector<uint8_t> payload(options.size, 0xa5);
+    int pipe_fds[2] = {-1, -1};
+
+    if (pass_fd && pipe(pipe_fds) < 0) {
+        std::cerr << "pipe failed\n";
+        return false;
+    }
+
+    bool ok = true;
+    int64_t start = 0;
+
+    for (size_t i = 0; ok && i < options.warmup + options.count; ++i) {
+        if (i == options.warmup) {
+            start = monotonic_ns();
+        }
+
+        GDBusMessage *call = new_ping(payload, pipe_fds[0]);
+        int64_t sent_at = monotonic_ns();
+        ok = stream.send(call);
+        uint32_t serial = g_dbus_message_get_serial(call);
+        g_object_unref(call);
+
+        ok = ok && wait_reply(stream, serial);
+        if (ok && i >= options.warmup) {
+            result->latency.record(monotonic_ns() - sent_at);
+            result->messages += 2;
+            result->bytes += 2 * payload.size();
+        }
+    }
+
+    result->elapsed_ns = monotonic_ns() - start;
+
+    if (pass_fd) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+    }
+    return ok;
+}
+
+// The latency of a signal is measured from the moment the mock bus stamped
+// it to the moment the client framed it, so it covers the whole path
+// through the proxy.
+static bool run_signals(MessageStream& stream, const BenchOptions& options, BenchResult *result) {
+    GDBusMessage *call = g_dbus_message_new_method_call(BENCH_ECHO_NAME, BENCH_ECHO_PATH, BENCH_ECHO_NAME, "Flood");
+    g_dbus_message_set_body(call, g_variant_new("(uu)",
+                                                static_cast<guint32>(options.count),
+                                                static_cast<guint32>(options.size)));
+
+    int64_t start = monotonic_ns();
+    bool ok = stream.send(call);
+    uint32_t serial = g_dbus_message_get_serial(call);
+    g_object_unref(call);
+
+    while (ok) {
+        GDBusMessage *message = stream.read_message();
+        if (message == nullptr) {
+            ok = false;
+            break;
+        }
+
+        GDBusMessageType type = g_dbus_message_get_message_type(message);
+        if (type == G_DBUS_MESSAGE_TYPE_SIGNAL && g_strcmp0(g_dbus_message_get_member(message), "Tick") == 0) {
+            guint64 stamp = 0;
+            GVariant *bytes = nullptr;
+            g_variant_get(g_dbus_message_get_body(message), "(t@ay)", &stamp, &bytes);
+            result->latency.record(monotonic_ns() - static_cast<int64_t>(stamp));
+            result->messages += 1;
+            result->bytes += g_variant_get_size(bytes);
+            g_variant_unref(bytes);
+        } else if (g_dbus_message_get_reply_serial(message) == serial) {
+            ok = type == G_DBUS_MESSAGE_TYPE_METHOD_RETURN;
+            g_object_unref(message);
+            break;
+        }
+        g_object_unref(message);
+    }
+
+    result->elapsed_ns = monotonic_ns() - start;
+    if (ok && result->messages != options.count) {
+        std::cerr << "Received " << result->messages << " of " << options.count << " signals\n";
+        ok = false;
+    }
+    return ok;
+}
+
+static void write_result(std::ostream& out, const BenchOptions& options, const BenchResult& result, size_t proxy_rss) {
+    double seconds = static_cast<double>(result.elapsed_ns) / 1e9;
+    if (seconds <= 0) {
+        seconds = 1e-9;
+    }
+
+    out << "{\"workload\":\"" << options.workload << "\""
+        << ",\"target\":\"" << (options.direct ? "direct" : "proxy") << "\""
+        << ",\"filter\":" << (options.filter ? "true" : "false")
+        << ",\"cut_through\":" << options.cut_through
+        << ",\"count\":" << options.count
+        << ",\"payload_bytes\":" << options.size
+        << ",\"seconds\":" << seconds
+        << ",\"messages\":" << result.messages
+        << ",\"bytes\":" << result.bytes
+        << ",\"messages_per_second\":" << static_cast<double>(result.messages) / seconds
+        << ",\"mb_per_second\":" << static_cast<double>(result.bytes) / seconds / (1024.0 * 1024.0)
+        << ",\"proxy_rss_bytes\":" << proxy_rss
+        << ",\"latency\":";
+    write_latency_json(out, result.latency);
+    out << "}\n";
+}
+
+int main(int argc, char *argv[]) {
+    BenchOptions options;
+    if (!parse_args(argc, argv, &options)) {
+        usage(argv[0], EXIT_FAILURE);
+    }
+
+    if (options.size == 0) {
+        options.size = options.workload == "large" ? 1024 * 1024 : 64;
+    }
+
+    std::string dir = make_temp_dir();
+    if (dir.empty()) {
+        return EXIT_FAILURE;
+    }
+
+    std::string bus_path = dir + "/bus";
+    std::string proxy_socket = dir + "/proxy";
+    MockBus bus;
+    ProxyProcess proxy;
+    int status = EXIT_FAILURE;
+
+    if (bus.start(bus_path)) {
+        std::vector<std::string> proxy_args;
+        if (options.filter) {
+            proxy_args = {"--filter", "--talk=" BENCH_ECHO_NAME};
+        }
+        if (options.cut_through > 0) {
+            proxy_args.push_back("--cut-through=" + std::to_string(options.cut_through));
+        }
+
+        if (options.direct || spawn_proxy(&proxy, options.proxy_path, bus_path, proxy_socket, proxy_args, options.verbose)) {
+            int fd = connect_unix(options.direct ? bus_path : proxy_socket);
+            MessageStream stream(fd);
+            BenchResult result;
+            bool ok = fd >= 0 && !client_handshake(stream, options.workload == "fds").empty();
+
+            if (!ok) {
+                std::cerr << "Failed to connect to " << (options.direct ? bus_path : proxy_socket) << "\n";
+            } else if (options.workload == "signals") {
+                ok = run_signals(stream, options, &result);
+            } else {
+                ok = run_calls(stream, options, options.workload == "fds", &result);
+            }
+
+            if (ok) {
+                std::ostringstream json;
+                write_result(json, options, result, options.direct ? 0 : process_rss(proxy.pid));
+                std::cout << json.str();
+                if (!options.output.empty()) {
+                    std::ofstream(options.output, std::ios::app) << json.str();
+                }
+                status = EXIT_SUCCESS;
+            }
+
+            stop_proxy(&proxy);
+        }
+        bus.stop();
+    }
+
+    std::filesystem::remove_all(dir);
+    return status;
+}
@@ -1,19 +1,28 @@
 #include <fstream>
 #include <cstdlib>
+#include <filesystem>
 #include <memory>
+#include <unordered_map>
 #include <sys/stat.h>
 #include <algorithm>
 #include <sstream>
 #include <unistd.h>
 #include <errno.h>
 #include <cstring>
+#include <climits>
 #include <locale.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include <glib.h>
 #include <glib-unix.h>
 #include <giomm.h>
 
 #include "headers/flatpak-proxy-client.h"
+#include "headers/policy-args.h"
 
 #ifndef TEMP_FAILURE_RETRY
 # define TEMP_FAILURE_RETRY(expression) \
@@ -27,6 +36,45 @@
 static const char *argv0;
 static std::list<FlatpakProxy*> proxies;
 static int sync_fd = -1;
+static std::string daemon_path;
+static bool daemon_socket_inherited = false;
+
+// Largest daemon request accepted; big policies belong in --policy-file.
+#define DAEMON_MAX_REQUEST (1024 * 1024)
+
+// A control connection whose request has not fully arrived yet.
+struct DaemonRequest {
+    GSocketConnection *connection = nullptr;
+    GSource *source = nullptr;
+    std::vector<uint8_t> data;
+    int sync_fd = -1;
+};
+
+// A proxy started over the control socket. It lives until its sync fd,
+// or the control connection if the requester sent none, is closed.
+struct DaemonProxy {
+    FlatpakProxy *proxy = nullptr;
+    std::string socket_path;
+    GSocketConnection *connection = nullptr;
+    int sync_fd = -1;
+};
+
+// Where systemd socket activation puts the first passed fd.
+#define SD_LISTEN_FDS_START 3
+
+// A listening socket passed by systemd socket activation. It goes to the
+// proxy, or the --daemon control socket, whose path it is bound to or
+// named after with FileDescriptorName=.
+struct InheritedSocket {
+    int fd = -1;
+    std::string name;
+    std::string path;
+    bool taken = false;
+};
+
+static std::list<DaemonProxy*> daemon_proxies;
+static std::vector<InheritedSocket> inherited_sockets;
+static std::unordered_map<std::string, std::weak_ptr<PolicyTable>> shared_policies;
 
 static void usage(int ecode, std::ostream *out) {
     *out << "usage: " << argv0 << " [OPTIONS...] [ADDRESS PATH [OPTIONS...] ...]\n\n";
@@ -34,16 +82,43 @@ static void usage(int ecode, std::ostream *out) {
             "    --help                       Print this help\n"
             "    --version                    Print version\n"
             "    --fd=FD                      Stop when FD is closed\n"
-            "    --args=FD                    Read arguments from FD\n\n"
+            "    --args=FD                    Read arguments from FD\n"
+            "    --daemon=PATH                Start proxies on request from a control socket at PATH\n\n"
             "Proxy Options:\n"
             "    --filter                     Enable filtering\n"
             "    --log                        Turn on logging\n"
             "    --sloppy-names               Report name changes for unique names\n"
+            "    --coalesce-properties        Merge PropertiesChanged signals still queued for\n"
+            "                                 a client into the next one for the same properties\n"
             "    --see=NAME                   Set 'see' policy for NAME\n"
             "    --talk=NAME                  Set 'talk' policy for NAME\n"
             "    --own=NAME                   Set 'own' policy for NAME\n"
             "    --call=NAME=RULE             Set RULE for calls on NAME\n"
-            "    --broadcast=NAME=RULE        Set RULE for broadcasts from NAME\n";
+            "    --broadcast=NAME=RULE        Set RULE for broadcasts from NAME\n"
+            "    --high-watermark=BYTES       Pause the sender when a queue exceeds BYTES\n"
+            "    --low-watermark=BYTES        Resume the sender once a queue drains to BYTES\n"
+            "    --max-client-memory=[SOFT:]HARD  Warn at SOFT, disconnect at HARD bytes per client\n"
+            "    --reply-timeout=SECONDS      Forget unanswered calls after SECONDS (0 = never, the default)\n"
+            "    --cut-through=BYTES          Stream the body of messages of at least BYTES once\n"
+            "                                 the header has been allowed (0 = never)\n"
+            "    --idle-trim=SECONDS          Free buffers of clients idle for SECONDS (0 = never)\n"
+            "    --listen-fd=FD               Accept clients on the listening socket FD instead\n"
+            "                                 of binding PATH\n"
+            "    --stats-socket=PATH          Serve JSON statistics on a Unix socket at PATH\n"
+            "    --capture=FILE               Record every framed message to FILE, which must\n"
+            "                                 not exist yet\n"
+            "    --policy-args=FILE           Read more --see/--talk/--own/--call/--broadcast\n"
+            "                                 rules from FILE, and re-read them on SIGHUP\n"
+            "    --policy-file=FILE           Map a policy compiled by xdg-dbus-proxy-policy-compile,\n"
+            "                                 and map it again on SIGHUP\n\n"
+            "A --daemon request is the arguments of one proxy, ADDRESS PATH [OPTIONS...],\n"
+            "each NUL-terminated and followed by an empty argument. The proxy stops when\n"
+            "an fd passed with the request, or else the connection, is closed; \"x\" is\n"
+            "written to it once the proxy is listening.\n\n"
+            "Listening sockets passed by systemd socket activation (LISTEN_FDS) are used\n"
+            "by the proxy or --daemon whose PATH they are bound to or named after\n"
+            "(FileDescriptorName=), so clients can connect before the proxy has started.\n\n"
+            "Send SIGUSR1 to print latency percentiles to stderr.\n";
     exit(ecode);
 }
 
@@ -90,18 +165,93 @@ std::vector<uint8_t> fd_readall_bytes(int fd) {
 }
 
 void add_args(const std::vector<uint8_t> &data, std::vector<std::string> &args, size_t pos) {
+    std::vector<std::string> new_args;
     size_t start = 0;
     
     for (size_t i = 0; i <= data.size(); ++i) {
         if (i == data.size() || data[i] == '\0') {
             if (i > start) {
-                std::string arg(data.begin() + start, data.begin() + i);
-                args.insert(args.begin() + pos, arg);
-                ++pos;
+                new_args.emplace_back(data.begin() + start, data.begin() + i);
             }
             start = i + 1;
         }
     }
+
+    // One insert, so a large --args file does not shift the tail per argument.
+    args.insert(args.begin() + pos,
+                std::make_move_iterator(new_args.begin()),
+                std::make_move_iterator(new_args.end()));
+}
+
+// Picks up the sockets systemd passed, if they are meant for this process,
+// and clears the variables so nothing started later mistakes them for its
+// own.
+static void collect_inherited_sockets() {
+    const char *pid_s = getenv("LISTEN_PID");
+    const char *fds_s = getenv("LISTEN_FDS");
+    const char *names_s = getenv("LISTEN_FDNAMES");
+
+    if (pid_s && fds_s && strtol(pid_s, nullptr, 10) == getpid()) {
+        char *endptr;
+        long n_fds = strtol(fds_s, &endptr, 10);
+
+        std::vector<std::string> names;
+        if (names_s) {
+            std::istringstream names_in(names_s);
+            std::string name;
+            while (std::getline(names_in, name, ':')) {
+                names.push_back(name);
+            }
+        }
+
+        if (n_fds <= 0 || n_fds > INT_MAX - SD_LISTEN_FDS_START || endptr == fds_s || *endptr != '\0') {
+            std::cerr << "Ignoring invalid LISTEN_FDS " << fds_s << "\n";
+            n_fds = 0;
+        }
+
+        for (long i = 0; i < n_fds; ++i) {
+            InheritedSocket inherited;
+            inherited.fd = SD_LISTEN_FDS_START + static_cast<int>(i);
+            fcntl(inherited.fd, F_SETFD, FD_CLOEXEC);
+            if (static_cast<size_t>(i) < names.size()) {
+                inherited.name = names[i];
+            }
+
+            struct sockaddr_un addr;
+            socklen_t len = sizeof(addr);
+            if (getsockname(inherited.fd, reinterpret_cast<struct sockaddr *>(&addr), &len) == 0 &&
+                addr.sun_family == AF_UNIX && len > offsetof(struct sockaddr_un, sun_path) && addr.sun_path[0] != '\0') {
+                inherited.path.assign(addr.sun_path, strnlen(addr.sun_path, len - offsetof(struct sockaddr_un, sun_path)));
+            }
+            inherited_sockets.push_back(std::move(inherited));
+        }
+    }
+
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+}
+
+// The inherited socket for `path`, or -1 if none was passed for it.
+static int take_inherited_socket(const std::string &path) {
+    for (auto &inherited : inherited_sockets) {
+        if (!inherited.taken && (inherited.path == path || inherited.name == path)) {
+            inherited.taken = true;
+            return inherited.fd;
+        }
+    }
+    return -1;
+}
+
+static void close_unused_inherited_sockets() {
+    for (auto &inherited : inherited_sockets) {
+        if (!inherited.taken) {
+            std::cerr << "No proxy for inherited socket " << inherited.fd << " ("
+                      << (inherited.path.empty() ? inherited.name : inherited.path) << "), closing it\n";
+            close(inherited.fd);
+        }
+    }
+    inherited_sockets.clear();
 }
 
 bool parse_generic_args(std::vector<std::string> &args, size_t &args_i) {
@@ -125,6 +275,15 @@ bool parse_generic_args(std::vector<std::string> &args, size_t &args_i) {
         }
         
         sync_fd = fd;
+        ++args_i;
+        return true;
+    } else if (arg.starts_with("--daemon=")) {
+        daemon_path = arg.substr(strlen("--daemon="));
+        if (daemon_path.empty()) {
+            std::cerr << "No control socket path given\n";
+            return false;
+        }
+
         ++args_i;
         return true;
     } else if (arg.starts_with("--args=")) {
@@ -154,22 +313,39 @@ bool parse_generic_args(std::vector<std::string> &args, size_t &args_i) {
     }
 }
 
-static bool start_proxy(std::vector<std::string> &args, size_t &args_i) {
+static bool parse_size(const std::string &size_s, size_t *out) {
+    char *endptr;
+    unsigned long long size = strtoull(size_s.c_str(), &endptr, 10);
+
+    if (size_s.empty() || size_s[0] == '-' || endptr == size_s.c_str() || *endptr != '\0') {
+        std::cerr << "Invalid size " << size_s << "\n";
+        return false;
+    }
+
+    *out = static_cast<size_t>(size);
+    return true;
+}
+
+// Parses one proxy's arguments and starts it. Daemon requests pass
+// allow_generic_args = false, so they cannot use --fd, --args and friends.
+static FlatpakProxy *start_proxy(std::vector<std::string> &args, size_t &args_i, bool allow_generic_args) {
     if (args_i >= args.size() || args[args_i][0] == '-') {
         std::cerr << "No bus address given\n";
-        return false;
+        return nullptr;
     }
 
     std::string bus_address = args[args_i++];
 
     if (args_i >= args.size() || args[args_i][0] == '-') {
         std::cerr << "No socket path given\n";
-        return false;
+        return nullptr;
     }
 
     std::string socket_path = args[args_i++];
 
-    auto proxy = new FlatpakProxy(bus_address, socket_path);
+    auto proxy = std::make_unique<FlatpakProxy>(bus_address, socket_path);
+    size_t high_watermark = DEFAULT_HIGH_WATERMARK;
+    size_t low_watermark = DEFAULT_LOW_WATERMARK;
 
     while (args_i < args.size()) {
         const std::string &temp_arg = args[args_i];
@@ -177,89 +353,431 @@ static bool start_proxy(std::vector<std::string> &args, size_t &args_i) {
         if (temp_arg[0] != '-')
             break;
 
-        if (temp_arg.starts_with("--see=") ||
-            temp_arg.starts_with("--talk=") ||
-            temp_arg.starts_with("--own=")) {
-            
-            FlatpakPolicy policy = FLATPAK_POLICY_SEE;
-            std::string name = temp_arg.substr(temp_arg.find('=') + 1);
-            bool wildcard = false;
-
-            if (temp_arg[2] == 't')
-                policy = FLATPAK_POLICY_TALK;
-            else if (temp_arg[2] == 'o')
-                policy = FLATPAK_POLICY_OWN;
-
-            if (name.ends_with(".*")) {
-                name.resize(name.size() - 2);
-                wildcard = true;
+        PolicyArgResult policy_res = apply_policy_arg(proxy.get(), temp_arg);
+        if (policy_res == POLICY_ARG_INVALID) {
+            return nullptr;
+        } else if (policy_res == POLICY_ARG_APPLIED) {
+            ++args_i;
+        } else if (temp_arg.starts_with("--high-watermark=")) {
+            if (!parse_size(temp_arg.substr(temp_arg.find('=') + 1), &high_watermark))
+                return nullptr;
+            ++args_i;
+        } else if (temp_arg.starts_with("--max-client-memory=")) {
+            std::string limits = temp_arg.substr(temp_arg.find('=') + 1);
+            size_t colon = limits.find(':');
+            size_t soft = 0;
+            size_t hard = 0;
+
+            if (colon != std::string::npos) {
+                if (!parse_size(limits.substr(0, colon), &soft) ||
+                    !parse_size(limits.substr(colon + 1), &hard))
+                    return nullptr;
+            } else {
+                if (!parse_size(limits, &hard))
+                    return nullptr;
+                soft = hard / 4 * 3;
             }
 
-            if (name.empty() || name[0] == ':') {
-                std::cerr << "'" << name << "' is not a valid dbus name\n";
-                return false;
+            if (soft > hard) {
+                std::cerr << "Soft client memory limit exceeds hard limit\n";
+                return nullptr;
             }
 
-            proxy->add_policy(name, wildcard, policy);
+            proxy->set_client_memory_limits(soft, hard);
             ++args_i;
-        } else if (temp_arg.starts_with("--call=") ||
-                   temp_arg.starts_with("--broadcast=")) {
-            
-            std::string rest = temp_arg.substr(temp_arg.find('=') + 1);
-            size_t name_end = rest.find('=');
-            bool wildcard = false;
-
-            if (name_end == std::string::npos) {
-                std::cerr << "'" << rest << "' is not a valid name + rule\n";
-                return false;
+        } else if (temp_arg.starts_with("--stats-socket=")) {
+            std::string path = temp_arg.substr(strlen("--stats-socket="));
+            if (path.empty()) {
+                std::cerr << "No stats socket path given\n";
+                return nullptr;
             }
-
-            std::string name = rest.substr(0, name_end);
-            std::string rule = rest.substr(name_end + 1);
-
-            if (name.ends_with(".*")) {
-                name.resize(name.size() - 2);
-                wildcard = true;
+            proxy->set_stats_socket(path);
+            ++args_i;
+        } else if (temp_arg.starts_with("--capture=")) {
+            std::string path = temp_arg.substr(strlen("--capture="));
+            if (path.empty()) {
+                std::cerr << "No capture file given\n";
+                return nullptr;
             }
-
-            if (temp_arg.starts_with("--call="))
-                proxy->add_call_rule(name, wildcard, rule);
-            else
-                proxy->add_broadcast_rule(name, wildcard, rule);
-
+            proxy->set_capture(path);
+            ++args_i;
+        } else if (temp_arg.starts_with("--policy-args=")) {
+            std::string path = temp_arg.substr(strlen("--policy-args="));
+            if (path.empty()) {
+                std::cerr << "No policy file given\n";
+                return nullptr;
+            }
+            proxy->set_policy_args(path);
+            ++args_i;
+        } else if (temp_arg.starts_with("--policy-file=")) {
+            std::string path = temp_arg.substr(strlen("--policy-file="));
+            if (path.empty()) {
+                std::cerr << "No policy file given\n";
+                return nullptr;
+            }
+            proxy->set_policy_file(path);
+            ++args_i;
+        } else if (temp_arg.starts_with("--reply-timeout=")) {
+            size_t timeout;
+            if (!parse_size(temp_arg.substr(temp_arg.find('=') + 1), &timeout) || timeout > G_MAXUINT32) {
+                std::cerr << "Invalid reply timeout\n";
+                return nullptr;
+            }
+            proxy->set_reply_timeout(static_cast<unsigned int>(timeout));
             ++args_i;
-        } else if (temp_arg == "--log") {
-            proxy->set_log_messages(true);
+        } else if (temp_arg.starts_with("--cut-through=")) {
+            size_t threshold;
+            if (!parse_size(temp_arg.substr(temp_arg.find('=') + 1), &threshold))
+                return nullptr;
+            proxy->set_cut_through(threshold);
             ++args_i;
-        } else if (temp_arg == "--filter") {
-            proxy->set_filter(true);
+        } else if (temp_arg.starts_with("--idle-trim=")) {
+            size_t seconds;
+            if (!parse_size(temp_arg.substr(temp_arg.find('=') + 1), &seconds) || seconds > G_MAXUINT32) {
+                std::cerr << "Invalid idle trim interval\n";
+                return nullptr;
+            }
+            proxy->set_idle_trim(static_cast<unsigned int>(seconds));
             ++args_i;
-        } else if (temp_arg == "--sloppy-names") {
-            proxy->set_sloppy_names(true);
+        } else if (temp_arg.starts_with("--listen-fd=") && allow_generic_args) {
+            std::string fd_s = temp_arg.substr(strlen("--listen-fd="));
+            char *endptr;
+            long fd = strtol(fd_s.c_str(), &endptr, 10);
+
+            if (fd < 0 || fd > INT_MAX || endptr == fd_s.c_str() || *endptr != '\0') {
+                std::cerr << "Invalid --listen-fd " << fd_s << "\n";
+                return nullptr;
+            }
+            proxy->set_listen_fd(static_cast<int>(fd));
             ++args_i;
+        } else if (temp_arg.starts_with("--low-watermark=")) {
+            if (!parse_size(temp_arg.substr(temp_arg.find('=') + 1), &low_watermark))
+                return nullptr;
+            ++args_i;
+        } else if (!allow_generic_args) {
+            std::cerr << "Argument " << temp_arg << " is not allowed here\n";
+            return nullptr;
         } else {
             if (!parse_generic_args(args, args_i))
-                return false;
+                return nullptr;
         }
     }
 
+    if (high_watermark == 0 || low_watermark > high_watermark) {
+        std::cerr << "Low watermark must not exceed a non-zero high watermark\n";
+        return nullptr;
+    }
+    proxy->set_watermarks(high_watermark, low_watermark);
+
+    if (allow_generic_args && proxy->listen_fd < 0) {
+        proxy->set_listen_fd(take_inherited_socket(socket_path));
+    }
+
     if (!proxy->start()) {
         std::cerr << "Failed to start proxy for " << bus_address << "\n";
-        return false;
+        proxy->stop();
+        return nullptr;
     }
-    
+
+    return proxy.release();
+}
+
+// Points `proxy` at an already loaded table with the same rules, if there
+// is one. Sandboxes of one app, or of apps with the usual portal and a11y
+// names, then hold a single copy of their policy between them.
+static void share_policy(FlatpakProxy *proxy) {
+    std::erase_if(shared_policies, [](const auto &entry) { return entry.second.expired(); });
+
+    std::weak_ptr<PolicyTable> &shared = shared_policies[proxy->policy->key()];
+    if (auto table = shared.lock()) {
+        proxy->policy = table;
+    } else {
+        shared = proxy->policy;
+    }
+}
+
+static void stop_proxy(FlatpakProxy *proxy) {
+    proxy->stop();
+    proxy->close_clients();
+    proxies.remove(proxy);
+    delete proxy;
+}
+
+static void finish_daemon_request(DaemonRequest *request) {
+    g_source_destroy(request->source);
+    g_source_unref(request->source);
+    if (request->sync_fd >= 0) {
+        close(request->sync_fd);
+    }
+    if (request->connection) {
+        g_object_unref(request->connection);
+    }
+    delete request;
+}
+
+static gboolean daemon_sync_closed_cb(gint, GIOCondition, gpointer data) {
+    auto daemon_proxy = static_cast<DaemonProxy *>(data);
+
+    std::cerr << "Requester of " << daemon_proxy->socket_path << " went away, stopping its proxy\n";
+    stop_proxy(daemon_proxy->proxy);
+    daemon_proxies.remove(daemon_proxy);
+
+    if (daemon_proxy->connection) {
+        g_object_unref(daemon_proxy->connection);
+    } else {
+        close(daemon_proxy->sync_fd);
+    }
+    delete daemon_proxy;
+    return G_SOURCE_REMOVE;
+}
+
+// Spells `path` the way the file system resolves it, so that two names
+// for one socket compare equal.
+static std::string normalize_socket_path(const std::string& path) {
+    std::error_code error;
+    std::filesystem::path absolute = std::filesystem::absolute(path, error);
+    if (error) {
+        return std::filesystem::path(path).lexically_normal();
+    }
+
+    std::filesystem::path resolved = std::filesystem::weakly_canonical(absolute, error);
+    return error ? absolute.lexically_normal() : resolved;
+}
+
+// Whether `path` is the daemon's socket or a socket or stats socket of a
+// running proxy.
+static bool socket_path_in_use(const std::string& path) {
+    std::string normalized = normalize_socket_path(path);
+    if (normalized == normalize_socket_path(daemon_path)) {
+        return true;
+    }
+
+    return std::any_of(proxies.begin(), proxies.end(), [&](FlatpakProxy *other) {
+        return normalize_socket_path(other->get_socket_path()) == normalized ||
+               (!other->get_stats_socket_path().empty() &&
+                normalize_socket_path(other->get_stats_socket_path()) == normalized);
+    });
+}
+
+static void handle_daemon_request(DaemonRequest *request) {
+    std::vector<std::string> args;
+    size_t args_i = 0;
+    add_args(request->data, args, 0);
+
+    // Starting a proxy removes whatever is at its socket and stats socket
+    // paths first, so a request must not be able to take over a socket of
+    // any running proxy, or the daemon's own, nor give both of its own
+    // sockets one path.
+    if (args.size() >= 2) {
+        std::vector<std::string> paths = {args[1]};
+        for (size_t i = 2; i < args.size(); ++i) {
+            if (args[i].starts_with("--stats-socket=") && args[i].size() > strlen("--stats-socket=")) {
+                paths.push_back(args[i].substr(strlen("--stats-socket=")));
+            }
+        }
+
+        for (size_t i = 0; i < paths.size(); ++i) {
+            bool repeated = std::any_of(paths.begin(), paths.begin() + i, [&](const std::string& earlier) {
+                return normalize_socket_path(earlier) == normalize_socket_path(paths[i]);
+            });
+            if (repeated || socket_path_in_use(paths[i])) {
+                std::cerr << "Daemon request for " << paths[i] << ", which is already in use\n";
+                finish_daemon_request(request);
+                return;
+            }
+        }
+    }
+
+    FlatpakProxy *proxy = start_proxy(args, args_i, false);
+    if (proxy && args_i < args.size()) {
+        std::cerr << "Daemon request must start exactly one proxy\n";
+        proxy->stop();
+        delete proxy;
+        proxy = nullptr;
+    }
+    if (!proxy) {
+        finish_daemon_request(request);
+        return;
+    }
+
+    share_policy(proxy);
     proxies.push_front(proxy);
+
+    auto daemon_proxy = new DaemonProxy();
+    daemon_proxy->proxy = proxy;
+    daemon_proxy->socket_path = args[1];
+
+    int fd;
+    if (request->sync_fd >= 0) {
+        daemon_proxy->sync_fd = std::exchange(request->sync_fd, -1);
+        fd = daemon_proxy->sync_fd;
+    } else {
+        daemon_proxy->connection = std::exchange(request->connection, nullptr);
+        fd = g_socket_get_fd(g_socket_connection_get_socket(daemon_proxy->connection));
+    }
+
+    if (write(fd, "x", 1) != 1) {
+        std::cerr << "Can't write to sync socket\n";
+    }
+    g_unix_fd_add(fd, static_cast<GIOCondition>(G_IO_ERR | G_IO_HUP), daemon_sync_closed_cb, daemon_proxy);
+    daemon_proxies.push_back(daemon_proxy);
+
+    std::cerr << "Started proxy for " << proxy->dbus_address << " at " << daemon_proxy->socket_path
+              << " (" << daemon_proxies.size() << " running, " << shared_policies.size() << " policies)\n";
+    finish_daemon_request(request);
+}
+
+static gboolean daemon_request_cb(GSocket *socket, GIOCondition, gpointer data) {
+    auto request = static_cast<DaemonRequest *>(data);
+
+    while (true) {
+        char chunk[4096];
+        GInputVector vec = {chunk, sizeof(chunk)};
+        GSocketControlMessage **messages = nullptr;
+        int n_messages = 0;
+        GError *error = nullptr;
+
+        gssize res = g_socket_receive_message(socket, nullptr, &vec, 1, &messages, &n_messages, nullptr, nullptr, &error);
+
+        for (int i = 0; i < n_messages; ++i) {
+            if (G_IS_UNIX_FD_MESSAGE(messages[i])) {
+                int n_fds = 0;
+                int *fds = g_unix_fd_list_steal_fds(g_unix_fd_message_get_fd_list(G_UNIX_FD_MESSAGE(messages[i])), &n_fds);
+                for (int j = 0; j < n_fds; ++j) {
+                    if (request->sync_fd < 0) {
+                        request->sync_fd = fds[j];
+                    } else {
+                        close(fds[j]);
+                    }
+                }
+                g_free(fds);
+            }
+            g_object_unref(messages[i]);
+        }
+        g_free(messages);
+
+        if (res < 0) {
+            if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+                g_error_free(error);
+                return G_SOURCE_CONTINUE;
+            }
+            std::cerr << "Failed to read daemon request: " << error->message << "\n";
+            g_error_free(error);
+            finish_daemon_request(request);
+            return G_SOURCE_REMOVE;
+        }
+
+        if (res == 0) {
+            std::cerr << "Daemon request closed before it was complete\n";
+            finish_daemon_request(request);
+            return G_SOURCE_REMOVE;
+        }
+
+        request->data.insert(request->data.end(), chunk, chunk + res);
+        if (request->data.size() > DAEMON_MAX_REQUEST) {
+            std::cerr << "Daemon request too large\n";
+            finish_daemon_request(request);
+            return G_SOURCE_REMOVE;
+        }
+
+        size_t size = request->data.size();
+        if (size >= 2 && request->data[size - 1] == '\0' && request->data[size - 2] == '\0') {
+            handle_daemon_request(request);
+            return G_SOURCE_REMOVE;
+        }
+    }
+}
+
+static gboolean daemon_incoming_cb(GSocketService *, GSocketConnection *connection, GObject *, gpointer) {
+    GSocket *socket = g_socket_connection_get_socket(connection);
+    g_socket_set_blocking(socket, FALSE);
+
+    auto request = new DaemonRequest();
+    request->connection = G_SOCKET_CONNECTION(g_object_ref(connection));
+    request->source = g_socket_create_source(socket, G_IO_IN, nullptr);
+    g_source_set_callback(request->source, G_SOURCE_FUNC(daemon_request_cb), request, nullptr);
+    g_source_attach(request->source, nullptr);
+    return TRUE;
+}
+
+static bool start_daemon() {
+    GError *error = nullptr;
+    GSocketService *service = g_socket_service_new();
+    bool res;
+
+    int inherited_fd = take_inherited_socket(daemon_path);
+    daemon_socket_inherited = inherited_fd >= 0;
+    if (daemon_socket_inherited) {
+        // The socket unit decides who may connect.
+        GSocket *socket = g_socket_new_from_fd(inherited_fd, &error);
+        res = socket && g_socket_listener_add_socket(G_SOCKET_LISTENER(service), socket, nullptr, &error);
+        if (socket) {
+            g_object_unref(socket);
+        }
+    } else {
+        std::filesystem::remove(daemon_path);
+
+        GSocketAddress *address = g_unix_socket_address_new(daemon_path.c_str());
+
+        // Requests name arbitrary sockets and files, so only our user may send them.
+        mode_t old_umask = umask(0077);
+        res = g_socket_listener_add_address(
+            G_SOCKET_LISTENER(service),
+            address,
+            G_SOCKET_TYPE_STREAM,
+            G_SOCKET_PROTOCOL_DEFAULT,
+            nullptr,
+            nullptr,
+            &error
+        );
+        umask(old_umask);
+        g_object_unref(address);
+    }
+
+    if (!res) {
+        std::cerr << "Failed to listen on " << daemon_path << ": " << error->message << "\n";
+        g_error_free(error);
+        g_object_unref(service);
+        return false;
+    }
+
+    g_signal_connect(service, "incoming", G_CALLBACK(daemon_incoming_cb), nullptr);
+    g_socket_service_start(service);
+    std::cerr << "Accepting proxy requests on " << daemon_path << "\n";
     return true;
 }
 
+
+
 gboolean sync_closed_cb(GIOChannel *, GIOCondition, gpointer) {
-    for (auto proxy : proxies) {
-        proxy->stop();
-        delete proxy;
+    while (!proxies.empty()) {
+        stop_proxy(proxies.front());
+    }
+    if (!daemon_path.empty() && !daemon_socket_inherited) {
+        std::filesystem::remove(daemon_path);
     }
     exit(0);
 }
 
+gboolean dump_latency_cb(gpointer) {
+    for (auto proxy : proxies) {
+        std::cerr << "Latency for " << proxy->dbus_address << ":\n";
+        proxy->latency.dump(std::cerr);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+// Re-reads every proxy's --policy-args file. Connected clients stay up and
+// switch to the new rules with their next message.
+gboolean reload_policy_cb(gpointer) {
+    for (auto proxy : proxies) {
+        if (proxy->has_policy_source() && proxy->reload_policy()) {
+            share_policy(proxy);
+        }
+    }
+    return G_SOURCE_CONTINUE;
+}
+
 int main(int argc, char *argv[]) {
     Glib::init();
     Gio::init();
@@ -274,6 +792,8 @@ int main(int argc, char *argv[]) {
         usage(EXIT_FAILURE, &std::cerr);
     }
 
+    collect_inherited_sockets();
+
     while (args_i < args.size()) {
         const std::string &arg = args[args_i];
         
@@ -282,13 +802,21 @@ int main(int argc, char *argv[]) {
                 return EXIT_FAILURE;
             }
         } else {
-            if (!start_proxy(args, args_i)) {
+            FlatpakProxy *proxy = start_proxy(args, args_i, true);
+            if (!proxy) {
                 return EXIT_FAILURE;
             }
+            share_policy(proxy);
+            proxies.push_front(proxy);
         }
     }
 
-    if (proxies.empty()) {
+    if (!daemon_path.empty() && !start_daemon()) {
+        return EXIT_FAILURE;
+    }
+    close_unused_inherited_sockets();
+
+    if (proxies.empty() && daemon_path.empty()) {
         std::cerr << "No proxies specified\n";
         return EXIT_FAILURE;
     }
@@ -306,6 +834,14 @@ int main(int argc, char *argv[]) {
                        nullptr);
     }
 
+    g_unix_signal_add(SIGUSR1, dump_latency_cb, nullptr);
+
+    // Without a policy file SIGHUP keeps its default action. A daemon may
+    // be asked for proxies that have one at any time.
+    if (!daemon_path.empty() || std::any_of(proxies.begin(), proxies.end(), [](FlatpakProxy *proxy) { return proxy->has_policy_source(); })) {
+        g_unix_signal_add(SIGHUP, reload_policy_cb, nullptr);
+    }
+
     GMainLoop *main_loop = g_main_loop_new(nullptr, FALSE);
     g_main_loop_run(main_loop);
     g_main_loop_unref(main_loop);
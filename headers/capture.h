@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+// Capture files hold every message framed by a proxy, per client and
+// direction, in host byte order:
+//
+//   CaptureFileHeader
+//   CaptureRecord, message bytes, zero padding to CAPTURE_ALIGN
+//   CaptureRecord, ...
+//
+// Records and message bytes are 8-byte aligned, so a reader can mmap the
+// file and walk it in place. A file cut short by a crash simply ends at the
+// last complete record.
+
+#define CAPTURE_MAGIC "XDBPCAP1"
+#define CAPTURE_BYTE_ORDER_MARK 0x01020304u
+#define CAPTURE_ALIGN 8
+#define CAPTURE_WRITE_BUFFER (1024 * 1024)
+
+typedef enum {
+    CAPTURE_FROM_CLIENT,
+    CAPTURE_FROM_BUS,
+} CaptureDirection;
+
+struct CaptureFileHeader {
+    char magic[8];
+    uint32_t byte_order_mark;
+    uint32_t record_align;
+    int64_t start_realtime_ns;
+};
+
+struct CaptureRecord {
+    uint64_t timestamp_ns;      // since the capture started, monotonic
+    uint32_t client_id;
+    uint32_t length;            // message bytes following the record
+    uint16_t n_fds;             // fds received along with the message
+    uint8_t direction;          // CaptureDirection
+    uint8_t reserved[5];
+};
+
+static_assert(sizeof(CaptureFileHeader) % CAPTURE_ALIGN == 0, "capture header must keep records aligned");
+static_assert(sizeof(CaptureRecord) % CAPTURE_ALIGN == 0, "capture records must stay aligned");
+
+inline size_t capture_padded(size_t length) {
+    return (length + CAPTURE_ALIGN - 1) & ~static_cast<size_t>(CAPTURE_ALIGN - 1);
+}
+
+class CaptureWriter {
+public:
+    ~CaptureWriter();
+
+    bool open(const std::string& path);
+    void record(uint32_t client_id, CaptureDirection direction,
+                const uint8_t *data, size_t length, size_t n_fds);
+    void close();
+
+private:
+    FILE *file = nullptr;
+    int64_t start_ns = 0;
+};
+
+class CaptureReader {
+public:
+    ~CaptureReader();
+
+    bool open(const std::string& path);
+    // Next complete record, or nullptr at the end of the capture. The
+    // message bytes follow the record directly.
+    const CaptureRecord *next();
+
+    const CaptureFileHeader *header() const {
+        return reinterpret_cast<const CaptureFileHeader *>(map);
+    }
+
+    static const uint8_t *message_data(const CaptureRecord *record) {
+        return reinterpret_cast<const uint8_t *>(record + 1);
+    }
+
+    void rewind() {
+        offset = sizeof(CaptureFileHeader);
+    }
+
+private:
+    const uint8_t *map = nullptr;
+    size_t map_size = 0;
+    size_t offset = 0;
+};
@@ -2,13 +2,22 @@
 
 #include <cassert>
 #include <filesystem>
+#include <functional>
 #include <iostream>
 #include <unordered_map>
+#include <unordered_set>
 #include <string>
 #include <vector>
 #include <list>
+#include <deque>
 #include <memory>
 
+#include "capture.h"
+#include "latency-histogram.h"
+#include "output-queue.h"
+#include "policy-image.h"
+#include "serial-table.h"
+
 #include <glibmm.h>
 #include <giomm/socketservice.h>
 #include <gio/gdbusaddress.h>
@@ -40,6 +49,11 @@ typedef enum {
     EXPECTED_REPLY_REWRITE,
 } ExpectedReplyType;
 
+struct ExpectedReply {
+    ExpectedReplyType type = EXPECTED_REPLY_NONE;
+    int64_t queued_at = 0;
+};
+
 typedef enum {
     AUTH_WAITING_FOR_BEGIN,
     AUTH_WAITING_FOR_BACKLOG,
@@ -66,7 +80,35 @@ typedef enum {
     FLATPAK_POLICY_OWN
 } FlatpakPolicy;
 
+#define N_BUS_HANDLERS (HANDLE_VALIDATE_MATCH + 1)
+
+// The name each BusHandler is reported under, defined in stats.cpp.
+extern const char *const handler_names[N_BUS_HANDLERS];
+
 #define MAX_CLIENT_SERIAL (G_MAXUINT32 - 65536)
+#define AUTH_SCRATCH_SIZE (16 * 1024)
+#define DEFAULT_HIGH_WATERMARK (4 * 1024 * 1024)
+#define DEFAULT_LOW_WATERMARK (1024 * 1024)
+#define REWRITE_REPLY_ESTIMATE 512
+#define DEFAULT_REPLY_TIMEOUT 0
+#define DEFAULT_IDLE_TRIM 30
+#define CUT_THROUGH_CHUNK (64 * 1024)
+#define BROADCAST_CACHE_MAX_ENTRIES 4096
+#define DEPARTED_NAMES_KEPT 1024
+
+struct ProxyStats {
+    uint64_t messages_from_client = 0;
+    uint64_t bytes_from_client = 0;
+    uint64_t messages_from_bus = 0;
+    uint64_t bytes_from_bus = 0;
+    uint64_t handler_counts[N_BUS_HANDLERS] = {};
+    uint64_t replies_rewritten = 0;
+    uint64_t bus_messages_withheld = 0;
+    uint64_t messages_reordered = 0;
+    uint64_t properties_coalesced = 0;
+
+    void add(const ProxyStats& other);
+};
 
 class Filter {
 public:
@@ -84,6 +126,72 @@ public:
     std::string member;
 };
 
+// Whether broadcasts from the owner of a well-known name get through, for
+// one path, interface and member.
+struct BroadcastDecision {
+    FlatpakPolicy policy = FLATPAK_POLICY_NONE;
+    bool allowed = false;
+};
+
+struct BroadcastCacheEntry {
+    BroadcastDecision decision;
+    // This entry's place in PolicyTable::broadcast_lru.
+    std::list<const std::string *>::iterator lru;
+};
+
+// The filters a proxy enforces, keyed by name. A table is only filled in
+// before it is published; a policy reload builds a new table and swaps it
+// in, and each client moves over the next time it handles a message, so
+// the old table is freed once the last client has let go of it.
+//
+// Rules come from the command line and --policy-args into `filters`, and
+// from a compiled --policy-file into `image`; lookups go through find(),
+// which merges the two.
+class PolicyTable {
+public:
+    PolicyTable();
+    PolicyTable(const PolicyTable& other);
+    PolicyTable& operator=(const PolicyTable&) = delete;
+    ~PolicyTable();
+
+    void add_policy(const std::string& name, bool name_is_subtree, FlatpakPolicy policy);
+    void add_call_rule(const std::string& name, bool name_is_subtree, const std::string& rule);
+    void add_broadcast_rule(const std::string& name, bool name_is_subtree, const std::string& rule);
+    // The filters for exactly `name`, or nullptr if there are none.
+    const std::vector<Filter *> *find(const std::string& name) const;
+    // Calls `fn` once per name with rules, and whether any covers its subtree.
+    void for_each_name(const std::function<void(const std::string&, bool)>& fn) const;
+    bool has_name(const std::string& name, bool *subtree) const;
+    // The highest policy the rules for `name` or a parent subtree grant;
+    // the rules that apply are appended to `matched_filters`.
+    FlatpakPolicy max_policy(const std::string& name, std::vector<Filter *> *matched_filters) const;
+    // Decides a broadcast from the owner of `name`. The answer depends on
+    // nothing but the table, so it is cached here and shared by every
+    // client and every proxy using the table; a reload starts afresh.
+    BroadcastDecision broadcast_decision(const std::string& name, const std::string& path,
+                                         const std::string& interface, const std::string& member) const;
+    size_t n_rules() const;
+    // Equal for tables that enforce the same rules, so they can be shared.
+    std::string key() const;
+
+    std::unordered_map<std::string, std::vector<Filter *>> filters;
+    std::shared_ptr<const PolicyImage> image;
+
+private:
+    void add_filter(Filter *filter);
+
+    // Names from the image whose rules have been turned into Filters,
+    // together with their `filters`; only names present in the image get
+    // an entry, so lookups of arbitrary names cannot grow it.
+    mutable std::unordered_map<std::string, std::vector<Filter *>> image_filters;
+    mutable std::vector<Filter *> image_owned;
+    // broadcast_decision() results, keyed by name, path, interface and
+    // member joined with NULs.
+    mutable std::unordered_map<std::string, BroadcastCacheEntry> broadcast_decisions;
+    // The keys of broadcast_decisions, most recently used first.
+    mutable std::list<const std::string *> broadcast_lru;
+};
+
 class Buffer {
 public:
     Buffer(size_t size, Buffer *old = nullptr);
@@ -93,13 +201,15 @@ public:
     void unref();
     bool read(ProxySide *side, GSocket *socket);
     bool write(ProxySide *side, GSocket *socket);
+    void close_fds();
 
     size_t size;
     size_t pos;
     size_t sent;
+    int64_t framed_at = 0;
     bool send_credentials;
     std::vector<uint8_t> data;
-    std::list<GSocketControlMessage *> control_messages;
+    std::vector<int> fds;       // owned, passed on with the message by write()
     int buffer_id;
 
 private:
@@ -119,6 +229,11 @@ public:
     bool is_dbus_method_call();
     bool is_for_bus();
     bool client_message_generates_reply();
+    // The leading string arguments of the body, decoded from the wire the
+    // first time any stage asks, so the filters, the name tracking and the
+    // reply rewriting share one decode. nullptr unless the body starts
+    // with at least `n` strings.
+    const std::vector<std::string> *string_args(size_t n);
 
     Buffer *buffer = nullptr;
     bool big_endian = false;
@@ -136,6 +251,11 @@ public:
     bool has_reply_serial = false;
     uint32_t reply_serial = 0;
     uint32_t unix_fds = 0;
+    uint32_t body_offset = 0;
+
+private:
+    bool args_decoded = false;
+    std::vector<std::string> args;
 };
 
 class ProxySide {
@@ -154,9 +274,14 @@ public:
     
     void start_reading();
     void stop_reading();
+    void pause_reading();
+    void resume_reading();
     void side_closed();
     ProxySide *get_other_side();
     void got_buffer_from_side(Buffer *buffer);
+    void release_auth_scratch();
+    void cleanup();
+    void trim();
 
     std::shared_ptr<FlatpakProxyClient> client;
     GSocketConnection *connection = nullptr;
@@ -164,15 +289,31 @@ public:
     Buffer *header_buffer = nullptr;
     bool closed = false;
     bool got_first_byte = false;
-    std::vector<uint8_t> extra_input_data;
-    std::list<GSocketControlMessage *> control_messages;
-    std::unordered_map<uint32_t, ExpectedReplyType> expected_replies;
-    std::list<Buffer *> buffers;
+    std::vector<uint8_t> auth_scratch;
+    size_t auth_scratch_start = 0;
+    size_t auth_scratch_end = 0;
+    std::deque<int> fds;        // received, not yet claimed by a message
+    SerialTable<ExpectedReply> expected_replies;
+    OutputQueue buffers;
+    size_t queued_bytes = 0;
+    bool read_paused = false;
+    // Size of the message whose header is being read for cut-through, and
+    // body bytes of a cut-through message still to be forwarded.
+    size_t cut_through_size = 0;
+    size_t stream_remaining = 0;
+    gint64 paused_since = 0;
+    gint64 paused_time = 0;
+    size_t pause_count = 0;
     GSource *in_source = nullptr;
     GSource *out_source = nullptr;
+};
 
-private:
-    void cleanup();
+// Replies the proxy rewrites or answers itself. Only clients that run into
+// the name filters need these, so they are allocated on first use and
+// dropped again once an idle client has none outstanding.
+struct ReplyRewrites {
+    SerialTable<GDBusMessage *> rewrite_reply;
+    SerialTable<std::string> get_owner_reply;
 };
 
 class FlatpakProxyClient {
@@ -183,12 +324,24 @@ public:
     void init_side(std::shared_ptr<FlatpakProxyClient> self, GSocketConnection *client_conn);
     void got_buffer_from_client(Buffer *buffer);
     void got_buffer_from_bus(Buffer *buffer);
+    bool start_cut_through(ProxySide *side, Buffer *head, size_t total_size);
     
     FlatpakPolicy get_max_policy(const std::string& source);
     FlatpakPolicy get_max_policy_and_matched(const std::string& source, std::vector<Filter *> *matched_filters);
+    bool broadcast_allowed(Header *header, FlatpakPolicy *max_policy);
     Buffer *get_error_for_roundtrip(Header *header, const char *error_name);
     Buffer *get_bool_reply_for_roundtrip(Header *header, bool val);
     void add_unique_id_owned_name(const std::string& unique_id, const std::string& owned_name);
+    void remove_unique_id_owned_name(const std::string& unique_id, const std::string& owned_name);
+    void forget_unique_id(const std::string& unique_id);
+    void refresh_policy();
+    void queue_rewrite_reply(uint32_t serial, GDBusMessage *reply);
+    void expire_replies(uint32_t tick);
+    size_t memory_usage() const;
+    bool check_memory_quota();
+    void disconnect();
+    ReplyRewrites& get_rewrites();
+    void trim();
 
     ProxySide client_side;
     ProxySide bus_side;
@@ -198,18 +351,36 @@ public:
     size_t auth_replies = 0;
     uint32_t hello_serial = 0;
     uint32_t last_fake_serial = MAX_CLIENT_SERIAL;
-    std::vector<uint8_t> auth_buffer;
-    std::unordered_map<uint32_t, GDBusMessage *> rewrite_reply;
-    std::unordered_map<uint32_t, std::string> get_owner_reply;
+    std::unique_ptr<ReplyRewrites> rewrites;
+    size_t accounted_name_bytes = 0;
+    bool over_soft_limit = false;
+    std::string unique_name;
+    uint32_t id = 0;
+    ProxyStats stats;
+    std::shared_ptr<const PolicyTable> policy;
+    bool name_ops_queued = false;
+    int64_t last_active = 0;
+    bool trimmed = false;
 
 private:
     void update_unique_id_policy(const std::string& unique_id, FlatpakPolicy policy);
-    bool validate_arg0_name(Buffer *buffer, FlatpakPolicy required_policy, FlatpakPolicy *has_policy);
+    bool validate_arg0_name(Header *header, FlatpakPolicy required_policy, FlatpakPolicy *has_policy);
     
     std::unordered_map<std::string, FlatpakPolicy> unique_id_policy;
     std::unordered_map<std::string, std::vector<std::string>> unique_id_owned_names;
 };
 
+// The arguments of a NameOwnerChanged, and the body they were decoded from.
+struct NameOwnerChange {
+    uint8_t endianness = 0;
+    std::string signature;
+    std::vector<uint8_t> body;
+    bool valid = false;
+    std::string name;
+    std::string old_owner;
+    std::string new_owner;
+};
+
 class FlatpakProxy {
 public:
     FlatpakProxy(const std::string& dbus_address, const std::string& socket_path);
@@ -222,19 +393,90 @@ public:
     void stop();
     void set_filter(bool filter);
     void set_sloppy_names(bool sloppy_names);
+    void set_coalesce_properties(bool coalesce);
     void set_log_messages(bool log);
+    void set_watermarks(size_t high, size_t low);
+    void set_client_memory_limits(size_t soft, size_t hard);
+    void set_reply_timeout(unsigned int seconds);
+    void set_idle_trim(unsigned int seconds);
+    void set_cut_through(size_t threshold);
+    void set_listen_fd(int fd);
+    void set_stats_socket(const std::string& path);
+    void set_capture(const std::string& path);
+    void set_policy_args(const std::string& path);
+    void set_policy_file(const std::string& path);
+    bool has_policy_source() const;
+    const std::string& get_socket_path() const;
+    const std::string& get_stats_socket_path() const;
+    bool reload_policy();
+    void close_clients();
+    void release_client(std::shared_ptr<FlatpakProxyClient> client);
+    void trim_idle_clients();
     bool incoming_connection(GSocketService *service, GSocketConnection *conn);
+    std::string stats_report();
+    void name_departed(const std::string& name, const std::string& old_owner);
+    bool recently_departed(const std::string& unique_id) const;
 
     std::list<std::shared_ptr<FlatpakProxyClient>> clients;
-    std::unordered_map<std::string, std::vector<Filter *>> filters;
+    // Clients with both sides closed, freed from an idle callback.
+    std::vector<std::shared_ptr<FlatpakProxyClient>> closed_clients;
+    guint release_idle_id = 0;
+    std::shared_ptr<PolicyTable> policy;
+    uint32_t policy_generation = 0;
     bool log_messages = false;
     bool filter = false;
     bool sloppy_names = false;
+    // Merge PropertiesChanged signals a client has not been sent yet.
+    bool coalesce_properties = false;
+    size_t high_watermark = DEFAULT_HIGH_WATERMARK;
+    size_t low_watermark = DEFAULT_LOW_WATERMARK;
+    size_t client_memory_soft_limit = 0;
+    size_t client_memory_hard_limit = 0;
+    unsigned int reply_timeout = DEFAULT_REPLY_TIMEOUT;
+    uint32_t reply_tick = SERIAL_TABLE_NO_EXPIRY;
+    guint reply_timer_id = 0;
+    unsigned int idle_trim = DEFAULT_IDLE_TRIM;
+    size_t cut_through_threshold = 0;
+    // An already listening socket to accept clients on instead of binding
+    // socket_path, which then belongs to whoever bound it.
+    int listen_fd = -1;
+    guint trim_timer_id = 0;
     std::string dbus_address;
     std::string auth_guid;
     GSocketService* service = nullptr;
+    ProxyStats retired_stats;
+    LatencyStats latency;
+    std::unique_ptr<CaptureWriter> capture;
+    uint32_t next_client_id = 0;
+    // The bus sends every client its own copy of each NameOwnerChanged;
+    // the last one decoded is kept so the copies only cost a compare.
+    NameOwnerChange last_name_owner_change;
 
 private:
-    void add_filter(Filter *filter);
+    bool start_stats();
+    void stop_stats();
+    void send_stats(GSocketConnection *conn);
+    void watch_departures();
+    void unwatch_departures();
+    void departures_connected(GDBusConnection *connection);
     std::string socket_path;
+    // Whether start() bound socket_path, and so may remove it again.
+    bool socket_path_bound = false;
+    std::string stats_socket_path;
+    // Whether start_stats() bound stats_socket_path.
+    bool stats_socket_bound = false;
+    std::string capture_path;
+    std::string policy_args_path;
+    std::string policy_file_path;
+    // The rules given on the command line, which every reload starts from.
+    std::shared_ptr<const PolicyTable> base_policy;
+    GSocketService* stats_service = nullptr;
+    // The proxy's own bus connection, on which names leaving the bus are
+    // seen once for all clients.
+    GDBusConnection *departures_connection = nullptr;
+    GCancellable *departures_cancellable = nullptr;
+    guint departures_subscription = 0;
+    // The last DEPARTED_NAMES_KEPT unique names to leave, oldest first.
+    std::deque<std::string> departed_order;
+    std::unordered_set<std::string> departed;
 };
\ No newline at end of file
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+#define LATENCY_SUB_BUCKET_BITS 5
+#define LATENCY_MAX_BITS 40
+
+inline int64_t monotonic_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// HDR-style log-linear histogram of nanosecond values: each power of two is
+// split into 16 linear sub-buckets, so any recorded value is reported within
+// about 3% of its true value. Values above 2^40 ns (~18 minutes) saturate.
+class LatencyHistogram {
+public:
+    static constexpr int SUB_BUCKETS = 1 << LATENCY_SUB_BUCKET_BITS;
+    static constexpr int HALF = SUB_BUCKETS / 2;
+    static constexpr int N_BUCKETS = (LATENCY_MAX_BITS - LATENCY_SUB_BUCKET_BITS + 2) * HALF + HALF;
+
+    void record(int64_t value) {
+        if (value < 0) {
+            value = 0;
+        }
+        ++counts[index(static_cast<uint64_t>(value))];
+        ++total;
+        if (value > max) {
+            max = value;
+        }
+    }
+
+    // Value at quantile `q` in [0, 1], as the midpoint of its bucket.
+    int64_t percentile(double q) const {
+        if (total == 0) {
+            return 0;
+        }
+
+        uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(total) + 0.5);
+        if (rank < 1) {
+            rank = 1;
+        }
+
+        uint64_t seen = 0;
+        for (int i = 0; i < N_BUCKETS; ++i) {
+            seen += counts[i];
+            if (seen >= rank) {
+                int64_t low = lower_bound(i);
+                int64_t high = lower_bound(i + 1);
+                return std::min<int64_t>(low + (high - low) / 2, max);
+            }
+        }
+        return max;
+    }
+
+    uint64_t count() const {
+        return total;
+    }
+
+    int64_t maximum() const {
+        return max;
+    }
+
+private:
+    static int index(uint64_t value) {
+        if (value < SUB_BUCKETS) {
+            return static_cast<int>(value);
+        }
+
+        int msb = 63 - __builtin_clzll(value);
+        if (msb >= LATENCY_MAX_BITS) {
+            return N_BUCKETS - 1;
+        }
+
+        int group = msb - LATENCY_SUB_BUCKET_BITS + 1;
+        int sub = static_cast<int>(value >> group);
+        return (group + 1) * HALF + (sub - HALF);
+    }
+
+    static int64_t lower_bound(int index) {
+        if (index < SUB_BUCKETS) {
+            return index;
+        }
+
+        int group = index / HALF - 1;
+        int64_t sub = index % HALF + HALF;
+        return sub << group;
+    }
+
+    std::array<uint64_t, N_BUCKETS> counts{};
+    uint64_t total = 0;
+    int64_t max = 0;
+};
+
+typedef enum {
+    LATENCY_TO_BUS,
+    LATENCY_TO_CLIENT,
+    N_LATENCY_DIRECTIONS,
+} LatencyDirection;
+
+#define N_LATENCY_MESSAGE_TYPES 5
+
+// Proxy-added latency per direction and D-Bus message type (index 0 is
+// unused, types 1-4 match GDBusMessageType), and method call round trips
+// per side of the conversation that made the call.
+struct LatencyStats {
+    LatencyHistogram forwarding[N_LATENCY_DIRECTIONS][N_LATENCY_MESSAGE_TYPES];
+    LatencyHistogram round_trip[N_LATENCY_DIRECTIONS];
+
+    void record_forwarding(LatencyDirection direction, uint8_t type, int64_t ns) {
+        if (type < N_LATENCY_MESSAGE_TYPES) {
+            forwarding[direction][type].record(ns);
+        }
+    }
+
+    void dump(std::ostream& out) const;
+    void dump_json(std::ostream& out) const;
+};
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <list>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+class Buffer;
+
+// Lanes of a side's output queue, drained highest first.
+enum OutputLane {
+    OUTPUT_LANE_REPLY,          // method returns and errors
+    OUTPUT_LANE_CALL,           // method calls
+    OUTPUT_LANE_SIGNAL,         // signals, and anything not classified
+    N_OUTPUT_LANES
+};
+
+// A side's outgoing buffers, split into lanes so a reply does not wait
+// behind a storm of signals.
+//
+// D-Bus only orders messages per sender, so a message may overtake earlier
+// ones in lower lanes as long as none is from its own sender: it joins the
+// lowest lane its sender still has queued messages in. Unclassified
+// buffers (auth lines, the body chunks of a cut-through message, anything
+// on the bus side) are never overtaken, which keeps them in order.
+//
+// A message is written out whole: once its first byte has been sent, or
+// while a cut-through message still has chunks to come, its lane is the
+// only one drained. Its chunks follow its head into that lane, and
+// messages pushed before the last chunk is in are held back until then.
+//
+// A message pushed with a coalescing key can be taken back out by a later
+// one with the same key, as long as none of it has been written yet.
+class OutputQueue {
+public:
+    // `sender` classifies the buffer as a complete message from it;
+    // `message_continues` says it is the head of a message whose body
+    // follows with push_chunk(). A `coalesce_key` replaces any earlier
+    // buffer's claim to it.
+    void push(Buffer *buffer, OutputLane lane = OUTPUT_LANE_SIGNAL, const std::string *sender = nullptr,
+              bool message_continues = false, const std::string *coalesce_key = nullptr);
+    // The next piece of the message whose head was pushed last;
+    // `message_continues` is false for its last chunk.
+    void push_chunk(Buffer *buffer, bool message_continues);
+    // The buffer to write next, or nullptr if there is none or the message
+    // being written waits for more of its chunks.
+    Buffer *next();
+    // Drops the buffer next() returned once it is fully written. True if it
+    // overtook a buffer that was queued before it.
+    bool pop();
+    // The unwritten buffer last pushed with `key`, still queued, or nullptr.
+    Buffer *find_coalescable(const std::string& key) const;
+    // Removes the buffer find_coalescable() returned; the caller takes its
+    // reference.
+    void take_coalescable(const std::string& key);
+    void for_each(const std::function<void(Buffer *)>& fn) const;
+    // Unrefs every queued buffer.
+    void clear();
+
+    bool empty() const {
+        return n_buffers == 0;
+    }
+
+    size_t size() const {
+        return n_buffers;
+    }
+
+private:
+    struct SenderLanes {
+        uint32_t queued[N_OUTPUT_LANES] = {};
+    };
+    using SenderMap = std::unordered_map<std::string, SenderLanes>;
+
+    struct QueuedBuffer {
+        Buffer *buffer;
+        uint64_t seq;
+        // nullptr for unclassified buffers. Map nodes don't move, and an
+        // entry is only erased once none of its buffers are queued.
+        SenderMap::value_type *sender;
+        bool message_continues;
+        // The key of `coalescable` that refers to this buffer, if any.
+        const std::string *coalesce_key;
+    };
+
+    // Pushed while a streamed message was incomplete, with what push()
+    // needs once it is.
+    struct HeldBuffer {
+        Buffer *buffer;
+        OutputLane lane;
+        bool message_continues;
+        std::optional<std::string> sender;
+        std::optional<std::string> coalesce_key;
+    };
+
+    struct CoalescableBuffer {
+        int lane;
+        std::list<QueuedBuffer>::iterator it;
+    };
+
+    void uncount(const QueuedBuffer& queued, int lane);
+
+    std::list<QueuedBuffer> lanes[N_OUTPUT_LANES];
+    SenderMap senders;
+    std::unordered_map<std::string, CoalescableBuffer> coalescable;
+    std::deque<HeldBuffer> held;
+    SenderLanes unclassified;
+    // The lane of the message being written, and whether its last
+    // buffer out left the message unfinished.
+    int current_lane = -1;
+    bool continuing = false;
+    // The lane of a message whose head was pushed and whose last chunk
+    // is still to come, or -1.
+    int open_lane = -1;
+    uint64_t next_seq = 0;
+    size_t n_buffers = 0;
+};
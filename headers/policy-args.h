@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+
+class FlatpakProxy;
+class PolicyTable;
+
+typedef enum {
+    POLICY_ARG_APPLIED,
+    POLICY_ARG_INVALID,
+    POLICY_ARG_UNKNOWN,
+} PolicyArgResult;
+
+// Adds one --see, --talk, --own, --call or --broadcast rule to `table`.
+// Returns POLICY_ARG_UNKNOWN for any other option.
+PolicyArgResult apply_policy_rule(PolicyTable *table, const std::string& arg);
+
+// Adds every rule in a --policy-args file to `table`. The file holds the
+// same options as apply_policy_rule takes, separated by NULs as in --args
+// or by newlines. Fails on the first option that is not a valid rule.
+bool load_policy_rules(const std::string& path, PolicyTable *table);
+
+// Applies one of the filtering options shared by the proxy and the offline
+// tools (--filter, --sloppy-names, --log, --see, --talk, --own, --call and
+// --broadcast) to `proxy`. Returns POLICY_ARG_UNKNOWN for anything else so
+// the caller can handle its own options.
+PolicyArgResult apply_policy_arg(FlatpakProxy *proxy, const std::string& arg);
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+class PolicyTable;
+
+// A compiled policy, written by xdg-dbus-proxy-policy-compile and mapped
+// read-only with --policy-file, in host byte order:
+//
+//   PolicyImageHeader
+//   PolicyImageName[n_names]    sorted by name, for binary search
+//   PolicyImageRule[n_rules]    each name's rules are contiguous
+//   string table                NUL-terminated, offset 0 is ""
+//
+// Nothing is parsed or copied at load time: a name is looked up in place
+// and only the rules of names that traffic actually touches become
+// Filters. Every proxy mapping the same file shares its pages.
+
+#define POLICY_IMAGE_MAGIC "XDBPPOL1"
+#define POLICY_IMAGE_BYTE_ORDER_MARK 0x01020304u
+
+#define POLICY_IMAGE_NAME_SUBTREE (1 << 0)
+
+struct PolicyImageHeader {
+    char magic[8];
+    uint32_t byte_order_mark;
+    uint32_t n_names;
+    uint32_t n_rules;
+    uint32_t names_offset;
+    uint32_t rules_offset;
+    uint32_t strings_offset;
+    uint32_t strings_size;
+    uint32_t reserved;
+};
+
+struct PolicyImageName {
+    uint32_t name;              // string offset
+    uint32_t first_rule;
+    uint32_t n_rules;
+    uint32_t flags;             // POLICY_IMAGE_NAME_*
+};
+
+struct PolicyImageRule {
+    uint32_t path;              // string offsets, 0 when unset
+    uint32_t interface;
+    uint32_t member;
+    uint8_t policy;             // FlatpakPolicy
+    uint8_t types;              // FilterTypeMask
+    uint8_t name_is_subtree;
+    uint8_t path_is_subtree;
+};
+
+class PolicyImage {
+public:
+    PolicyImage() = default;
+    PolicyImage(const PolicyImage&) = delete;
+    PolicyImage& operator=(const PolicyImage&) = delete;
+    ~PolicyImage();
+
+    // Maps and validates `path`; a malformed image is rejected as a whole.
+    bool open(const std::string& path);
+
+    const PolicyImageName *find_name(const std::string& name) const;
+
+    uint32_t n_names() const {
+        return header->n_names;
+    }
+
+    uint32_t n_rules() const {
+        return header->n_rules;
+    }
+
+    const PolicyImageName *name_at(uint32_t i) const {
+        return names + i;
+    }
+
+    const PolicyImageRule *rule_at(uint32_t i) const {
+        return rules + i;
+    }
+
+    const char *string_at(uint32_t offset) const {
+        return strings + offset;
+    }
+
+    // Names the mapped file, so proxies that mapped the same version of
+    // it can tell; a recompiled image is renamed in and gets a new inode.
+    const std::string& identity() const {
+        return file_identity;
+    }
+
+private:
+    bool validate(const std::string& path) const;
+
+    const uint8_t *map = nullptr;
+    size_t map_size = 0;
+    const PolicyImageHeader *header = nullptr;
+    const PolicyImageName *names = nullptr;
+    const PolicyImageRule *rules = nullptr;
+    const char *strings = nullptr;
+    std::string file_identity;
+};
+
+// Compiles `table` into an image at `path`. The image is written next to
+// it and renamed into place, so proxies still mapping the old file keep a
+// consistent copy.
+bool write_policy_image(const PolicyTable& table, const std::string& path);
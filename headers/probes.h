@@ -0,0 +1,37 @@
+#pragma once
+
+// USDT tracepoints under the "xdg_dbus_proxy" provider. With sys/sdt.h each
+// probe is a single nop plus a note in the ELF file, so it costs nothing
+// until a tracer attaches; without it the macros compile away.
+//
+//   bpftrace -l 'usdt:/usr/bin/xdg-dbus-proxy:xdg_dbus_proxy:*'
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define PROXY_PROBE1(name, a) DTRACE_PROBE1(xdg_dbus_proxy, name, a)
+#define PROXY_PROBE2(name, a, b) DTRACE_PROBE2(xdg_dbus_proxy, name, a, b)
+#define PROXY_PROBE3(name, a, b, c) DTRACE_PROBE3(xdg_dbus_proxy, name, a, b, c)
+#define PROXY_PROBE4(name, a, b, c, d) DTRACE_PROBE4(xdg_dbus_proxy, name, a, b, c, d)
+#define PROXY_PROBE6(name, a, b, c, d, e, f) DTRACE_PROBE6(xdg_dbus_proxy, name, a, b, c, d, e, f)
+#else
+#define PROXY_PROBE1(name, a) do {} while (0)
+#define PROXY_PROBE2(name, a, b) do {} while (0)
+#define PROXY_PROBE3(name, a, b, c) do {} while (0)
+#define PROXY_PROBE4(name, a, b, c, d) do {} while (0)
+#define PROXY_PROBE6(name, a, b, c, d, e, f) do {} while (0)
+#endif
+
+// Probe arguments, for reference:
+//   client_connect(client)
+//   auth_complete(client)
+//   client_close(client)
+//   message_framed(client, from_bus, size)
+//   header_parsed(client, from_bus, type, serial, interface, member)
+//   policy_decided(client, serial, handler, policy)
+//   broadcast_decided(client, serial, policy, forwarded)
+//   reply_synthesized(client, serial)
+//   buffer_queued(client, to_bus, size, queued_bytes)
+//   buffer_written(client, to_bus, size)
+//   policy_reloaded(proxy, generation)
+//   policy_refreshed(client, generation)
@@ -0,0 +1,223 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#define REPLY_WHEEL_SLOTS 8
+#define SERIAL_TABLE_NO_EXPIRY UINT32_MAX
+
+// Open-addressing table keyed by D-Bus serial. Serial 0 is never valid on
+// the wire, so it marks an empty slot; lookups for it always miss and
+// inserting it is a no-op. Linear probing with backward-shift
+// deletion keeps the table free of tombstones.
+//
+// Every entry is stamped with the coarse tick it was inserted at and its
+// serial is recorded in the matching timer wheel slot. When the wheel comes
+// around to that slot again the entry is expired, so replies that never
+// arrive do not live forever. Entries inserted at SERIAL_TABLE_NO_EXPIRY
+// stay until they are stolen.
+//
+// An empty table is a few words: the slots and the wheel are allocated on
+// first use, and trim() gives both back once the table has drained.
+template <typename T>
+class SerialTable {
+public:
+    struct Entry {
+        uint32_t serial = 0;
+        uint32_t tick = 0;
+        T value{};
+    };
+
+    void insert(uint32_t serial, T value, uint32_t tick) {
+        if (serial == 0) {
+            return;
+        }
+
+        if ((count + 1) * 2 > entries.size()) {
+            rehash(entries.empty() ? 16 : entries.size() * 2);
+        }
+
+        size_t i = probe(serial);
+        if (entries[i].serial == 0) {
+            ++count;
+        }
+        entries[i].serial = serial;
+        entries[i].tick = tick;
+        entries[i].value = std::move(value);
+        if (tick != SERIAL_TABLE_NO_EXPIRY) {
+            if (!wheel) {
+                wheel = std::make_unique<Wheel>();
+            }
+            (*wheel)[tick % REPLY_WHEEL_SLOTS].push_back(serial);
+        }
+    }
+
+    T *find(uint32_t serial) {
+        if (count == 0 || serial == 0) {
+            return nullptr;
+        }
+
+        size_t i = probe(serial);
+        return entries[i].serial == serial ? &entries[i].value : nullptr;
+    }
+
+    bool steal(uint32_t serial, T *value) {
+        if (count == 0 || serial == 0) {
+            return false;
+        }
+
+        size_t i = probe(serial);
+        if (entries[i].serial != serial) {
+            return false;
+        }
+
+        *value = std::move(entries[i].value);
+        remove_at(i);
+        return true;
+    }
+
+    // Called once per tick before anything is inserted at `tick`. The slot
+    // about to be reused holds the serials inserted REPLY_WHEEL_SLOTS ticks
+    // ago; whichever of those are still present are handed to `on_expired`
+    // and dropped.
+    template <typename Fn>
+    size_t expire(uint32_t tick, Fn &&on_expired) {
+        if (!wheel) {
+            return 0;
+        }
+
+        std::vector<uint32_t> &slot = (*wheel)[tick % REPLY_WHEEL_SLOTS];
+        size_t expired = 0;
+
+        for (uint32_t serial : slot) {
+            if (count == 0) {
+                break;
+            }
+
+            size_t i = probe(serial);
+            if (entries[i].serial != serial ||
+                static_cast<uint32_t>(tick - entries[i].tick) < REPLY_WHEEL_SLOTS) {
+                continue;
+            }
+
+            on_expired(serial, entries[i].value);
+            remove_at(i);
+            ++expired;
+        }
+
+        std::vector<uint32_t>().swap(slot);
+
+        if (entries.size() > 16 && count * 8 < entries.size()) {
+            rehash(std::max<size_t>(16, entries.size() / 4));
+        }
+        return expired;
+    }
+
+    template <typename Fn>
+    void for_each(Fn &&fn) {
+        for (auto &entry : entries) {
+            if (entry.serial != 0) {
+                fn(entry.serial, entry.value);
+            }
+        }
+    }
+
+    void clear() {
+        std::vector<Entry>().swap(entries);
+        wheel.reset();
+        count = 0;
+    }
+
+    // Releases what an idle table does not need: everything once it is
+    // empty, otherwise excess slots.
+    void trim() {
+        if (count == 0) {
+            clear();
+        } else if (entries.size() > 16 && count * 8 < entries.size()) {
+            rehash(std::max<size_t>(16, entries.size() / 4));
+        }
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    bool empty() const {
+        return count == 0;
+    }
+
+    size_t footprint() const {
+        size_t bytes = entries.capacity() * sizeof(Entry);
+        if (wheel) {
+            bytes += sizeof(Wheel);
+            for (const auto &slot : *wheel) {
+                bytes += slot.capacity() * sizeof(uint32_t);
+            }
+        }
+        return bytes;
+    }
+
+private:
+    typedef std::array<std::vector<uint32_t>, REPLY_WHEEL_SLOTS> Wheel;
+
+    size_t home(uint32_t serial) const {
+        // Fibonacci hashing spreads both the low client serials and the fake
+        // serials just below G_MAXUINT32 over the table.
+        int bits = __builtin_ctzll(entries.size());
+        return static_cast<uint32_t>(serial * 2654435769u) >> (32 - bits);
+    }
+
+    // Index of `serial`, or of the empty slot where it would go.
+    size_t probe(uint32_t serial) const {
+        size_t mask = entries.size() - 1;
+        size_t i = home(serial);
+        while (entries[i].serial != 0 && entries[i].serial != serial) {
+            i = (i + 1) & mask;
+        }
+        return i;
+    }
+
+    void remove_at(size_t i) {
+        size_t mask = entries.size() - 1;
+        size_t j = i;
+
+        entries[i] = Entry();
+        --count;
+
+        while (true) {
+            j = (j + 1) & mask;
+            if (entries[j].serial == 0) {
+                break;
+            }
+
+            // Shift back any entry whose home slot is not cyclically
+            // within (i, j], so lookups never hit a hole before it.
+            size_t k = home(entries[j].serial);
+            if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+                entries[i] = std::move(entries[j]);
+                entries[j] = Entry();
+                i = j;
+            }
+        }
+    }
+
+    void rehash(size_t new_size) {
+        std::vector<Entry> old;
+        old.swap(entries);
+        entries.resize(new_size);
+
+        for (auto &entry : old) {
+            if (entry.serial != 0) {
+                entries[probe(entry.serial)] = std::move(entry);
+            }
+        }
+    }
+
+    std::vector<Entry> entries;
+    std::unique_ptr<Wheel> wheel;
+    size_t count = 0;
+};
@@ -2,6 +2,19 @@
 #include "../headers/utils.h"
 #include <gio/gunixconnection.h>
 #include <atomic>
+#include <cerrno>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// The kernel's SCM_MAX_FD: no single message can carry more.
+#define MAX_FDS_PER_MESSAGE 253
+
+// Sized and aligned for one SCM_RIGHTS header carrying the most fds a
+// message can, so control data never needs a heap allocation.
+union FdControl {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int) * MAX_FDS_PER_MESSAGE)];
+};
 
 // Глобальный счетчик для отладки
 static std::atomic<int> g_buffer_count(0);
@@ -29,9 +42,9 @@ Buffer::Buffer(size_t size, Buffer *old) :
             sent = old->sent;
             std::copy_n(old->data.begin(), pos, data.begin());
             
-            // Перемещаем control messages
-            control_messages = std::move(old->control_messages);
-            old->control_messages.clear();
+            // Перемещаем fds
+            fds = std::move(old->fds);
+            old->fds.clear();
         }
     }
     
@@ -47,11 +60,7 @@ Buffer::~Buffer() {
               << " addr=" << this
               << " total_buffers=" << g_buffer_count << "\n";
     
-    // Очищаем control messages
-    for (auto *msg : control_messages) {
-        if (msg) g_object_unref(msg);
-    }
-    control_messages.clear();
+    close_fds();
     
     // Обнуляем данные для обнаружения use-after-free
     buffer_id = -buffer_id;  // Отрицательный ID = удаленный буфер
@@ -62,6 +71,13 @@ Buffer::~Buffer() {
     data.clear();
 }
 
+void Buffer::close_fds() {
+    for (int fd : fds) {
+        close(fd);
+    }
+    fds.clear();
+}
+
 void Buffer::ref() {
     if (refcount <= 0 || refcount >= 1000) {
         std::cerr << "BUFFER[" << buffer_id << "] ERROR: ref() on invalid buffer with refcount=" 
@@ -127,47 +143,52 @@ bool Buffer::read(ProxySide *side, GSocket *socket) {
         return false;
     }
 
-    if (!side->extra_input_data.empty() && client->auth_state == AUTH_COMPLETE) {
-        received = std::min(size - pos, side->extra_input_data.size());
-        
-        if (received > 0) {
-            std::copy_n(side->extra_input_data.begin(), received, data.begin() + pos);
-            
-            if (received < side->extra_input_data.size()) {
-                side->extra_input_data.erase(side->extra_input_data.begin(), 
-                                           side->extra_input_data.begin() + received);
-            } else {
-                side->extra_input_data.clear();
-            }
-            std::cerr << "BUFFER[" << buffer_id << "]: read() from extra_input_data - received=" 
-                      << received << "\n";
+    if (side->auth_scratch_start < side->auth_scratch_end) {
+        // Bytes pipelined after the auth phase are still sitting in the
+        // side's scratch region, hand them to the framer before touching
+        // the socket again.
+        if (client->auth_state != AUTH_COMPLETE) {
+            return false;
         }
-    } else if (side->extra_input_data.empty()) {
-        GInputVector vec;
-        vec.buffer = data.data() + pos;
-        vec.size = size - pos;
 
-        GSocketControlMessage **messages = nullptr;
-        int num_messages = 0;
-        int flags = 0;
-        GError *error = nullptr;
+        received = std::min(size - pos, side->auth_scratch_end - side->auth_scratch_start);
+        std::copy_n(side->auth_scratch.begin() + side->auth_scratch_start, received, data.begin() + pos);
+        side->auth_scratch_start += received;
 
-        gssize res = g_socket_receive_message(
-            socket, nullptr, &vec, 1,
-            &messages, &num_messages, &flags,
-            nullptr, &error
-        );
+        if (side->auth_scratch_start == side->auth_scratch_end) {
+            side->release_auth_scratch();
+        }
+        std::cerr << "BUFFER[" << buffer_id << "]: read() from auth_scratch - received="
+                  << received << "\n";
+    } else {
+        if (!side->auth_scratch.empty() && client->auth_state == AUTH_COMPLETE) {
+            side->release_auth_scratch();
+        }
 
-        if (res < 0 && g_error_matches(error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
-            g_error_free(error);
+        struct iovec iov;
+        iov.iov_base = data.data() + pos;
+        iov.iov_len = size - pos;
+
+        FdControl control;
+        struct msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        ssize_t res;
+        do {
+            res = recvmsg(g_socket_get_fd(socket), &msg, MSG_CMSG_CLOEXEC);
+        } while (res < 0 && errno == EINTR);
+
+        if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
             std::cerr << "BUFFER[" << buffer_id << "]: read() - would block\n";
             return false;
         }
         
         if (res <= 0) {
-            if (res != 0 && error) {
-                std::cerr << "BUFFER[" << buffer_id << "] Socket error: " << error->message << "\n";
-                g_error_free(error);
+            if (res < 0) {
+                std::cerr << "BUFFER[" << buffer_id << "] Socket error: " << strerror(errno) << "\n";
             }
             std::cerr << "BUFFER[" << buffer_id << "]: read() - socket closed/error\n";
             side->side_closed();
@@ -177,10 +198,23 @@ bool Buffer::read(ProxySide *side, GSocket *socket) {
         received = static_cast<size_t>(res);
         std::cerr << "BUFFER[" << buffer_id << "]: read() from socket - received=" << received << "\n";
         
-        for (int i = 0; i < num_messages; ++i) {
-            control_messages.push_back(messages[i]);
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+            size_t n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            size_t first = fds.size();
+            fds.resize(first + n_fds);
+            memcpy(fds.data() + first, CMSG_DATA(cmsg), n_fds * sizeof(int));
+        }
+
+        if (msg.msg_flags & MSG_CTRUNC) {
+            // Some fds were dropped by the kernel, the message they
+            // belonged to can't be forwarded intact.
+            std::cerr << "BUFFER[" << buffer_id << "] Control data truncated, fds lost\n";
+            side->side_closed();
+            return false;
         }
-        g_free(messages);
     }
     
     if (received > 0 && pos + received <= size) {
@@ -224,40 +258,50 @@ bool Buffer::write(ProxySide *side, GSocket *socket) {
         return true; // Всё уже отправлено
     }
 
-    std::vector<GSocketControlMessage *> messages(control_messages.begin(), control_messages.end());
-    GOutputVector vec;
-    vec.buffer = const_cast<void *>(reinterpret_cast<const void *>(data.data() + sent));
-    vec.size = pos - sent;
-    
-    gssize res = g_socket_send_message(
-        socket,
-        nullptr,
-        &vec, 1,
-        messages.empty() ? nullptr : messages.data(),
-        static_cast<int>(messages.size()),
-        G_SOCKET_MSG_NONE,
-        nullptr,
-        &error
-    );
+    if (fds.size() > MAX_FDS_PER_MESSAGE) {
+        std::cerr << "Too many fds to send: " << fds.size() << "\n";
+        side->side_closed();
+        return false;
+    }
+
+    struct iovec iov;
+    iov.iov_base = data.data() + sent;
+    iov.iov_len = pos - sent;
+
+    FdControl control;
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (!fds.empty()) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+        memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+    }
+
+    ssize_t res;
+    do {
+        res = sendmsg(g_socket_get_fd(socket), &msg, MSG_NOSIGNAL);
+    } while (res < 0 && errno == EINTR);
     
-    if (res < 0 && g_error_matches(error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
-        g_error_free(error);
+    if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
         return false;
     }
     
     if (res <= 0) {
         if (res < 0) {
-            std::cerr << "Error writing to socket: " << error->message << "\n";
-            g_error_free(error);
+            std::cerr << "Error writing to socket: " << strerror(errno) << "\n";
         }
         side->side_closed();
         return false;
     }
 
-    for (auto msg : control_messages) {
-        g_object_unref(msg);
-    }
-    control_messages.clear();
+    // The receiver has its own copies now.
+    close_fds();
 
     sent += static_cast<size_t>(res);
     return true;
@@ -0,0 +1,138 @@
+#include "../headers/capture.h"
+#include "../headers/latency-histogram.h"
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+CaptureWriter::~CaptureWriter() {
+    close();
+}
+
+// Captures hold whole message bodies, secrets included, so the file must
+// be new and readable by our user only; an existing file or symlink at
+// `path` is never written through.
+bool CaptureWriter::open(const std::string& path) {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        std::cerr << "Failed to create capture file " << path << ": " << strerror(errno) << "\n";
+        return false;
+    }
+
+    file = fdopen(fd, "wb");
+    if (file == nullptr) {
+        std::cerr << "Failed to open capture file " << path << ": " << strerror(errno) << "\n";
+        ::close(fd);
+        return false;
+    }
+    setvbuf(file, nullptr, _IOFBF, CAPTURE_WRITE_BUFFER);
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    CaptureFileHeader header = {};
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    header.byte_order_mark = CAPTURE_BYTE_ORDER_MARK;
+    header.record_align = CAPTURE_ALIGN;
+    header.start_realtime_ns = static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+    start_ns = monotonic_ns();
+
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        std::cerr << "Failed to write capture header to " << path << "\n";
+        close();
+        return false;
+    }
+    return true;
+}
+
+void CaptureWriter::record(uint32_t client_id, CaptureDirection direction,
+                           const uint8_t *data, size_t length, size_t n_fds) {
+    static const uint8_t padding[CAPTURE_ALIGN] = {};
+
+    if (file == nullptr) {
+        return;
+    }
+
+    CaptureRecord record = {};
+    record.timestamp_ns = static_cast<uint64_t>(monotonic_ns() - start_ns);
+    record.client_id = client_id;
+    record.length = static_cast<uint32_t>(length);
+    record.n_fds = static_cast<uint16_t>(std::min<size_t>(n_fds, UINT16_MAX));
+    record.direction = static_cast<uint8_t>(direction);
+
+    size_t pad = capture_padded(length) - length;
+    if (fwrite(&record, sizeof(record), 1, file) != 1 ||
+        fwrite(data, 1, length, file) != length ||
+        fwrite(padding, 1, pad, file) != pad) {
+        std::cerr << "Failed to write capture record, capture stopped: " << strerror(errno) << "\n";
+        close();
+    }
+}
+
+void CaptureWriter::close() {
+    if (file) {
+        fclose(file);
+        file = nullptr;
+    }
+}
+
+CaptureReader::~CaptureReader() {
+    if (map) {
+        munmap(const_cast<uint8_t *>(map), map_size);
+    }
+}
+
+bool CaptureReader::open(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "Failed to open capture " << path << ": " << strerror(errno) << "\n";
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(CaptureFileHeader)) {
+        std::cerr << path << " is not a capture file\n";
+        ::close(fd);
+        return false;
+    }
+
+    map_size = static_cast<size_t>(st.st_size);
+    void *addr = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        std::cerr << "Failed to map capture " << path << ": " << strerror(errno) << "\n";
+        return false;
+    }
+    map = static_cast<const uint8_t *>(addr);
+    madvise(addr, map_size, MADV_SEQUENTIAL);
+
+    const CaptureFileHeader *file_header = header();
+    if (memcmp(file_header->magic, CAPTURE_MAGIC, sizeof(file_header->magic)) != 0 ||
+        file_header->byte_order_mark != CAPTURE_BYTE_ORDER_MARK ||
+        file_header->record_align != CAPTURE_ALIGN) {
+        std::cerr << path << " is not a capture file for this host\n";
+        return false;
+    }
+
+    rewind();
+    return true;
+}
+
+const CaptureRecord *CaptureReader::next() {
+    if (map == nullptr || offset + sizeof(CaptureRecord) > map_size) {
+        return nullptr;
+    }
+
+    const CaptureRecord *record = reinterpret_cast<const CaptureRecord *>(map + offset);
+    size_t end = offset + sizeof(CaptureRecord) + capture_padded(record->length);
+    if (end > map_size) {
+        return nullptr;
+    }
+
+    offset = end;
+    return record;
+}
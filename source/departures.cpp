@@ -0,0 +1,116 @@
+#include "../headers/flatpak-proxy-client.h"
+
+#define DEPARTURES_MATCH_RULE \
+    "type='signal',sender='org.freedesktop.DBus',interface='org.freedesktop.DBus'," \
+    "member='NameOwnerChanged',arg2=''"
+
+// Connections and names leaving the bus are watched on one connection of
+// the proxy's own rather than through a match on every client's: a match
+// per client would wake each of them for every departure and hand clients
+// NameOwnerChanged signals they never asked for.
+void FlatpakProxy::watch_departures() {
+    departures_cancellable = g_cancellable_new();
+    g_dbus_connection_new_for_address(
+        dbus_address.c_str(),
+        static_cast<GDBusConnectionFlags>(G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                          G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION),
+        nullptr,
+        departures_cancellable,
+        +[](GObject *, GAsyncResult *res, gpointer data) {
+            GError *error = nullptr;
+            GDBusConnection *connection = g_dbus_connection_new_for_address_finish(res, &error);
+
+            // Cancelled means the proxy has stopped and may be gone.
+            if (!connection) {
+                if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+                    std::cerr << "Failed to watch for departures: " << error->message << "\n";
+                }
+                g_error_free(error);
+                return;
+            }
+
+            static_cast<FlatpakProxy *>(data)->departures_connected(connection);
+        },
+        this
+    );
+}
+
+void FlatpakProxy::departures_connected(GDBusConnection *connection) {
+    departures_connection = connection;
+    departures_subscription = g_dbus_connection_signal_subscribe(
+        connection,
+        "org.freedesktop.DBus",
+        "org.freedesktop.DBus",
+        "NameOwnerChanged",
+        "/org/freedesktop/DBus",
+        nullptr,
+        G_DBUS_SIGNAL_FLAGS_NO_MATCH_RULE,
+        +[](GDBusConnection *, const gchar *, const gchar *, const gchar *, const gchar *,
+            GVariant *parameters, gpointer data) {
+            const gchar *name, *old_owner, *new_owner;
+
+            if (!g_variant_is_of_type(parameters, G_VARIANT_TYPE("(sss)"))) {
+                return;
+            }
+            g_variant_get(parameters, "(&s&s&s)", &name, &old_owner, &new_owner);
+            if (name[0] != '\0' && new_owner[0] == '\0') {
+                static_cast<FlatpakProxy *>(data)->name_departed(name, old_owner);
+            }
+        },
+        this,
+        nullptr
+    );
+
+    // The rule only matches departures, which the subscription above
+    // cannot express.
+    g_dbus_connection_call(connection, "org.freedesktop.DBus", "/org/freedesktop/DBus",
+                           "org.freedesktop.DBus", "AddMatch", g_variant_new("(s)", DEPARTURES_MATCH_RULE),
+                           nullptr, G_DBUS_CALL_FLAGS_NONE, -1, nullptr, nullptr, nullptr);
+
+    if (log_messages) {
+        std::cerr << "Watching for departures from " << dbus_address << "\n";
+    }
+}
+
+void FlatpakProxy::unwatch_departures() {
+    if (departures_cancellable) {
+        g_cancellable_cancel(departures_cancellable);
+        g_object_unref(departures_cancellable);
+        departures_cancellable = nullptr;
+    }
+    if (departures_connection) {
+        g_dbus_connection_signal_unsubscribe(departures_connection, departures_subscription);
+        departures_subscription = 0;
+        g_dbus_connection_close(departures_connection, nullptr, nullptr, nullptr);
+        g_object_unref(departures_connection);
+        departures_connection = nullptr;
+    }
+}
+
+// Prunes what every client keeps for a unique name that disconnected, or
+// for a well-known name its owner released.
+void FlatpakProxy::name_departed(const std::string& name, const std::string& old_owner) {
+    if (name[0] == ':') {
+        if (departed.insert(name).second) {
+            departed_order.push_back(name);
+            if (departed_order.size() > DEPARTED_NAMES_KEPT) {
+                departed.erase(departed_order.front());
+                departed_order.pop_front();
+            }
+        }
+        for (auto &client : clients) {
+            client->forget_unique_id(name);
+        }
+    } else if (!old_owner.empty()) {
+        for (auto &client : clients) {
+            client->remove_unique_id_owned_name(old_owner, name);
+        }
+    }
+}
+
+// Departures arrive on their own connection, so a client may still read a
+// message its sender sent just before leaving. Such a late message must
+// not bring back the state the departure dropped.
+bool FlatpakProxy::recently_departed(const std::string& unique_id) const {
+    return departed.count(unique_id) != 0;
+}
@@ -1,4 +1,8 @@
 #include "../headers/flatpak-proxy-client.h"
+#include <algorithm>
+
+bool any_filter_matches(const std::vector<Filter *>& filters, FilterTypeMask type,
+                       const std::string& path, const std::string& interface, const std::string& member);
 
 Filter::Filter(const std::string& name, bool name_is_subtree, FlatpakPolicy policy) :
     name(name),
@@ -40,4 +44,220 @@ Filter::Filter(const std::string& name, bool name_is_subtree, FilterTypeMask typ
             }
         }
     }
-}
\ No newline at end of file
+}
+
+PolicyTable::PolicyTable() {
+    add_policy("org.freedesktop.DBus", false, FLATPAK_POLICY_TALK);
+}
+
+PolicyTable::PolicyTable(const PolicyTable& other) :
+    image(other.image) {
+    for (auto &[name, filter_list] : other.filters) {
+        auto &copies = filters[name];
+        copies.reserve(filter_list.size());
+        for (auto *filter : filter_list) {
+            copies.push_back(new Filter(*filter));
+        }
+    }
+}
+
+PolicyTable::~PolicyTable() {
+    for (auto &[_, filter_list] : filters) {
+        for (auto filter : filter_list) {
+            delete filter;
+        }
+    }
+    for (auto filter : image_owned) {
+        delete filter;
+    }
+}
+
+void PolicyTable::add_filter(Filter *filter) {
+    filters[filter->name].push_back(filter);
+}
+
+void PolicyTable::add_policy(const std::string& name, bool name_is_subtree, FlatpakPolicy policy) {
+    add_filter(new Filter(name, name_is_subtree, policy));
+}
+
+void PolicyTable::add_call_rule(const std::string& name, bool name_is_subtree, const std::string& rule) {
+    add_filter(new Filter(name, name_is_subtree, FILTER_TYPE_CALL, rule));
+}
+
+void PolicyTable::add_broadcast_rule(const std::string& name, bool name_is_subtree, const std::string& rule) {
+    add_filter(new Filter(name, name_is_subtree, FILTER_TYPE_BROADCAST, rule));
+}
+
+const std::vector<Filter *> *PolicyTable::find(const std::string& name) const {
+    auto it = filters.find(name);
+    const std::vector<Filter *> *found = (it != filters.end()) ? &it->second : nullptr;
+
+    if (!image) {
+        return found;
+    }
+
+    auto cached = image_filters.find(name);
+    if (cached != image_filters.end()) {
+        return &cached->second;
+    }
+
+    const PolicyImageName *entry = image->find_name(name);
+    if (entry == nullptr) {
+        return found;
+    }
+
+    std::vector<Filter *> &merged = image_filters[name];
+    if (found) {
+        merged = *found;
+    }
+    for (uint32_t i = 0; i < entry->n_rules; ++i) {
+        const PolicyImageRule *rule = image->rule_at(entry->first_rule + i);
+        Filter *filter = new Filter(name, rule->name_is_subtree != 0, static_cast<FlatpakPolicy>(rule->policy));
+        filter->types = static_cast<FilterTypeMask>(rule->types);
+        filter->path = image->string_at(rule->path);
+        filter->path_is_subtree = rule->path_is_subtree != 0;
+        filter->interface = image->string_at(rule->interface);
+        filter->member = image->string_at(rule->member);
+        image_owned.push_back(filter);
+        merged.push_back(filter);
+    }
+    return &merged;
+}
+
+FlatpakPolicy PolicyTable::max_policy(const std::string& source, std::vector<Filter *> *matched_filters) const {
+    FlatpakPolicy max_policy = FLATPAK_POLICY_NONE;
+    std::string name = source;
+    bool exact_match = true;
+    
+    while (true) {
+        if (const std::vector<Filter *> *name_filters = find(name)) {
+            for (auto *filter : *name_filters) {
+                if (exact_match || filter->name_is_subtree) {
+                    max_policy = std::max(max_policy, filter->policy);
+                    if (matched_filters) {
+                        matched_filters->push_back(filter);
+                    }
+                }
+            }
+        }
+        
+        exact_match = false;
+        size_t dot = name.rfind('.');
+        if (dot == std::string::npos) break;
+        name.erase(dot);
+    }
+
+    return max_policy;
+}
+
+BroadcastDecision PolicyTable::broadcast_decision(const std::string& name, const std::string& path,
+                                                  const std::string& interface, const std::string& member) const {
+    std::string key = name;
+    key += '\0';
+    key += path;
+    key += '\0';
+    key += interface;
+    key += '\0';
+    key += member;
+
+    auto it = broadcast_decisions.find(key);
+    if (it != broadcast_decisions.end()) {
+        broadcast_lru.splice(broadcast_lru.begin(), broadcast_lru, it->second.lru);
+        return it->second.decision;
+    }
+
+    std::vector<Filter *> matched;
+    BroadcastDecision decision;
+    decision.policy = max_policy(name, &matched);
+    decision.allowed = decision.policy >= FLATPAK_POLICY_TALK ||
+                       any_filter_matches(matched, FILTER_TYPE_BROADCAST, path, interface, member);
+
+    // Paths are often unique per object, so the cache is bounded; dropping
+    // the least recently used entry keeps the hot decisions cached.
+    if (broadcast_decisions.size() >= BROADCAST_CACHE_MAX_ENTRIES) {
+        broadcast_decisions.erase(broadcast_decisions.find(*broadcast_lru.back()));
+        broadcast_lru.pop_back();
+    }
+    it = broadcast_decisions.emplace(std::move(key), BroadcastCacheEntry{decision, {}}).first;
+    broadcast_lru.push_front(&it->first);
+    it->second.lru = broadcast_lru.begin();
+    return decision;
+}
+
+bool PolicyTable::has_name(const std::string& name, bool *subtree) const {
+    bool found = false;
+    *subtree = false;
+
+    auto it = filters.find(name);
+    if (it != filters.end()) {
+        found = true;
+        for (auto filter : it->second) {
+            *subtree |= filter->name_is_subtree;
+        }
+    }
+
+    if (image) {
+        const PolicyImageName *entry = image->find_name(name);
+        if (entry) {
+            found = true;
+            *subtree |= (entry->flags & POLICY_IMAGE_NAME_SUBTREE) != 0;
+        }
+    }
+    return found;
+}
+
+void PolicyTable::for_each_name(const std::function<void(const std::string&, bool)>& fn) const {
+    bool subtree;
+
+    for (auto &[name, _] : filters) {
+        has_name(name, &subtree);
+        fn(name, subtree);
+    }
+
+    if (image) {
+        for (uint32_t i = 0; i < image->n_names(); ++i) {
+            const PolicyImageName *entry = image->name_at(i);
+            std::string name = image->string_at(entry->name);
+            if (filters.find(name) == filters.end()) {
+                fn(name, (entry->flags & POLICY_IMAGE_NAME_SUBTREE) != 0);
+            }
+        }
+    }
+}
+
+std::string PolicyTable::key() const {
+    std::vector<std::string> rules;
+
+    auto field = [](std::string *out, const std::string& value) {
+        *out += std::to_string(value.size()) + ":" + value;
+    };
+
+    for (auto &[name, filter_list] : filters) {
+        for (auto filter : filter_list) {
+            std::string rule;
+            field(&rule, name);
+            field(&rule, filter->path);
+            field(&rule, filter->interface);
+            field(&rule, filter->member);
+            rule += std::to_string(filter->name_is_subtree) + std::to_string(filter->policy) +
+                    std::to_string(filter->types) + std::to_string(filter->path_is_subtree);
+            rules.push_back(std::move(rule));
+        }
+    }
+    std::sort(rules.begin(), rules.end());
+
+    std::string key;
+    field(&key, image ? image->identity() : "");
+    for (auto &rule : rules) {
+        key += rule;
+    }
+    return key;
+}
+
+size_t PolicyTable::n_rules() const {
+    size_t n = image ? image->n_rules() : 0;
+    for (auto &[_, filter_list] : filters) {
+        n += filter_list.size();
+    }
+    return n;
+}
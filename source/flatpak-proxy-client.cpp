@@ -1,42 +1,61 @@
 #include "../headers/flatpak-proxy-client.h"
 #include "../headers/utils.h"
+#include "../headers/probes.h"
+#include "../headers/policy-args.h"
 #include <gio/gio.h>
 #include <gio/gunixsocketaddress.h>
+#include <map>
+#include <set>
+#include <sys/socket.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 void client_connected_to_dbus(GObject *source_object, GAsyncResult *res, void *user_data);
 void queue_expected_reply(ProxySide *side, uint32_t serial, ExpectedReplyType type);
 void queue_outgoing_buffer(ProxySide *side, Buffer *buffer);
+void queue_outgoing_message(ProxySide *side, Buffer *buffer, OutputLane lane,
+                            const std::string *sender, bool message_continues,
+                            const std::string *coalesce_key);
 ExpectedReplyType steal_expected_reply(ProxySide *side, uint32_t serial);
+void queue_initial_name_ops(FlatpakProxyClient *client);
+void queue_policy_name_ops(FlatpakProxyClient *client, const PolicyTable *previous);
 bool filter_matches(Filter *filter, FilterTypeMask type, const std::string& path, 
                    const std::string& interface, const std::string& member);
 bool any_filter_matches(const std::vector<Filter *>& filters, FilterTypeMask type,
                        const std::string& path, const std::string& interface, const std::string& member);
 
 FlatpakProxy::FlatpakProxy(const std::string& dbus_address, const std::string& socket_path) :
-    dbus_address(dbus_address), socket_path(socket_path) {
+    policy(std::make_shared<PolicyTable>()), dbus_address(dbus_address), socket_path(socket_path) {
     
     service = g_socket_service_new();
-    add_policy("org.freedesktop.DBus", false, FLATPAK_POLICY_TALK);
 }
 
 FlatpakProxy::~FlatpakProxy() {
-    if (service && g_socket_service_is_active(G_SOCKET_SERVICE(service))) {
+    if (socket_path_bound) {
         std::filesystem::remove(socket_path);
     }
+    if (stats_socket_bound) {
+        std::filesystem::remove(stats_socket_path);
+    }
+    unwatch_departures();
 
     assert(clients.empty());
-    
-    for (auto &[_, filter_list] : filters) {
-        for (auto filter : filter_list) {
-            delete filter;
-        }
+    if (release_idle_id) {
+        g_source_remove(release_idle_id);
     }
-    filters.clear();
+    closed_clients.clear();
     
     if (service) {
         g_object_unref(service);
         service = nullptr;
     }
+
+    if (stats_service) {
+        g_object_unref(stats_service);
+        stats_service = nullptr;
+    }
 }
 
 void FlatpakProxy::set_filter(bool filter) {
@@ -47,46 +66,144 @@ void FlatpakProxy::set_sloppy_names(bool sloppy_names) {
     this->sloppy_names = sloppy_names;
 }
 
+void FlatpakProxy::set_coalesce_properties(bool coalesce) {
+    this->coalesce_properties = coalesce;
+}
+
 void FlatpakProxy::set_log_messages(bool log) {
     this->log_messages = log;
 }
 
-void FlatpakProxy::add_filter(Filter *filter) {
-    filters[filter->name].push_back(filter);
+void FlatpakProxy::set_watermarks(size_t high, size_t low) {
+    this->high_watermark = high;
+    this->low_watermark = low;
+}
+
+void FlatpakProxy::set_client_memory_limits(size_t soft, size_t hard) {
+    this->client_memory_soft_limit = soft;
+    this->client_memory_hard_limit = hard;
+}
+
+void FlatpakProxy::set_reply_timeout(unsigned int seconds) {
+    this->reply_timeout = seconds;
+}
+
+void FlatpakProxy::set_idle_trim(unsigned int seconds) {
+    this->idle_trim = seconds;
+}
+
+void FlatpakProxy::set_cut_through(size_t threshold) {
+    this->cut_through_threshold = threshold;
+}
+
+void FlatpakProxy::set_listen_fd(int fd) {
+    this->listen_fd = fd;
+}
+
+void FlatpakProxy::set_capture(const std::string& path) {
+    this->capture_path = path;
+}
+
+void FlatpakProxy::set_policy_args(const std::string& path) {
+    this->policy_args_path = path;
+}
+
+void FlatpakProxy::set_policy_file(const std::string& path) {
+    this->policy_file_path = path;
+}
+
+bool FlatpakProxy::has_policy_source() const {
+    return !policy_args_path.empty() || !policy_file_path.empty();
+}
+
+const std::string& FlatpakProxy::get_socket_path() const {
+    return socket_path;
 }
 
+// Rules can only be added before the proxy starts; afterwards the table is
+// shared with clients and changes go through reload_policy().
 void FlatpakProxy::add_policy(const std::string& name, bool name_is_subtree, FlatpakPolicy policy) {
-    Filter *filter = new Filter(name, name_is_subtree, policy);
-    add_filter(filter);
+    this->policy->add_policy(name, name_is_subtree, policy);
 }
 
 void FlatpakProxy::add_call_rule(const std::string& name, bool name_is_subtree, const std::string& rule) {
-    Filter *filter = new Filter(name, name_is_subtree, FILTER_TYPE_CALL, rule);
-    add_filter(filter);
+    policy->add_call_rule(name, name_is_subtree, rule);
 }
 
 void FlatpakProxy::add_broadcast_rule(const std::string& name, bool name_is_subtree, const std::string& rule) {
-    Filter *filter = new Filter(name, name_is_subtree, FILTER_TYPE_BROADCAST, rule);
-    add_filter(filter);
+    policy->add_broadcast_rule(name, name_is_subtree, rule);
+}
+
+// Builds a new table from the command line rules plus the --policy-args
+// and --policy-file files and swaps it in. Clients pick it up lazily; on
+// any error the current table stays in place.
+bool FlatpakProxy::reload_policy() {
+    if (!base_policy) {
+        base_policy = policy;
+    }
+    auto table = std::make_shared<PolicyTable>(*base_policy);
+
+    if (!policy_args_path.empty() && !load_policy_rules(policy_args_path, table.get())) {
+        std::cerr << "Keeping the previous policy for " << socket_path << "\n";
+        return false;
+    }
+
+    if (!policy_file_path.empty()) {
+        auto image = std::make_shared<PolicyImage>();
+        if (!image->open(policy_file_path)) {
+            std::cerr << "Keeping the previous policy for " << socket_path << "\n";
+            return false;
+        }
+        table->image = std::move(image);
+    }
+
+    policy = std::move(table);
+    ++policy_generation;
+    std::cerr << "Loaded policy generation " << policy_generation << " for " << socket_path
+              << " with " << policy->n_rules() << " rules\n";
+    PROXY_PROBE2(policy_reloaded, this, policy_generation);
+    return true;
 }
 
 bool FlatpakProxy::start() {
-    std::filesystem::remove(socket_path);
+    if (has_policy_source() && !reload_policy()) {
+        return false;
+    }
 
     GError *error = nullptr;
-    GSocketAddress *s_address = g_unix_socket_address_new(socket_path.c_str());
-    
-    bool res = g_socket_listener_add_address(
-        G_SOCKET_LISTENER(service),
-        s_address,
-        G_SOCKET_TYPE_STREAM,
-        G_SOCKET_PROTOCOL_DEFAULT,
-        nullptr,
-        nullptr,
-        &error
-    );
+    bool res;
 
-    g_object_unref(s_address);
+    if (listen_fd >= 0) {
+        int listening = 0;
+        socklen_t len = sizeof(listening);
+        if (getsockopt(listen_fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) != 0 || !listening) {
+            std::cerr << "Fd " << listen_fd << " is not a listening socket\n";
+            return false;
+        }
+
+        GSocket *socket = g_socket_new_from_fd(listen_fd, &error);
+        res = socket && g_socket_listener_add_socket(G_SOCKET_LISTENER(service), socket, nullptr, &error);
+        if (socket) {
+            g_object_unref(socket);
+        }
+    } else {
+        std::filesystem::remove(socket_path);
+
+        GSocketAddress *s_address = g_unix_socket_address_new(socket_path.c_str());
+        
+        res = g_socket_listener_add_address(
+            G_SOCKET_LISTENER(service),
+            s_address,
+            G_SOCKET_TYPE_STREAM,
+            G_SOCKET_PROTOCOL_DEFAULT,
+            nullptr,
+            nullptr,
+            &error
+        );
+
+        g_object_unref(s_address);
+        socket_path_bound = res;
+    }
 
     if (!res) {
         if (error) {
@@ -107,11 +224,142 @@ bool FlatpakProxy::start() {
     );
 
     g_socket_service_start(G_SOCKET_SERVICE(service));
+
+    if (!stats_socket_path.empty() && !start_stats()) {
+        return false;
+    }
+
+    if (filter) {
+        watch_departures();
+    }
+
+    if (!capture_path.empty()) {
+        capture = std::make_unique<CaptureWriter>();
+        if (!capture->open(capture_path)) {
+            return false;
+        }
+    }
+
+    if (reply_timeout > 0) {
+        // Entries expire between REPLY_WHEEL_SLOTS - 1 and REPLY_WHEEL_SLOTS
+        // ticks after they were queued.
+        unsigned int tick_seconds = std::max(1u, (reply_timeout + REPLY_WHEEL_SLOTS - 2) / (REPLY_WHEEL_SLOTS - 1));
+        reply_tick = 0;
+        reply_timer_id = g_timeout_add_seconds(
+            tick_seconds,
+            +[](gpointer data) -> gboolean {
+                auto *proxy = static_cast<FlatpakProxy *>(data);
+                ++proxy->reply_tick;
+                for (auto &client : proxy->clients) {
+                    client->expire_replies(proxy->reply_tick);
+                }
+                return G_SOURCE_CONTINUE;
+            },
+            this
+        );
+    }
+
+    if (idle_trim > 0) {
+        trim_timer_id = g_timeout_add_seconds(
+            idle_trim,
+            +[](gpointer data) -> gboolean {
+                static_cast<FlatpakProxy *>(data)->trim_idle_clients();
+                return G_SOURCE_CONTINUE;
+            },
+            this
+        );
+    }
     return true;
 }
 
+// Drops every client of a proxy that is going away. Their sockets are
+// closed without flushing and their sources removed; a client still waiting for its bus connection
+// sees that it was detached when the connection completes.
+void FlatpakProxy::close_clients() {
+    std::list<std::shared_ptr<FlatpakProxyClient>> closing;
+    closing.swap(clients);
+    closing.insert(closing.end(), closed_clients.begin(), closed_clients.end());
+    closed_clients.clear();
+    if (release_idle_id) {
+        g_source_remove(release_idle_id);
+        release_idle_id = 0;
+    }
+
+    for (auto &client : closing) {
+        for (ProxySide *side : {&client->client_side, &client->bus_side}) {
+            if (side->connection && !side->closed) {
+                g_socket_close(g_socket_connection_get_socket(side->connection), nullptr);
+            }
+            side->closed = true;
+            side->cleanup();
+            side->client.reset();
+        }
+        retired_stats.add(client->stats);
+        client->proxy = nullptr;
+    }
+}
+
+// Called once both sides of `client` are closed. Callers up the stack may
+// still be using it, so the last reference is dropped from an idle callback.
+void FlatpakProxy::release_client(std::shared_ptr<FlatpakProxyClient> client) {
+    clients.remove(client);
+    closed_clients.push_back(std::move(client));
+
+    if (release_idle_id == 0) {
+        release_idle_id = g_idle_add(
+            +[](gpointer data) -> gboolean {
+                auto *proxy = static_cast<FlatpakProxy *>(data);
+                std::vector<std::shared_ptr<FlatpakProxyClient>> closed;
+                closed.swap(proxy->closed_clients);
+                proxy->release_idle_id = 0;
+                return G_SOURCE_REMOVE;
+            },
+            this
+        );
+    }
+}
+
+// Trims clients that have not handled a message for a whole interval, then
+// hands the freed memory back to the system.
+void FlatpakProxy::trim_idle_clients() {
+    int64_t cutoff = monotonic_ns() - static_cast<int64_t>(idle_trim) * 1000000000;
+    size_t trimmed = 0;
+
+    for (auto &client : clients) {
+        if (!client->trimmed && client->last_active < cutoff) {
+            client->trim();
+            ++trimmed;
+        }
+    }
+
+    if (trimmed > 0) {
+#ifdef __GLIBC__
+        malloc_trim(0);
+#endif
+        if (log_messages) {
+            std::cerr << "Trimmed " << trimmed << " idle clients\n";
+        }
+    }
+}
+
 void FlatpakProxy::stop() {
-    std::filesystem::remove(socket_path);
+    if (socket_path_bound) {
+        std::filesystem::remove(socket_path);
+        socket_path_bound = false;
+    }
+    if (reply_timer_id) {
+        g_source_remove(reply_timer_id);
+        reply_timer_id = 0;
+    }
+    if (trim_timer_id) {
+        g_source_remove(trim_timer_id);
+        trim_timer_id = 0;
+    }
+    stop_stats();
+    unwatch_departures();
+    if (capture) {
+        capture->close();
+    }
     if (service) {
         g_socket_service_stop(G_SOCKET_SERVICE(service));
     }
@@ -119,7 +367,9 @@ void FlatpakProxy::stop() {
 
 bool FlatpakProxy::incoming_connection(GSocketService *, GSocketConnection *conn) {
     auto client = std::make_shared<FlatpakProxyClient>(this, conn);
+    client->id = ++next_client_id;
     client->init_side(client, conn);
+    PROXY_PROBE1(client_connect, client.get());
     
     auto client_ptr = new std::shared_ptr<FlatpakProxyClient>(client);
     g_dbus_address_get_stream(
@@ -150,6 +400,11 @@ void client_connected_to_dbus(GObject *, GAsyncResult *res, void *user_data) {
         return;
     }
 
+    if (client->proxy == nullptr) {
+        g_object_unref(stream);
+        return;
+    }
+
     GSocketConnection *connection = G_SOCKET_CONNECTION(stream);
     GSocket *socket = g_socket_connection_get_socket(connection);
     g_socket_set_blocking(socket, FALSE);
@@ -160,7 +415,7 @@ void client_connected_to_dbus(GObject *, GAsyncResult *res, void *user_data) {
 }
 
 FlatpakProxyClient::FlatpakProxyClient(FlatpakProxy *proxy, GSocketConnection *) :
-    proxy(proxy) {
+    proxy(proxy), policy(proxy->policy), last_active(monotonic_ns()) {
 }
 
 void FlatpakProxyClient::init_side(std::shared_ptr<FlatpakProxyClient> self, GSocketConnection *client_conn) {
@@ -174,36 +429,127 @@ void FlatpakProxyClient::init_side(std::shared_ptr<FlatpakProxyClient> self, GSo
 }
 
 FlatpakProxyClient::~FlatpakProxyClient() {
+    PROXY_PROBE1(client_close, this);
+
     if (proxy) {
+        proxy->retired_stats.add(stats);
         proxy->clients.remove_if([this](const std::shared_ptr<FlatpakProxyClient>& c) {
             return c.get() == this;
         });
     }
 
-    for (auto &[_, msg] : rewrite_reply) {
-        g_object_unref(msg);
+    if (rewrites) {
+        rewrites->rewrite_reply.for_each([](uint32_t, GDBusMessage *msg) {
+            g_object_unref(msg);
+        });
     }
-    rewrite_reply.clear();
-    get_owner_reply.clear();
     unique_id_policy.clear();
     unique_id_owned_names.clear();
 }
 
 void queue_expected_reply(ProxySide *side, uint32_t serial, ExpectedReplyType type) {
-    side->expected_replies[serial] = type;
+    ExpectedReply reply;
+    reply.type = type;
+    reply.queued_at = monotonic_ns();
+    side->expected_replies.insert(serial, reply, side->client->proxy->reply_tick);
 }
 
 ExpectedReplyType steal_expected_reply(ProxySide *side, uint32_t serial) {
-    auto it = side->expected_replies.find(serial);
-    if (it != side->expected_replies.end()) {
-        ExpectedReplyType type = it->second;
-        side->expected_replies.erase(it);
-        return type;
+    ExpectedReply reply;
+    if (!side->expected_replies.steal(serial, &reply)) {
+        return EXPECTED_REPLY_NONE;
+    }
+
+    // The proxy's own fake calls are not part of the client's round trips.
+    if (reply.type != EXPECTED_REPLY_FILTER &&
+        reply.type != EXPECTED_REPLY_FAKE_GET_NAME_OWNER &&
+        reply.type != EXPECTED_REPLY_FAKE_LIST_NAMES) {
+        LatencyDirection direction = (side == &side->client->client_side) ? LATENCY_TO_BUS : LATENCY_TO_CLIENT;
+        side->client->proxy->latency.round_trip[direction].record(monotonic_ns() - reply.queued_at);
+    }
+    return reply.type;
+}
+
+ReplyRewrites& FlatpakProxyClient::get_rewrites() {
+    if (!rewrites) {
+        rewrites = std::make_unique<ReplyRewrites>();
+    }
+    return *rewrites;
+}
+
+// Drops what an idle client can rebuild on demand. Only called from the
+// proxy's trim timer, never while a message is being handled.
+void FlatpakProxyClient::trim() {
+    client_side.trim();
+    bus_side.trim();
+
+    if (rewrites) {
+        if (rewrites->rewrite_reply.empty() && rewrites->get_owner_reply.empty()) {
+            rewrites.reset();
+        } else {
+            rewrites->rewrite_reply.trim();
+            rewrites->get_owner_reply.trim();
+        }
+    }
+
+    // Emptied maps keep their buckets.
+    if (unique_id_policy.empty()) {
+        decltype(unique_id_policy)().swap(unique_id_policy);
+    }
+    if (unique_id_owned_names.empty()) {
+        decltype(unique_id_owned_names)().swap(unique_id_owned_names);
+    }
+
+    trimmed = true;
+}
+
+void FlatpakProxyClient::queue_rewrite_reply(uint32_t serial, GDBusMessage *reply) {
+    SerialTable<GDBusMessage *> &rewrite_reply = get_rewrites().rewrite_reply;
+    GDBusMessage *old_reply = nullptr;
+    if (rewrite_reply.steal(serial, &old_reply)) {
+        g_object_unref(old_reply);
+    }
+    rewrite_reply.insert(serial, reply, proxy->reply_tick);
+    PROXY_PROBE2(reply_synthesized, this, serial);
+}
+
+void FlatpakProxyClient::expire_replies(uint32_t tick) {
+    size_t expired = client_side.expected_replies.expire(tick, [](uint32_t, const ExpectedReply&) {});
+    expired += bus_side.expected_replies.expire(tick, [](uint32_t, const ExpectedReply&) {});
+
+    if (rewrites) {
+        rewrites->rewrite_reply.expire(tick, [](uint32_t, GDBusMessage *msg) {
+            g_object_unref(msg);
+        });
+        rewrites->get_owner_reply.expire(tick, [this](uint32_t, const std::string &name) {
+            accounted_name_bytes -= name.size();
+        });
+    }
+
+    if (expired > 0 && proxy->log_messages) {
+        std::cerr << "Expired " << expired << " expected replies\n";
+    }
+}
+
+OutputLane output_lane_for_type(uint8_t type) {
+    switch (type) {
+        case G_DBUS_MESSAGE_TYPE_METHOD_RETURN:
+        case G_DBUS_MESSAGE_TYPE_ERROR:
+            return OUTPUT_LANE_REPLY;
+        case G_DBUS_MESSAGE_TYPE_METHOD_CALL:
+            return OUTPUT_LANE_CALL;
+        default:
+            return OUTPUT_LANE_SIGNAL;
     }
-    return EXPECTED_REPLY_NONE;
 }
 
 void queue_outgoing_buffer(ProxySide *side, Buffer *buffer) {
+    queue_outgoing_message(side, buffer, OUTPUT_LANE_SIGNAL, nullptr, false, nullptr);
+}
+
+// Wakes the writer for a buffer just queued on `side`, and pauses the
+// other side if the queue has grown past the high watermark.
+static void outgoing_buffer_queued(ProxySide *side, Buffer *buffer) {
     if (side->out_source == nullptr) {
         GSocket *socket = g_socket_connection_get_socket(side->connection);
         side->out_source = g_socket_create_source(socket, G_IO_OUT, nullptr);
@@ -212,7 +558,34 @@ void queue_outgoing_buffer(ProxySide *side, Buffer *buffer) {
         g_source_unref(side->out_source);
     }
 
-    side->buffers.push_back(buffer);
+    side->queued_bytes += buffer->size;
+    PROXY_PROBE4(buffer_queued, side->client.get(), side == &side->client->bus_side,
+                 buffer->size, side->queued_bytes);
+
+    ProxySide *other_side = side->get_other_side();
+    if (side->queued_bytes >= side->client->proxy->high_watermark && !other_side->read_paused) {
+        if (side->client->proxy->log_messages) {
+            std::cerr << "Output queue at " << side->queued_bytes << " bytes, pausing "
+                      << (other_side == &side->client->client_side ? "client" : "bus") << " side\n";
+        }
+        other_side->pause_reading();
+    }
+}
+
+// Queues `buffer` in `lane`, see OutputQueue; a null `sender` keeps it in
+// order with everything queued before.
+void queue_outgoing_message(ProxySide *side, Buffer *buffer, OutputLane lane,
+                            const std::string *sender, bool message_continues,
+                            const std::string *coalesce_key) {
+    side->buffers.push(buffer, lane, sender, message_continues, coalesce_key);
+    outgoing_buffer_queued(side, buffer);
+}
+
+// Queues the next body chunk of the message whose head was queued with
+// `message_continues`.
+void queue_outgoing_chunk(ProxySide *side, Buffer *buffer, bool message_continues) {
+    side->buffers.push_chunk(buffer, message_continues);
+    outgoing_buffer_queued(side, buffer);
 }
 
 bool filter_matches(Filter *filter, FilterTypeMask type, const std::string& path,
@@ -291,86 +664,268 @@ FlatpakPolicy FlatpakProxyClient::get_max_policy_and_matched(const std::string&
         return max_policy;
     }
 
-    std::string name = source;
-    bool exact_match = true;
-    
-    while (true) {
-        auto it = proxy->filters.find(name);
-        if (it != proxy->filters.end()) {
-            for (auto *filter : it->second) {
-                if (exact_match || filter->name_is_subtree) {
-                    max_policy = std::max(max_policy, filter->policy);
-                    if (matched_filters) {
-                        matched_filters->push_back(filter);
-                    }
-                }
-            }
-        }
-        
-        exact_match = false;
-        size_t dot = name.rfind('.');
-        if (dot == std::string::npos) break;
-        name.erase(dot);
+    return policy->max_policy(source, matched_filters);
+}
+
+// Decides whether a broadcast reaches the client. A unique sender counts
+// as the names this client has seen it own; the decision for each name
+// comes from the policy table's cache, so only the lookup of the sender's
+// names is done per client.
+bool FlatpakProxyClient::broadcast_allowed(Header *header, FlatpakPolicy *max_policy) {
+    const std::string &sender = header->sender;
+
+    if (sender.empty()) {
+        *max_policy = FLATPAK_POLICY_TALK;
+        return true;
+    }
+
+    if (sender[0] != ':') {
+        BroadcastDecision decision = policy->broadcast_decision(sender, header->path, header->interface, header->member);
+        *max_policy = decision.policy;
+        return decision.allowed;
     }
 
-    return max_policy;
+    *max_policy = FLATPAK_POLICY_NONE;
+    auto it = unique_id_policy.find(sender);
+    if (it != unique_id_policy.end()) {
+        *max_policy = it->second;
+    }
+    bool allowed = *max_policy >= FLATPAK_POLICY_TALK;
+
+    auto owned = unique_id_owned_names.find(sender);
+    if (owned != unique_id_owned_names.end()) {
+        for (const std::string &name : owned->second) {
+            BroadcastDecision decision = policy->broadcast_decision(name, header->path, header->interface, header->member);
+            *max_policy = std::max(*max_policy, decision.policy);
+            allowed |= decision.allowed;
+        }
+    }
+    return allowed;
 }
 
 void FlatpakProxyClient::update_unique_id_policy(const std::string& unique_id, FlatpakPolicy policy) {
     if (policy > FLATPAK_POLICY_NONE) {
-        FlatpakPolicy old_policy = unique_id_policy[unique_id];
-        if (policy > old_policy) {
-            unique_id_policy[unique_id] = policy;
+        auto it = unique_id_policy.find(unique_id);
+        if (it == unique_id_policy.end()) {
+            if (proxy->recently_departed(unique_id)) {
+                return;
+            }
+            it = unique_id_policy.emplace(unique_id, FLATPAK_POLICY_NONE).first;
+            accounted_name_bytes += unique_id.size();
+        }
+        if (policy > it->second) {
+            it->second = policy;
         }
     }
 }
 
 void FlatpakProxyClient::add_unique_id_owned_name(const std::string& unique_id, const std::string& owned_name) {
-    unique_id_owned_names[unique_id].push_back(owned_name);
+    if (proxy->recently_departed(unique_id)) {
+        return;
+    }
+
+    auto [it, inserted] = unique_id_owned_names.try_emplace(unique_id);
+    if (inserted) {
+        accounted_name_bytes += unique_id.size();
+    } else if (std::find(it->second.begin(), it->second.end(), owned_name) != it->second.end()) {
+        return;
+    }
+    it->second.push_back(owned_name);
+    accounted_name_bytes += sizeof(std::string) + owned_name.size();
 }
 
-bool FlatpakProxyClient::validate_arg0_name(Buffer *buffer, FlatpakPolicy required_policy, FlatpakPolicy *has_policy) {
-    GDBusMessage *message = g_dbus_message_new_from_blob(
-        buffer->data.data(), buffer->size, static_cast<GDBusCapabilityFlags>(0), nullptr);
-    
-    if (has_policy) {
-        *has_policy = FLATPAK_POLICY_NONE;
+// Give the bucket array back once most of a table has been evicted.
+template <typename Map>
+void shrink_if_sparse(Map &map) {
+    if (map.bucket_count() > 64 && map.size() * 8 < map.bucket_count()) {
+        map.rehash(0);
     }
+}
 
-    if (!message) {
-        return false;
+void FlatpakProxyClient::remove_unique_id_owned_name(const std::string& unique_id, const std::string& owned_name) {
+    auto it = unique_id_owned_names.find(unique_id);
+    if (it == unique_id_owned_names.end()) {
+        return;
     }
 
-    GVariant *body = g_dbus_message_get_body(message);
-    if (!body) {
-        g_object_unref(message);
-        return false;
+    auto name = std::find(it->second.begin(), it->second.end(), owned_name);
+    if (name == it->second.end()) {
+        return;
     }
 
-    GVariant *arg0 = g_variant_get_child_value(body, 0);
-    if (arg0 && g_variant_is_of_type(arg0, G_VARIANT_TYPE_STRING)) {
-        const char *name = g_variant_get_string(arg0, nullptr);
-        FlatpakPolicy name_policy = get_max_policy(name);
+    accounted_name_bytes -= sizeof(std::string) + name->size();
+    it->second.erase(name);
 
-        if (has_policy) {
-            *has_policy = name_policy;
+    if (it->second.empty()) {
+        accounted_name_bytes -= it->first.size();
+        unique_id_owned_names.erase(it);
+        shrink_if_sparse(unique_id_owned_names);
+    }
+}
+
+void FlatpakProxyClient::forget_unique_id(const std::string& unique_id) {
+    auto policy = unique_id_policy.find(unique_id);
+    if (policy != unique_id_policy.end()) {
+        accounted_name_bytes -= policy->first.size();
+        unique_id_policy.erase(policy);
+        shrink_if_sparse(unique_id_policy);
+    }
+
+    auto owned = unique_id_owned_names.find(unique_id);
+    if (owned != unique_id_owned_names.end()) {
+        accounted_name_bytes -= owned->first.size();
+        for (const std::string &name : owned->second) {
+            accounted_name_bytes -= sizeof(std::string) + name.size();
         }
+        unique_id_owned_names.erase(owned);
+        shrink_if_sparse(unique_id_owned_names);
+    }
+}
 
-        if (name_policy >= required_policy) {
-            g_variant_unref(arg0);
-            g_object_unref(message);
-            return true;
+// Moves the client onto the proxy's current policy table after a reload:
+// owners of names it may no longer see are forgotten, and once the initial
+// name ops have gone out, names the new table adds are tracked and names
+// it drops are not. Those name ops go to the bus, so the move waits while
+// a client message is being streamed there.
+void FlatpakProxyClient::refresh_policy() {
+    if (policy == proxy->policy || client_side.stream_remaining > 0) {
+        return;
+    }
+
+    std::shared_ptr<const PolicyTable> previous = std::move(policy);
+    policy = proxy->policy;
+
+    for (auto it = unique_id_owned_names.begin(); it != unique_id_owned_names.end();) {
+        auto &names = it->second;
+        for (auto name = names.begin(); name != names.end();) {
+            if (get_max_policy(*name) < FLATPAK_POLICY_SEE) {
+                accounted_name_bytes -= sizeof(std::string) + name->size();
+                name = names.erase(name);
+            } else {
+                ++name;
+            }
         }
 
-        if (proxy->log_messages) {
-            std::cerr << "Filtering message due to arg0 " << name
-                      << ", policy: " << name_policy
-                      << " (required " << required_policy << ")\n";
+        if (names.empty()) {
+            accounted_name_bytes -= it->first.size();
+            it = unique_id_owned_names.erase(it);
+        } else {
+            ++it;
         }
     }
+    shrink_if_sparse(unique_id_owned_names);
 
-    if (arg0) g_variant_unref(arg0);
-    g_object_unref(message);
+    if (name_ops_queued) {
+        queue_policy_name_ops(this, previous.get());
+    }
+
+    PROXY_PROBE2(policy_refreshed, this, proxy->policy_generation);
+    if (proxy->log_messages) {
+        std::cerr << "Client " << id << " moved to policy generation " << proxy->policy_generation << "\n";
+    }
+}
+
+// Node-based containers: the value plus a next pointer and cached hash per
+// entry, and one pointer per bucket.
+template <typename Map>
+size_t map_footprint(const Map &map) {
+    return map.size() * (sizeof(typename Map::value_type) + 2 * sizeof(void *)) +
+           map.bucket_count() * sizeof(void *);
+}
+
+size_t side_footprint(const ProxySide &side) {
+    size_t usage = side.queued_bytes +
+                   side.buffers.size() * (sizeof(Buffer) + 2 * sizeof(void *)) +
+                   side.auth_scratch.capacity() +
+                   side.expected_replies.footprint();
+
+    if (side.current_read_buffer && side.current_read_buffer != side.header_buffer) {
+        usage += side.current_read_buffer->size;
+    }
+    return usage;
+}
+
+size_t FlatpakProxyClient::memory_usage() const {
+    size_t usage = sizeof(FlatpakProxyClient) +
+                   side_footprint(client_side) +
+                   side_footprint(bus_side) +
+                   map_footprint(unique_id_policy) +
+                   map_footprint(unique_id_owned_names) +
+                   accounted_name_bytes;
+
+    if (rewrites) {
+        usage += sizeof(ReplyRewrites) +
+                 rewrites->rewrite_reply.footprint() + rewrites->rewrite_reply.size() * REWRITE_REPLY_ESTIMATE +
+                 rewrites->get_owner_reply.footprint();
+    }
+    return usage;
+}
+
+bool FlatpakProxyClient::check_memory_quota() {
+    if (proxy->client_memory_hard_limit == 0) {
+        return true;
+    }
+
+    size_t usage = memory_usage();
+
+    if (usage > proxy->client_memory_hard_limit) {
+        std::cerr << "Client exceeded memory limit (" << usage << " > "
+                  << proxy->client_memory_hard_limit << " bytes), disconnecting\n";
+        disconnect();
+        return false;
+    }
+
+    if (usage > proxy->client_memory_soft_limit) {
+        if (!over_soft_limit) {
+            std::cerr << "Client memory usage " << usage << " bytes above soft limit of "
+                      << proxy->client_memory_soft_limit << " bytes\n";
+        }
+        over_soft_limit = true;
+    } else {
+        over_soft_limit = false;
+    }
+    return true;
+}
+
+void FlatpakProxyClient::disconnect() {
+    for (ProxySide *side : {&client_side, &bus_side}) {
+        side->buffers.clear();
+        side->queued_bytes = 0;
+    }
+
+    if (!client_side.closed) {
+        client_side.side_closed();
+    } else if (!bus_side.closed) {
+        bus_side.side_closed();
+    }
+}
+
+bool FlatpakProxyClient::validate_arg0_name(Header *header, FlatpakPolicy required_policy, FlatpakPolicy *has_policy) {
+    if (has_policy) {
+        *has_policy = FLATPAK_POLICY_NONE;
+    }
+
+    const std::vector<std::string> *args = header->string_args(1);
+    if (!args) {
+        return false;
+    }
+
+    const std::string &name = (*args)[0];
+    FlatpakPolicy name_policy = get_max_policy(name);
+
+    if (has_policy) {
+        *has_policy = name_policy;
+    }
+
+    if (name_policy >= required_policy) {
+        return true;
+    }
+
+    if (proxy->log_messages) {
+        std::cerr << "Filtering message due to arg0 " << name
+                  << ", policy: " << name_policy
+                  << " (required " << required_policy << ")\n";
+    }
     return false;
 }
 
@@ -418,18 +973,18 @@ Buffer *get_ping_buffer_for_header(Header *header) {
 Buffer *FlatpakProxyClient::get_error_for_roundtrip(Header *header, const char *error_name) {
     Buffer *ping_buffer = get_ping_buffer_for_header(header);
     GDBusMessage *reply = get_error_for_header(header, error_name);
-    rewrite_reply[header->serial] = reply;
+    queue_rewrite_reply(header->serial, reply);
     return ping_buffer;
 }
 
 Buffer *FlatpakProxyClient::get_bool_reply_for_roundtrip(Header *header, bool val) {
     Buffer *ping_buffer = get_ping_buffer_for_header(header);
     GDBusMessage *reply = get_bool_reply_for_header(header, val);
-    rewrite_reply[header->serial] = reply;
+    queue_rewrite_reply(header->serial, reply);
     return ping_buffer;
 }
 
-BusHandler get_dbus_method_handler(FlatpakProxyClient *client, Header *header) {
+BusHandler get_dbus_method_handler(FlatpakProxyClient *client, Header *header, FlatpakPolicy *policy_out = nullptr) {
     if (header->has_reply_serial) {
         ExpectedReplyType expected_reply = steal_expected_reply(&client->bus_side, header->reply_serial);
         if (expected_reply == EXPECTED_REPLY_NONE)
@@ -439,6 +994,7 @@ BusHandler get_dbus_method_handler(FlatpakProxyClient *client, Header *header) {
 
     std::vector<Filter *> filters;
     FlatpakPolicy policy = client->get_max_policy_and_matched(header->destination, &filters);
+    if (policy_out) *policy_out = policy;
     
     if (policy < FLATPAK_POLICY_SEE) return HANDLE_HIDE;
     if (policy < FLATPAK_POLICY_TALK) return HANDLE_DENY;
@@ -482,65 +1038,36 @@ FlatpakPolicy policy_from_handler(BusHandler handler) {
     }
 }
 
-bool validate_arg0_match(Buffer *buffer) {
-    GDBusMessage *message = g_dbus_message_new_from_blob(
-        buffer->data.data(), buffer->size, static_cast<GDBusCapabilityFlags>(0), nullptr);
-
-    bool result = true;
-    if (message) {
-        GVariant *body = g_dbus_message_get_body(message);
-        if (body) {
-            GVariant *arg0 = g_variant_get_child_value(body, 0);
-            if (arg0 && g_variant_is_of_type(arg0, G_VARIANT_TYPE_STRING)) {
-                std::string match = g_variant_get_string(arg0, nullptr);
-                if (match.find("eavesdrop=") != std::string::npos) {
-                    result = false;
-                }
-            }
-            if (arg0) g_variant_unref(arg0);
-        }
-        g_object_unref(message);
-    }
-    return result;
+bool validate_arg0_match(Header *header) {
+    const std::vector<std::string> *args = header->string_args(1);
+    return !args || (*args)[0].find("eavesdrop=") == std::string::npos;
 }
 
-std::list<GSocketControlMessage *> side_get_n_unix_fds(ProxySide *side, int n_fds) {
-    while (!side->control_messages.empty()) {
-        auto it = side->control_messages.begin();
-        GSocketControlMessage *msg = *it;
-        
-        if (G_IS_UNIX_FD_MESSAGE(msg)) {
-            GUnixFDMessage *fd_msg = G_UNIX_FD_MESSAGE(msg);
-            GUnixFDList *fd_list = g_unix_fd_message_get_fd_list(fd_msg);
-            int len = g_unix_fd_list_get_length(fd_list);
-            
-            if (len != n_fds) {
-                std::cerr << "Not right nr of fds in socket message\n";
-                return {};
-            }
-            
-            side->control_messages.erase(it);
-            return {msg};
-        }
-        
-        g_object_unref(msg);
-        side->control_messages.erase(it);
+// Queues the fds that arrived with `buffer` on the side and hands the
+// message exactly as many as its header declares. Reads never cross a
+// message boundary, so anything still queued afterwards was sent
+// alongside this message without being declared and is closed.
+bool update_socket_messages(ProxySide *side, Buffer *buffer, Header *header) {
+    side->fds.insert(side->fds.end(), buffer->fds.begin(), buffer->fds.end());
+    buffer->fds.clear();
+
+    if (side->fds.size() < header->unix_fds) {
+        std::cerr << "Not enough fds for message\n";
+        side->side_closed();
+        buffer->unref();
+        return false;
     }
-    return {};
-}
 
-bool update_socket_messages(ProxySide *side, Buffer *buffer, Header *header) {
-    side->control_messages.splice(side->control_messages.end(), buffer->control_messages);
-    buffer->control_messages.clear();
-    
-    if (header->unix_fds > 0) {
-        buffer->control_messages = side_get_n_unix_fds(side, header->unix_fds);
-        if (buffer->control_messages.empty()) {
-            std::cerr << "Not enough fds for message\n";
-            side->side_closed();
-            buffer->unref();
-            return false;
+    auto claimed = side->fds.begin() + header->unix_fds;
+    buffer->fds.assign(side->fds.begin(), claimed);
+    side->fds.erase(side->fds.begin(), claimed);
+
+    if (!side->fds.empty()) {
+        std::cerr << "Closing " << side->fds.size() << " undeclared fds\n";
+        for (int fd : side->fds) {
+            close(fd);
         }
+        side->fds.clear();
     }
     return true;
 }
@@ -548,6 +1075,16 @@ bool update_socket_messages(ProxySide *side, Buffer *buffer, Header *header) {
 void FlatpakProxyClient::got_buffer_from_client(Buffer *buffer) {
     ExpectedReplyType expecting_reply = EXPECTED_REPLY_NONE;
     ProxySide *side = &client_side;
+    int64_t framed_at = buffer->framed_at;
+
+    last_active = framed_at ? framed_at : monotonic_ns();
+    trimmed = false;
+    refresh_policy();
+
+    if (auth_state == AUTH_COMPLETE) {
+        ++stats.messages_from_client;
+        stats.bytes_from_client += buffer->size;
+    }
 
     if (auth_state == AUTH_COMPLETE && proxy->filter) {
         Header header;
@@ -560,6 +1097,9 @@ void FlatpakProxyClient::got_buffer_from_client(Buffer *buffer) {
             return;
         }
 
+        PROXY_PROBE6(header_parsed, this, false, header.type, header.serial,
+                     header.interface.c_str(), header.member.c_str());
+
         if (!update_socket_messages(side, buffer, &header)) {
             return;
         }
@@ -580,12 +1120,15 @@ void FlatpakProxyClient::got_buffer_from_client(Buffer *buffer) {
             hello_serial = header.serial;
         }
 
-        BusHandler handler = get_dbus_method_handler(this, &header);
+        FlatpakPolicy policy = FLATPAK_POLICY_NONE;
+        BusHandler handler = get_dbus_method_handler(this, &header, &policy);
+        PROXY_PROBE4(policy_decided, this, header.serial, handler, policy);
+        ++stats.handler_counts[handler];
 
         switch (handler) {
             case HANDLE_FILTER_HAS_OWNER_REPLY:
             case HANDLE_FILTER_GET_OWNER_REPLY:
-                if (!validate_arg0_name(buffer, FLATPAK_POLICY_SEE, nullptr)) {
+                if (!validate_arg0_name(&header, FLATPAK_POLICY_SEE, nullptr)) {
                     buffer->unref();
                     buffer = (handler == HANDLE_FILTER_GET_OWNER_REPLY) 
                         ? get_error_for_roundtrip(&header, "org.freedesktop.DBus.Error.NameHasNoOwner")
@@ -605,7 +1148,7 @@ void FlatpakProxyClient::got_buffer_from_client(Buffer *buffer) {
                 break;
 
             case HANDLE_VALIDATE_MATCH:
-                if (!validate_arg0_match(buffer)) {
+                if (!validate_arg0_match(&header)) {
                     if (proxy->log_messages) {
                         std::cerr << "*DENIED* (ping)\n";
                     }
@@ -625,7 +1168,7 @@ void FlatpakProxyClient::got_buffer_from_client(Buffer *buffer) {
             case HANDLE_VALIDATE_SEE:
             case HANDLE_VALIDATE_TALK: {
                 FlatpakPolicy name_policy;
-                if (validate_arg0_name(buffer, policy_from_handler(handler), &name_policy)) {
+                if (validate_arg0_name(&header, policy_from_handler(handler), &name_policy)) {
                     if (header.client_message_generates_reply()) {
                         if (expecting_reply == EXPECTED_REPLY_NONE) {
                             expecting_reply = EXPECTED_REPLY_NORMAL;
@@ -722,76 +1265,78 @@ void FlatpakProxyClient::got_buffer_from_client(Buffer *buffer) {
     }
 
     if (buffer) {
+        buffer->framed_at = framed_at;
         queue_outgoing_buffer(&bus_side, buffer);
-    }
-}
-
-std::string get_arg0_string(Buffer *buffer) {
-    GDBusMessage *message = g_dbus_message_new_from_blob(
-        buffer->data.data(), buffer->size, static_cast<GDBusCapabilityFlags>(0), nullptr);
-    
-    if (!message) {
-        return "";
-    }
 
-    GVariant *body = g_dbus_message_get_body(message);
-    if (!body) {
-        g_object_unref(message);
-        return "";
-    }
-
-    GVariant *arg0 = g_variant_get_child_value(body, 0);
-    std::string result;
-    
-    if (arg0 && g_variant_is_of_type(arg0, G_VARIANT_TYPE_STRING)) {
-        const char *str = g_variant_get_string(arg0, nullptr);
-        result = str;
+        if (expecting_reply == EXPECTED_REPLY_HELLO) {
+            queue_initial_name_ops(this);
+        }
     }
 
-    if (arg0) g_variant_unref(arg0);
-    g_object_unref(message);
-    return result;
+    check_memory_quota();
 }
 
-Buffer *filter_names_list(FlatpakProxyClient *client, Buffer *buffer) {
-    GDBusMessage *message = g_dbus_message_new_from_blob(
-        buffer->data.data(), buffer->size, static_cast<GDBusCapabilityFlags>(0), nullptr);
+std::string get_arg0_string(Header *header) {
+    const std::vector<std::string> *args = header->string_args(1);
+    return args ? (*args)[0] : "";
+}
 
-    if (!message) {
+// Filters a ListNames or ListActivatableNames reply without decoding it.
+// The header is copied as is, each visible name is copied straight from
+// the bus's array into the new buffer, and then the array and body lengths
+// are patched. Offsets are relative to the body, which starts 8-aligned,
+// so element alignment is the same as in the message. Returns nullptr if
+// the reply is not a well-formed (as).
+Buffer *filter_names_list(FlatpakProxyClient *client, Buffer *buffer, Header *header) {
+    if (header->signature != "as" || header->length < 4 || header->length > buffer->size) {
         return nullptr;
     }
 
-    GVariant *body = g_dbus_message_get_body(message);
-    if (!body) {
-        g_object_unref(message);
+    size_t body_offset = buffer->size - header->length;
+    uint8_t *in = buffer->data.data() + body_offset;
+    if (read_uint32(header, in) != header->length - 4) {
         return nullptr;
     }
 
-    GVariant *arg0 = g_variant_get_child_value(body, 0);
-    if (!arg0 || !g_variant_is_of_type(arg0, G_VARIANT_TYPE_STRING_ARRAY)) {
-        if (arg0) g_variant_unref(arg0);
-        g_object_unref(message);
-        return nullptr;
-    }
+    // Never larger than the reply, so this is the only allocation.
+    Buffer *filtered = new Buffer(buffer->size);
+    std::copy_n(buffer->data.begin(), body_offset, filtered->data.begin());
+    uint8_t *out = filtered->data.data() + body_offset;
 
-    const gchar **names = g_variant_get_strv(arg0, nullptr);
-    GVariantBuilder builder;
-    g_variant_builder_init(&builder, G_VARIANT_TYPE_STRING_ARRAY);
-    
-    for (int i = 0; names[i] != nullptr; i++) {
-        if (client->get_max_policy(names[i]) >= FLATPAK_POLICY_SEE) {
-            g_variant_builder_add(&builder, "s", names[i]);
+    std::string name;
+    size_t in_pos = 4;
+    size_t out_pos = 4;
+
+    while (in_pos < header->length) {
+        in_pos = align_by_4(in_pos);
+        if (in_pos + 4 > header->length) {
+            filtered->unref();
+            return nullptr;
         }
-    }
-    
-    g_free(names);
-    g_variant_unref(arg0);
 
-    GVariant *new_names = g_variant_builder_end(&builder);
-    g_dbus_message_set_body(message, g_variant_new_tuple(&new_names, 1));
+        uint32_t len = read_uint32(header, in + in_pos);
+        in_pos += 4;
+        if (len >= header->length - in_pos || in[in_pos + len] != '\0') {
+            filtered->unref();
+            return nullptr;
+        }
 
-    Buffer *filtered = message_to_buffer(message);
-    g_object_unref(message);
+        name.assign(reinterpret_cast<const char *>(in + in_pos), len);
+        if (client->get_max_policy(name) >= FLATPAK_POLICY_SEE) {
+            // Padding is already zero in a new buffer.
+            out_pos = align_by_4(out_pos);
+            write_uint32(header, out + out_pos, len);
+            memcpy(out + out_pos + 4, in + in_pos, len + 1);
+            out_pos += 4 + len + 1;
+        }
+        in_pos += len + 1;
+    }
+
+    write_uint32(header, out, out_pos - 4);
+    write_uint32(header, filtered->data.data() + 4, out_pos);
+    filtered->size = body_offset + out_pos;
+    filtered->data.resize(filtered->size);
+    filtered->pos = filtered->size;
     return filtered;
 }
 
@@ -802,51 +1347,215 @@ bool message_is_name_owner_changed(Header *header) {
            header->member == "NameOwnerChanged";
 }
 
-bool should_filter_name_owner_changed(FlatpakProxyClient *client, Buffer *buffer) {
-    GDBusMessage *message = g_dbus_message_new_from_blob(
-        buffer->data.data(), buffer->size, static_cast<GDBusCapabilityFlags>(0), nullptr);
+bool message_is_properties_changed(Header *header) {
+    return header->type == G_DBUS_MESSAGE_TYPE_SIGNAL &&
+           header->interface == "org.freedesktop.DBus.Properties" &&
+           header->member == "PropertiesChanged" &&
+           header->signature == "sa{sv}as" &&
+           header->unix_fds == 0;
+}
+
+// Signals under the same key describe the same properties to the same
+// recipient, so a later one can absorb an earlier one.
+std::string properties_changed_key(Header *header) {
+    const std::vector<std::string> *args = header->string_args(1);
+    if (!args) {
+        return {};
+    }
 
-    if (!message) {
-        return true;
+    std::string key = header->sender;
+    key.push_back('\0');
+    key.append(header->path);
+    key.push_back('\0');
+    key.append((*args)[0]);
+    key.push_back('\0');
+    key.append(header->destination);
+    return key;
+}
+
+// Folds `older` into `newer`, which keeps its header: the values `newer`
+// sets win, a property it invalidates loses any older value, and one it
+// sets is no longer invalidated. nullptr if either does not decode.
+Buffer *merge_properties_changed(Buffer *older, Buffer *newer) {
+    GDBusMessage *messages[2];
+    GVariant *bodies[2];
+    bool valid = true;
+
+    for (int i = 0; i < 2; ++i) {
+        Buffer *buffer = i == 0 ? older : newer;
+        messages[i] = g_dbus_message_new_from_blob(buffer->data.data(), buffer->size,
+                                                   G_DBUS_CAPABILITY_FLAGS_NONE, nullptr);
+        bodies[i] = messages[i] ? g_dbus_message_get_body(messages[i]) : nullptr;
+        if (bodies[i] == nullptr || !g_variant_is_of_type(bodies[i], G_VARIANT_TYPE("(sa{sv}as)"))) {
+            valid = false;
+        }
+    }
+
+    Buffer *merged = nullptr;
+    if (valid) {
+        std::map<std::string, GVariant *> changed;
+        std::set<std::string> invalidated;
+        const char *interface = nullptr;
+
+        for (GVariant *body : bodies) {
+            GVariantIter *changed_iter;
+            GVariantIter *invalidated_iter;
+            const char *name;
+            GVariant *value;
+
+            g_variant_get(body, "(&sa{sv}as)", &interface, &changed_iter, &invalidated_iter);
+            while (g_variant_iter_next(changed_iter, "{&sv}", &name, &value)) {
+                invalidated.erase(name);
+                auto [it, inserted] = changed.try_emplace(name, value);
+                if (!inserted) {
+                    g_variant_unref(it->second);
+                    it->second = value;
+                }
+            }
+            while (g_variant_iter_next(invalidated_iter, "&s", &name)) {
+                auto it = changed.find(name);
+                if (it != changed.end()) {
+                    g_variant_unref(it->second);
+                    changed.erase(it);
+                }
+                invalidated.insert(name);
+            }
+            g_variant_iter_free(changed_iter);
+            g_variant_iter_free(invalidated_iter);
+        }
+
+        GVariantBuilder changed_builder;
+        GVariantBuilder invalidated_builder;
+        g_variant_builder_init(&changed_builder, G_VARIANT_TYPE("a{sv}"));
+        g_variant_builder_init(&invalidated_builder, G_VARIANT_TYPE("as"));
+        for (auto &[name, value] : changed) {
+            g_variant_builder_add(&changed_builder, "{sv}", name.c_str(), value);
+            g_variant_unref(value);
+        }
+        for (const std::string &name : invalidated) {
+            g_variant_builder_add(&invalidated_builder, "s", name.c_str());
+        }
+
+        // `interface` points into the newer body, which is still alive.
+        g_dbus_message_set_body(messages[1], g_variant_new("(sa{sv}as)", interface,
+                                                           &changed_builder, &invalidated_builder));
+        merged = message_to_buffer(messages[1]);
+    }
+
+    for (GDBusMessage *message : messages) {
+        if (message) {
+            g_object_unref(message);
+        }
+    }
+    return merged;
+}
+
+// Merges a PropertiesChanged signal with one for the same properties that
+// the client has not been sent yet, which then no longer goes out on its
+// own. Only finds one while the client is behind on its queue.
+Buffer *coalesce_properties_changed(FlatpakProxyClient *client, Buffer *buffer, const std::string& key) {
+    ProxySide *side = &client->client_side;
+    Buffer *older = side->buffers.find_coalescable(key);
+    if (older == nullptr) {
+        return buffer;
+    }
+
+    Buffer *merged = merge_properties_changed(older, buffer);
+    if (merged == nullptr) {
+        return buffer;
+    }
+
+    if (client->proxy->log_messages) {
+        std::cerr << "*COALESCED*\n";
+    }
+    side->buffers.take_coalescable(key);
+    side->queued_bytes -= older->size;
+    older->unref();
+    buffer->unref();
+    ++client->stats.properties_coalesced;
+    return merged;
+}
+
+const NameOwnerChange *decode_name_owner_changed(FlatpakProxy *proxy, Buffer *buffer, Header *header) {
+    NameOwnerChange &change = proxy->last_name_owner_change;
+    if (header->length > buffer->size) {
+        return nullptr;
+    }
+    const uint8_t *body = buffer->data.data() + buffer->size - header->length;
+
+    if (change.endianness == buffer->data[0] && change.signature == header->signature &&
+        change.body.size() == header->length && memcmp(change.body.data(), body, header->length) == 0) {
+        return change.valid ? &change : nullptr;
+    }
+
+    change.endianness = buffer->data[0];
+    change.signature = header->signature;
+    change.body.assign(body, body + header->length);
+    change.valid = false;
+
+    const std::vector<std::string> *args = header->string_args(3);
+    if (header->signature != "sss" || !args) {
+        return nullptr;
     }
 
-    GVariant *body = g_dbus_message_get_body(message);
-    if (!body) {
-        g_object_unref(message);
+    change.name = (*args)[0];
+    change.old_owner = (*args)[1];
+    change.new_owner = (*args)[2];
+    change.valid = true;
+    return &change;
+}
+
+bool should_filter_name_owner_changed(FlatpakProxyClient *client, Buffer *buffer, Header *header) {
+    const NameOwnerChange *change = decode_name_owner_changed(client->proxy, buffer, header);
+    if (!change) {
         return true;
     }
 
-    GVariant *arg0 = g_variant_get_child_value(body, 0);
-    GVariant *arg2 = g_variant_get_child_value(body, 2);
-    
+    const std::string &name = change->name;
     bool result = true;
-    
-    if (arg0 && g_variant_is_of_type(arg0, G_VARIANT_TYPE_STRING) &&
-        arg2 && g_variant_is_of_type(arg2, G_VARIANT_TYPE_STRING)) {
-        
-        const char *name = g_variant_get_string(arg0, nullptr);
-        const char *new_owner = g_variant_get_string(arg2, nullptr);
-
-        if (client->get_max_policy(name) >= FLATPAK_POLICY_SEE ||
-            (client->proxy->sloppy_names && name[0] == ':')) {
-            
-            if (name[0] != ':' && new_owner[0] != 0) {
-                client->add_unique_id_owned_name(new_owner, name);
-            }
-            
-            result = false;
+
+    if (client->get_max_policy(name) >= FLATPAK_POLICY_SEE ||
+        (client->proxy->sloppy_names && name[0] == ':')) {
+        result = false;
+    }
+
+    // Prune state for departed connections and names that changed
+    // hands, whether or not the client gets to see the signal.
+    if (name[0] == ':') {
+        if (change->new_owner.empty()) {
+            client->forget_unique_id(name);
+        }
+    } else {
+        if (!change->old_owner.empty()) {
+            client->remove_unique_id_owned_name(change->old_owner, name);
+        }
+        if (!result && !change->new_owner.empty()) {
+            client->add_unique_id_owned_name(change->new_owner, name);
         }
     }
 
-    if (arg0) g_variant_unref(arg0);
-    if (arg2) g_variant_unref(arg2);
-    g_object_unref(message);
-    
     return result;
 }
 
 void FlatpakProxyClient::got_buffer_from_bus(Buffer *buffer) {
     ProxySide *side = &bus_side;
+    int64_t framed_at = buffer->framed_at;
+
+    last_active = framed_at ? framed_at : monotonic_ns();
+    trimmed = false;
+    refresh_policy();
+
+    if (auth_state == AUTH_COMPLETE) {
+        ++stats.messages_from_bus;
+        stats.bytes_from_bus += buffer->size;
+    }
+
+    // Only parsed messages get a lane of their own, the rest keep their
+    // order.
+    OutputLane lane = OUTPUT_LANE_SIGNAL;
+    std::string sender;
+    bool classified = false;
+    std::string coalesce_key;
 
     if (auth_state == AUTH_COMPLETE && proxy->filter) {
         Header header;
@@ -859,6 +1568,9 @@ void FlatpakProxyClient::got_buffer_from_bus(Buffer *buffer) {
             return;
         }
 
+        PROXY_PROBE6(header_parsed, this, true, header.type, header.serial,
+                     header.interface.c_str(), header.member.c_str());
+
         if (!update_socket_messages(side, buffer, &header)) {
             return;
         }
@@ -875,27 +1587,29 @@ void FlatpakProxyClient::got_buffer_from_bus(Buffer *buffer) {
                     if (proxy->log_messages) {
                         std::cerr << "*Unexpected reply*\n";
                     }
+                    ++stats.bus_messages_withheld;
                     buffer->unref();
                     return;
 
                 case EXPECTED_REPLY_HELLO:
                     if (header.type == G_DBUS_MESSAGE_TYPE_METHOD_RETURN) {
-                        std::string my_id = get_arg0_string(buffer);
+                        std::string my_id = get_arg0_string(&header);
                         update_unique_id_policy(my_id, FLATPAK_POLICY_TALK);
+                        unique_name = my_id;
                     }
                     break;
 
                 case EXPECTED_REPLY_REWRITE: {
-                    auto it = rewrite_reply.find(header.reply_serial);
-                    if (it != rewrite_reply.end()) {
+                    GDBusMessage *reply = nullptr;
+                    if (rewrites && rewrites->rewrite_reply.steal(header.reply_serial, &reply)) {
                         if (proxy->log_messages) {
                             std::cerr << "*REWRITTEN*\n";
                         }
-                        g_dbus_message_set_serial(it->second, header.serial);
+                        g_dbus_message_set_serial(reply, header.serial);
+                        ++stats.replies_rewritten;
                         buffer->unref();
-                        buffer = message_to_buffer(it->second);
-                        g_object_unref(it->second);
-                        rewrite_reply.erase(it);
+                        buffer = message_to_buffer(reply);
+                        g_object_unref(reply);
                     }
                     break;
                 }
@@ -910,15 +1624,16 @@ void FlatpakProxyClient::got_buffer_from_bus(Buffer *buffer) {
                     break;
 
                 case EXPECTED_REPLY_FAKE_GET_NAME_OWNER: {
-                    auto it = get_owner_reply.find(header.reply_serial);
-                    if (it != get_owner_reply.end()) {
+                    std::string name;
+                    if (rewrites && rewrites->get_owner_reply.steal(header.reply_serial, &name)) {
                         if (header.type == G_DBUS_MESSAGE_TYPE_METHOD_RETURN) {
-                            std::string owner = get_arg0_string(buffer);
-                            if (!owner.empty()) {
-                                add_unique_id_owned_name(owner, it->second);
+                            std::string owner = get_arg0_string(&header);
+                            // A reload may have dropped the name meanwhile.
+                            if (!owner.empty() && get_max_policy(name) >= FLATPAK_POLICY_SEE) {
+                                add_unique_id_owned_name(owner, name);
                             }
                         }
-                        get_owner_reply.erase(it);
+                        accounted_name_bytes -= name.size();
                     }
                     if (proxy->log_messages) {
                         std::cerr << "*SKIPPED*\n";
@@ -938,7 +1653,7 @@ void FlatpakProxyClient::got_buffer_from_bus(Buffer *buffer) {
 
                 case EXPECTED_REPLY_LIST_NAMES:
                     if (header.type == G_DBUS_MESSAGE_TYPE_METHOD_RETURN) {
-                        Buffer *filtered = filter_names_list(this, buffer);
+                        Buffer *filtered = filter_names_list(this, buffer, &header);
                         buffer->unref();
                         buffer = filtered;
                     }
@@ -962,7 +1677,7 @@ void FlatpakProxyClient::got_buffer_from_bus(Buffer *buffer) {
             }
 
             if (message_is_name_owner_changed(&header)) {
-                if (should_filter_name_owner_changed(this, buffer)) {
+                if (should_filter_name_owner_changed(this, buffer, &header)) {
                     buffer->unref();
                     buffer = nullptr;
                 }
@@ -970,16 +1685,10 @@ void FlatpakProxyClient::got_buffer_from_bus(Buffer *buffer) {
         }
 
         if (buffer && header.type == G_DBUS_MESSAGE_TYPE_SIGNAL && header.destination.empty()) {
-            std::vector<Filter *> filters;
-            bool filtered = true;
-
-            FlatpakPolicy policy = get_max_policy_and_matched(header.sender, &filters);
+            FlatpakPolicy policy = FLATPAK_POLICY_NONE;
+            bool filtered = !broadcast_allowed(&header, &policy);
 
-            if (policy == FLATPAK_POLICY_OWN ||
-                policy == FLATPAK_POLICY_TALK ||
-                any_filter_matches(filters, FILTER_TYPE_BROADCAST, header.path, header.interface, header.member)) {
-                filtered = false;
-            }
+            PROXY_PROBE4(broadcast_decided, this, header.serial, policy, !filtered);
 
             if (filtered) {
                 if (proxy->log_messages) {
@@ -997,11 +1706,156 @@ void FlatpakProxyClient::got_buffer_from_bus(Buffer *buffer) {
         if (buffer && header.client_message_generates_reply()) {
             queue_expected_reply(side, header.serial, EXPECTED_REPLY_NORMAL);
         }
+
+        if (buffer && proxy->coalesce_properties && message_is_properties_changed(&header)) {
+            coalesce_key = properties_changed_key(&header);
+            if (!coalesce_key.empty()) {
+                buffer = coalesce_properties_changed(this, buffer, coalesce_key);
+            }
+        }
+
+        lane = output_lane_for_type(header.type);
+        sender = std::move(header.sender);
+        classified = true;
     }
 
     if (buffer) {
-        queue_outgoing_buffer(&client_side, buffer);
+        buffer->framed_at = framed_at;
+        queue_outgoing_message(&client_side, buffer, lane, classified ? &sender : nullptr, false,
+                               coalesce_key.empty() ? nullptr : &coalesce_key);
+    } else {
+        ++stats.bus_messages_withheld;
+    }
+
+    check_memory_quota();
+}
+
+// Judges a large message from its header alone. Only messages that would
+// be passed on unchanged qualify; anything whose body the filter reads, or
+// whose reply the proxy rewrites or swallows, returns false and is read in
+// full for got_buffer_from_*. On true `head` has been taken: queued on the
+// other side with `side->stream_remaining` set to the body still to come,
+// or dropped with the side closed. Either way the caller must not touch it.
+bool FlatpakProxyClient::start_cut_through(ProxySide *side, Buffer *head, size_t total_size) {
+    bool from_bus = side == &bus_side;
+    ProxySide *other_side = from_bus ? &client_side : &bus_side;
+    ExpectedReplyType expecting_reply = EXPECTED_REPLY_NONE;
+
+    if (auth_state != AUTH_COMPLETE) {
+        return false;
+    }
+
+    refresh_policy();
+
+    OutputLane lane = OUTPUT_LANE_SIGNAL;
+    std::string sender;
+    bool classified = false;
+
+    if (proxy->filter) {
+        Header header;
+        try {
+            header.parse(head);
+        } catch (const std::exception &) {
+            // Reported by the full parse.
+            return false;
+        }
+
+        if (!from_bus) {
+            if (header.serial > MAX_CLIENT_SERIAL ||
+                (header.is_dbus_method_call() && header.member == "Hello")) {
+                return false;
+            }
+
+            FlatpakPolicy policy = FLATPAK_POLICY_NONE;
+            BusHandler handler = get_dbus_method_handler(this, &header, &policy);
+            if (handler != HANDLE_PASS) {
+                return false;
+            }
+            PROXY_PROBE4(policy_decided, this, header.serial, handler, policy);
+            ++stats.handler_counts[handler];
+
+            if (header.client_message_generates_reply()) {
+                expecting_reply = EXPECTED_REPLY_NORMAL;
+            }
+        } else if (header.has_reply_serial) {
+            ExpectedReply *expected = client_side.expected_replies.find(header.reply_serial);
+            if (!expected || expected->type != EXPECTED_REPLY_NORMAL) {
+                return false;
+            }
+            steal_expected_reply(&client_side, header.reply_serial);
+        } else {
+            if ((header.type != G_DBUS_MESSAGE_TYPE_METHOD_CALL && header.type != G_DBUS_MESSAGE_TYPE_SIGNAL) ||
+                message_is_name_owner_changed(&header)) {
+                return false;
+            }
+
+            if (header.type == G_DBUS_MESSAGE_TYPE_SIGNAL && header.destination.empty()) {
+                FlatpakPolicy policy = FLATPAK_POLICY_NONE;
+                if (!broadcast_allowed(&header, &policy)) {
+                    return false;
+                }
+                PROXY_PROBE4(broadcast_decided, this, header.serial, policy, true);
+            }
+
+            if (header.client_message_generates_reply()) {
+                expecting_reply = EXPECTED_REPLY_NORMAL;
+            }
+        }
+
+        // As in got_buffer_from_bus(), whatever a unique name gets through
+        // to the client, replies included, lets the client see that name.
+        if (from_bus && !header.sender.empty() && header.sender[0] == ':') {
+            update_unique_id_policy(header.sender, FLATPAK_POLICY_SEE);
+        }
+
+        PROXY_PROBE6(header_parsed, this, from_bus, header.type, header.serial,
+                     header.interface.c_str(), header.member.c_str());
+
+        if (!update_socket_messages(side, head, &header)) {
+            return true;
+        }
+
+        if (proxy->log_messages) {
+            if (from_bus) {
+                header.print_incoming();
+            } else {
+                header.print_outgoing();
+            }
+            std::cerr << "*STREAMED* " << total_size << " bytes\n";
+        }
+
+        if (expecting_reply != EXPECTED_REPLY_NONE) {
+            queue_expected_reply(side, header.serial, expecting_reply);
+        }
+
+        if (from_bus) {
+            lane = output_lane_for_type(header.type);
+            sender = std::move(header.sender);
+            classified = true;
+        }
+    }
+
+    // Set before `head` is queued: the quota check below may disconnect
+    // and free it.
+    side->stream_remaining = total_size - head->size;
+
+    if (from_bus) {
+        ++stats.messages_from_bus;
+        stats.bytes_from_bus += total_size;
+    } else {
+        ++stats.messages_from_client;
+        stats.bytes_from_client += total_size;
     }
+
+    head->framed_at = monotonic_ns();
+    last_active = head->framed_at;
+    trimmed = false;
+    PROXY_PROBE3(message_framed, this, from_bus, total_size);
+    // The body follows in chunks queued right behind the head.
+    queue_outgoing_message(other_side, head, lane, classified ? &sender : nullptr, true, nullptr);
+
+    check_memory_quota();
+    return true;
 }
 
 void queue_fake_message(FlatpakProxyClient *client, GDBusMessage *message, ExpectedReplyType reply_type) {
@@ -1016,51 +1870,61 @@ void queue_fake_message(FlatpakProxyClient *client, GDBusMessage *message, Expec
     queue_expected_reply(&client->client_side, client->last_fake_serial, reply_type);
 }
 
+// Adds or removes the NameOwnerChanged match the proxy keeps for `name`.
+void queue_name_match(FlatpakProxyClient *client, const char *method, const std::string& name, bool subtree) {
+    GDBusMessage *message = g_dbus_message_new_method_call(
+        "org.freedesktop.DBus", "/", "org.freedesktop.DBus", method);
+        
+    GVariant *match;
+    if (subtree) {
+        match = g_variant_new_printf(
+            "type='signal',sender='org.freedesktop.DBus',interface='org.freedesktop.DBus',"
+            "member='NameOwnerChanged',arg0namespace='%s'",
+            name.c_str());
+    } else {
+        match = g_variant_new_printf(
+            "type='signal',sender='org.freedesktop.DBus',interface='org.freedesktop.DBus',"
+            "member='NameOwnerChanged',arg0='%s'",
+            name.c_str());
+    }
+    
+    g_dbus_message_set_body(message, g_variant_new_tuple(&match, 1));
+    queue_fake_message(client, message, EXPECTED_REPLY_FILTER);
+
+    if (client->proxy->log_messages) {
+        std::cerr << "C" << client->last_fake_serial << ": -> org.freedesktop.DBus fake "
+                  << (subtree ? "wildcarded " : "") << method << " for " << name << "\n";
+    }
+}
+
+// Departures are watched by the proxy for all clients, see
+// FlatpakProxy::watch_departures().
 void queue_initial_name_ops(FlatpakProxyClient *client) {
-    bool has_wildcards = false;
+    queue_policy_name_ops(client, nullptr);
+    client->name_ops_queued = true;
+}
 
-    for (auto &[name, filters] : client->proxy->filters) {
-        bool name_needs_subtree = false;
-        
-        for (auto filter : filters) {
-            if (filter->name_is_subtree) {
-                name_needs_subtree = true;
-                break;
-            }
-        }
+// Starts tracking the owners of the names in the client's policy that
+// `previous` did not cover (all of them for a new client) and drops the
+// matches for names `previous` covered and the current policy does not.
+void queue_policy_name_ops(FlatpakProxyClient *client, const PolicyTable *previous) {
+    bool has_wildcards = false;
 
-        if (name == "org.freedesktop.DBus") continue;
+    client->policy->for_each_name([&](const std::string& name, bool subtree) {
+        bool old_subtree;
 
-        GDBusMessage *message = g_dbus_message_new_method_call(
-            "org.freedesktop.DBus", "/", "org.freedesktop.DBus", "AddMatch");
-            
-        GVariant *match;
-        if (name_needs_subtree) {
-            match = g_variant_new_printf(
-                "type='signal',sender='org.freedesktop.DBus',interface='org.freedesktop.DBus',"
-                "member='NameOwnerChanged',arg0namespace='%s'",
-                name.c_str());
-        } else {
-            match = g_variant_new_printf(
-                "type='signal',sender='org.freedesktop.DBus',interface='org.freedesktop.DBus',"
-                "member='NameOwnerChanged',arg0='%s'",
-                name.c_str());
-        }
-        
-        g_dbus_message_set_body(message, g_variant_new_tuple(&match, 1));
-        queue_fake_message(client, message, EXPECTED_REPLY_FILTER);
+        if (name == "org.freedesktop.DBus") return;
+        if (previous && previous->has_name(name, &old_subtree) && old_subtree == subtree) return;
 
-        if (client->proxy->log_messages) {
-            std::cerr << "C" << client->last_fake_serial << ": -> org.freedesktop.DBus fake "
-                      << (name_needs_subtree ? "wildcarded " : "") << "AddMatch for " << name << "\n";
-        }
+        queue_name_match(client, "AddMatch", name, subtree);
 
-        if (!name_needs_subtree) {
-            message = g_dbus_message_new_method_call(
+        if (!subtree) {
+            GDBusMessage *message = g_dbus_message_new_method_call(
                 "org.freedesktop.DBus", "/", "org.freedesktop.DBus", "GetNameOwner");
             g_dbus_message_set_body(message, g_variant_new("(s)", name.c_str()));
             queue_fake_message(client, message, EXPECTED_REPLY_FAKE_GET_NAME_OWNER);
-            client->get_owner_reply[client->last_fake_serial] = name;
+            client->get_rewrites().get_owner_reply.insert(client->last_fake_serial, name, client->proxy->reply_tick);
+            client->accounted_name_bytes += name.size();
 
             if (client->proxy->log_messages) {
                 std::cerr << "C" << client->last_fake_serial 
@@ -1069,6 +1933,17 @@ void queue_initial_name_ops(FlatpakProxyClient *client) {
         } else {
             has_wildcards = true;
         }
+    });
+
+    if (previous) {
+        previous->for_each_name([&](const std::string& name, bool subtree) {
+            bool new_subtree;
+
+            if (name == "org.freedesktop.DBus") return;
+            if (!client->policy->has_name(name, &new_subtree) || new_subtree != subtree) {
+                queue_name_match(client, "RemoveMatch", name, subtree);
+            }
+        });
     }
 
     if (has_wildcards) {
@@ -1,5 +1,6 @@
 #include "../headers/flatpak-proxy-client.h"
 #include "../headers/utils.h"
+#include <algorithm>
 
 std::string debug_str(const std::string& s, Header *header) {
     std::string result = s;
@@ -66,6 +67,8 @@ void Header::parse(Buffer *buffer) {
     }
     
     this->buffer = buffer;
+    args_decoded = false;
+    args.clear();
     
     if (buffer->size < 16) {
         throw std::runtime_error("Buffer too small: " + std::to_string(buffer->size));
@@ -98,6 +101,8 @@ void Header::parse(Buffer *buffer) {
         throw std::runtime_error("Header len " + std::to_string(header_len) + 
                                " bigger than buffer size (" + std::to_string(buffer->size) + ")");
     
+    body_offset = header_len;
+
     uint32_t offset = 12 + 4;
     uint32_t end_offset = offset + array_len;
     std::string header_str;
@@ -152,6 +157,8 @@ void Header::parse(Buffer *buffer) {
                     throw std::runtime_error("Header too small to fit reply serial " + debug_str(header_str, this));
                 has_reply_serial = true;
                 reply_serial = read_uint32(this, &buffer->data[offset]);
+                if (reply_serial == 0)
+                    throw std::runtime_error("Reply serial is 0 " + debug_str(header_str, this));
                 offset += 4;
                 break;
                 
@@ -228,6 +235,43 @@ Header::~Header() {
     }
 }
 
+const std::vector<std::string> *Header::string_args(size_t n) {
+    if (!buffer) {
+        return nullptr;
+    }
+
+    if (!args_decoded) {
+        args_decoded = true;
+
+        // A cut-through head may hold only part of the body.
+        size_t end = std::min(buffer->size, static_cast<size_t>(body_offset) + length);
+        size_t offset = body_offset;
+
+        for (char arg_type : signature) {
+            if (arg_type != 's')
+                break;
+
+            offset = align_by_4(static_cast<uint32_t>(offset));
+            if (offset + 4 > end)
+                break;
+
+            uint32_t len = read_uint32(this, &buffer->data[offset]);
+            offset += 4;
+            if (len >= end - offset)
+                break;
+
+            const char *str = reinterpret_cast<const char *>(&buffer->data[offset]);
+            if (str[len] != '\0' || !g_utf8_validate(str, len, nullptr))
+                break;
+
+            args.emplace_back(str, len);
+            offset += len + 1;
+        }
+    }
+
+    return args.size() >= n ? &args : nullptr;
+}
+
 bool Header::client_message_generates_reply() {
     switch (type) {
         case G_DBUS_MESSAGE_TYPE_METHOD_CALL:
@@ -0,0 +1,70 @@
+#include "../headers/latency-histogram.h"
+#include <iomanip>
+
+static const char *direction_names[N_LATENCY_DIRECTIONS] = {
+    "to_bus",
+    "to_client",
+};
+
+static const char *type_names[N_LATENCY_MESSAGE_TYPES] = {
+    "invalid",
+    "method_call",
+    "method_return",
+    "error",
+    "signal",
+};
+
+static double to_us(int64_t ns) {
+    return static_cast<double>(ns) / 1000.0;
+}
+
+static void dump_histogram(std::ostream& out, const char *label, const LatencyHistogram& histogram) {
+    out << "  " << std::left << std::setw(28) << label << std::right
+        << " n=" << histogram.count()
+        << std::fixed << std::setprecision(1)
+        << " p50=" << to_us(histogram.percentile(0.5)) << "us"
+        << " p99=" << to_us(histogram.percentile(0.99)) << "us"
+        << " p999=" << to_us(histogram.percentile(0.999)) << "us"
+        << " max=" << to_us(histogram.maximum()) << "us\n";
+}
+
+static void dump_histogram_json(std::ostream& out, const LatencyHistogram& histogram) {
+    out << "{\"n\":" << histogram.count()
+        << ",\"p50_ns\":" << histogram.percentile(0.5)
+        << ",\"p99_ns\":" << histogram.percentile(0.99)
+        << ",\"p999_ns\":" << histogram.percentile(0.999)
+        << ",\"max_ns\":" << histogram.maximum() << "}";
+}
+
+void LatencyStats::dump(std::ostream& out) const {
+    for (int direction = 0; direction < N_LATENCY_DIRECTIONS; ++direction) {
+        for (int type = 1; type < N_LATENCY_MESSAGE_TYPES; ++type) {
+            if (forwarding[direction][type].count() == 0)
+                continue;
+            std::string label = std::string(direction_names[direction]) + " " + type_names[type];
+            dump_histogram(out, label.c_str(), forwarding[direction][type]);
+        }
+    }
+
+    if (round_trip[LATENCY_TO_BUS].count() > 0)
+        dump_histogram(out, "round trip client calls", round_trip[LATENCY_TO_BUS]);
+    if (round_trip[LATENCY_TO_CLIENT].count() > 0)
+        dump_histogram(out, "round trip bus calls", round_trip[LATENCY_TO_CLIENT]);
+}
+
+void LatencyStats::dump_json(std::ostream& out) const {
+    out << "{\"forwarding\":{";
+    for (int direction = 0; direction < N_LATENCY_DIRECTIONS; ++direction) {
+        out << (direction ? "," : "") << "\"" << direction_names[direction] << "\":{";
+        for (int type = 1; type < N_LATENCY_MESSAGE_TYPES; ++type) {
+            out << (type > 1 ? "," : "") << "\"" << type_names[type] << "\":";
+            dump_histogram_json(out, forwarding[direction][type]);
+        }
+        out << "}";
+    }
+    out << "},\"round_trip\":{\"client_calls\":";
+    dump_histogram_json(out, round_trip[LATENCY_TO_BUS]);
+    out << ",\"bus_calls\":";
+    dump_histogram_json(out, round_trip[LATENCY_TO_CLIENT]);
+    out << "}}";
+}
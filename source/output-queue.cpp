@@ -0,0 +1,177 @@
+#include "../headers/flatpak-proxy-client.h"
+#include "../headers/output-queue.h"
+#include <algorithm>
+
+static int lowest_queued_lane(const uint32_t *queued) {
+    for (int lane = N_OUTPUT_LANES - 1; lane >= 0; --lane) {
+        if (queued[lane] > 0) {
+            return lane;
+        }
+    }
+    return -1;
+}
+
+void OutputQueue::push(Buffer *buffer, OutputLane lane, const std::string *sender, bool message_continues,
+                       const std::string *coalesce_key) {
+    if (open_lane >= 0) {
+        HeldBuffer &held_buffer = held.emplace_back();
+        held_buffer.buffer = buffer;
+        held_buffer.lane = lane;
+        held_buffer.message_continues = message_continues;
+        if (sender) {
+            held_buffer.sender = *sender;
+        }
+        if (coalesce_key) {
+            held_buffer.coalesce_key = *coalesce_key;
+        }
+        ++n_buffers;
+        return;
+    }
+
+    QueuedBuffer queued = {buffer, next_seq++, nullptr, message_continues, nullptr};
+    int target = std::max<int>(lane, lowest_queued_lane(unclassified.queued));
+
+    if (sender) {
+        SenderMap::value_type &entry = *senders.try_emplace(*sender).first;
+        target = std::max(target, lowest_queued_lane(entry.second.queued));
+        queued.sender = &entry;
+    } else {
+        target = OUTPUT_LANE_SIGNAL;
+    }
+
+    ++(queued.sender ? queued.sender->second.queued[target] : unclassified.queued[target]);
+    open_lane = message_continues ? target : -1;
+    lanes[target].push_back(queued);
+    ++n_buffers;
+
+    if (coalesce_key) {
+        auto [entry, inserted] = coalescable.try_emplace(*coalesce_key);
+        if (!inserted) {
+            entry->second.it->coalesce_key = nullptr;
+        }
+        entry->second = {target, std::prev(lanes[target].end())};
+        lanes[target].back().coalesce_key = &entry->first;
+    }
+}
+
+void OutputQueue::push_chunk(Buffer *buffer, bool message_continues) {
+    int target = open_lane >= 0 ? open_lane : OUTPUT_LANE_SIGNAL;
+
+    ++unclassified.queued[target];
+    lanes[target].push_back({buffer, next_seq++, nullptr, message_continues, nullptr});
+    ++n_buffers;
+
+    if (message_continues) {
+        return;
+    }
+
+    // The message is complete; what was pushed meanwhile goes in now, in
+    // the order it came, and may open the next stream.
+    open_lane = -1;
+    std::deque<HeldBuffer> released;
+    released.swap(held);
+    n_buffers -= released.size();
+
+    for (const HeldBuffer &held_buffer : released) {
+        push(held_buffer.buffer, held_buffer.lane,
+             held_buffer.sender ? &*held_buffer.sender : nullptr, held_buffer.message_continues,
+             held_buffer.coalesce_key ? &*held_buffer.coalesce_key : nullptr);
+    }
+}
+
+Buffer *OutputQueue::next() {
+    if (current_lane >= 0) {
+        std::list<QueuedBuffer> &lane = lanes[current_lane];
+        if (continuing || (!lane.empty() && lane.front().buffer->sent > 0)) {
+            return lane.empty() ? nullptr : lane.front().buffer;
+        }
+    }
+
+    for (int lane = 0; lane < N_OUTPUT_LANES; ++lane) {
+        if (!lanes[lane].empty()) {
+            current_lane = lane;
+            return lanes[lane].front().buffer;
+        }
+    }
+
+    current_lane = -1;
+    return nullptr;
+}
+
+bool OutputQueue::pop() {
+    std::list<QueuedBuffer> &lane = lanes[current_lane];
+    QueuedBuffer queued = lane.front();
+    lane.pop_front();
+    --n_buffers;
+    continuing = queued.message_continues;
+    uncount(queued, current_lane);
+
+    for (int lower = current_lane + 1; lower < N_OUTPUT_LANES; ++lower) {
+        if (!lanes[lower].empty() && lanes[lower].front().seq < queued.seq) {
+            return true;
+        }
+    }
+    return false;
+}
+
+Buffer *OutputQueue::find_coalescable(const std::string& key) const {
+    auto found = coalescable.find(key);
+    if (found == coalescable.end() || found->second.it->buffer->sent > 0) {
+        return nullptr;
+    }
+    return found->second.it->buffer;
+}
+
+void OutputQueue::take_coalescable(const std::string& key) {
+    auto [lane, it] = coalescable.find(key)->second;
+    uncount(*it, lane);
+    lanes[lane].erase(it);
+    --n_buffers;
+}
+
+void OutputQueue::uncount(const QueuedBuffer& queued, int lane) {
+    if (queued.coalesce_key) {
+        coalescable.erase(coalescable.find(*queued.coalesce_key));
+    }
+
+    if (queued.sender) {
+        SenderLanes &sender_lanes = queued.sender->second;
+        --sender_lanes.queued[lane];
+        if (lowest_queued_lane(sender_lanes.queued) < 0) {
+            senders.erase(senders.find(queued.sender->first));
+        }
+    } else {
+        --unclassified.queued[lane];
+    }
+}
+
+void OutputQueue::for_each(const std::function<void(Buffer *)>& fn) const {
+    for (const auto &lane : lanes) {
+        for (const QueuedBuffer &queued : lane) {
+            fn(queued.buffer);
+        }
+    }
+    for (const HeldBuffer &held_buffer : held) {
+        fn(held_buffer.buffer);
+    }
+}
+
+void OutputQueue::clear() {
+    for (auto &lane : lanes) {
+        for (QueuedBuffer &queued : lane) {
+            queued.buffer->unref();
+        }
+        lane.clear();
+    }
+    for (HeldBuffer &held_buffer : held) {
+        held_buffer.buffer->unref();
+    }
+    held.clear();
+    senders.clear();
+    coalescable.clear();
+    unclassified = SenderLanes();
+    current_lane = -1;
+    continuing = false;
+    open_lane = -1;
+    n_buffers = 0;
+}
@@ -0,0 +1,114 @@
+#include "../headers/flatpak-proxy-client.h"
+#include "../headers/policy-args.h"
+#include <fstream>
+
+PolicyArgResult apply_policy_rule(PolicyTable *table, const std::string& arg) {
+    if (arg.starts_with("--see=") ||
+        arg.starts_with("--talk=") ||
+        arg.starts_with("--own=")) {
+
+        FlatpakPolicy policy = FLATPAK_POLICY_SEE;
+        std::string name = arg.substr(arg.find('=') + 1);
+        bool wildcard = false;
+
+        if (arg[2] == 't')
+            policy = FLATPAK_POLICY_TALK;
+        else if (arg[2] == 'o')
+            policy = FLATPAK_POLICY_OWN;
+
+        if (name.ends_with(".*")) {
+            name.resize(name.size() - 2);
+            wildcard = true;
+        }
+
+        if (name.empty() || name[0] == ':') {
+            std::cerr << "'" << name << "' is not a valid dbus name\n";
+            return POLICY_ARG_INVALID;
+        }
+
+        table->add_policy(name, wildcard, policy);
+        return POLICY_ARG_APPLIED;
+    } else if (arg.starts_with("--call=") ||
+               arg.starts_with("--broadcast=")) {
+
+        std::string rest = arg.substr(arg.find('=') + 1);
+        size_t name_end = rest.find('=');
+        bool wildcard = false;
+
+        if (name_end == std::string::npos) {
+            std::cerr << "'" << rest << "' is not a valid name + rule\n";
+            return POLICY_ARG_INVALID;
+        }
+
+        std::string name = rest.substr(0, name_end);
+        std::string rule = rest.substr(name_end + 1);
+
+        if (name.ends_with(".*")) {
+            name.resize(name.size() - 2);
+            wildcard = true;
+        }
+
+        if (arg.starts_with("--call="))
+            table->add_call_rule(name, wildcard, rule);
+        else
+            table->add_broadcast_rule(name, wildcard, rule);
+
+        return POLICY_ARG_APPLIED;
+    }
+
+    return POLICY_ARG_UNKNOWN;
+}
+
+bool load_policy_rules(const std::string& path, PolicyTable *table) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        std::cerr << "Failed to read policy from " << path << "\n";
+        return false;
+    }
+    std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    size_t start = 0;
+    for (size_t i = 0; i <= data.size(); ++i) {
+        if (i < data.size() && data[i] != '\0' && data[i] != '\n') {
+            continue;
+        }
+
+        std::string arg = data.substr(start, i - start);
+        start = i + 1;
+        if (arg.empty()) {
+            continue;
+        }
+
+        PolicyArgResult res = apply_policy_rule(table, arg);
+        if (res == POLICY_ARG_UNKNOWN) {
+            std::cerr << "Unsupported option " << arg << " in " << path << "\n";
+        }
+        if (res != POLICY_ARG_APPLIED) {
+            return false;
+        }
+    }
+    return true;
+}
+
+PolicyArgResult apply_policy_arg(FlatpakProxy *proxy, const std::string& arg) {
+    PolicyArgResult res = apply_policy_rule(proxy->policy.get(), arg);
+    if (res != POLICY_ARG_UNKNOWN) {
+        return res;
+    }
+
+    if (arg == "--log") {
+        proxy->set_log_messages(true);
+        return POLICY_ARG_APPLIED;
+    } else if (arg == "--filter") {
+        proxy->set_filter(true);
+        return POLICY_ARG_APPLIED;
+    } else if (arg == "--sloppy-names") {
+        proxy->set_sloppy_names(true);
+        return POLICY_ARG_APPLIED;
+    } else if (arg == "--coalesce-properties") {
+        proxy->set_coalesce_properties(true);
+        return POLICY_ARG_APPLIED;
+    }
+
+    return POLICY_ARG_UNKNOWN;
+}
@@ -0,0 +1,203 @@
+#include "../headers/flatpak-proxy-client.h"
+#include "../headers/policy-image.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <map>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+PolicyImage::~PolicyImage() {
+    if (map) {
+        munmap(const_cast<uint8_t *>(map), map_size);
+    }
+}
+
+bool PolicyImage::open(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "Failed to open policy file " << path << ": " << strerror(errno) << "\n";
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(PolicyImageHeader)) {
+        std::cerr << path << " is not a compiled policy\n";
+        ::close(fd);
+        return false;
+    }
+
+    map_size = static_cast<size_t>(st.st_size);
+    void *addr = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        std::cerr << "Failed to map policy file " << path << ": " << strerror(errno) << "\n";
+        map_size = 0;
+        return false;
+    }
+    map = static_cast<const uint8_t *>(addr);
+    header = reinterpret_cast<const PolicyImageHeader *>(map);
+
+    if (!validate(path)) {
+        return false;
+    }
+
+    names = reinterpret_cast<const PolicyImageName *>(map + header->names_offset);
+    rules = reinterpret_cast<const PolicyImageRule *>(map + header->rules_offset);
+    strings = reinterpret_cast<const char *>(map + header->strings_offset);
+    file_identity = std::to_string(st.st_dev) + ":" + std::to_string(st.st_ino) + ":" +
+                    std::to_string(st.st_mtim.tv_sec) + "." + std::to_string(st.st_mtim.tv_nsec);
+    return true;
+}
+
+// Checks every offset against the mapping, so lookups never need to.
+bool PolicyImage::validate(const std::string& path) const {
+    if (memcmp(header->magic, POLICY_IMAGE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->byte_order_mark != POLICY_IMAGE_BYTE_ORDER_MARK) {
+        std::cerr << path << " is not a compiled policy for this host\n";
+        return false;
+    }
+
+    uint64_t names_end = header->names_offset + uint64_t(header->n_names) * sizeof(PolicyImageName);
+    uint64_t rules_end = header->rules_offset + uint64_t(header->n_rules) * sizeof(PolicyImageRule);
+    uint64_t strings_end = header->strings_offset + uint64_t(header->strings_size);
+
+    if (header->names_offset % alignof(PolicyImageName) != 0 ||
+        header->rules_offset % alignof(PolicyImageRule) != 0 ||
+        names_end > map_size || rules_end > map_size || strings_end > map_size ||
+        header->strings_size == 0) {
+        std::cerr << path << " is truncated or corrupt\n";
+        return false;
+    }
+
+    const char *table = reinterpret_cast<const char *>(map + header->strings_offset);
+    if (table[0] != '\0' || table[header->strings_size - 1] != '\0') {
+        std::cerr << path << " has a corrupt string table\n";
+        return false;
+    }
+
+    auto image_names = reinterpret_cast<const PolicyImageName *>(map + header->names_offset);
+    auto image_rules = reinterpret_cast<const PolicyImageRule *>(map + header->rules_offset);
+
+    for (uint32_t i = 0; i < header->n_names; ++i) {
+        const PolicyImageName &entry = image_names[i];
+        if (entry.name >= header->strings_size ||
+            uint64_t(entry.first_rule) + entry.n_rules > header->n_rules ||
+            (i > 0 && strcmp(table + image_names[i - 1].name, table + entry.name) >= 0)) {
+            std::cerr << path << " has a corrupt name index\n";
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < header->n_rules; ++i) {
+        const PolicyImageRule &rule = image_rules[i];
+        if (rule.path >= header->strings_size ||
+            rule.interface >= header->strings_size ||
+            rule.member >= header->strings_size ||
+            rule.policy > FLATPAK_POLICY_OWN ||
+            (rule.types & ~FILTER_TYPE_ALL) != 0) {
+            std::cerr << path << " has a corrupt rule table\n";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+const PolicyImageName *PolicyImage::find_name(const std::string& name) const {
+    const PolicyImageName *end = names + header->n_names;
+    const PolicyImageName *it = std::lower_bound(names, end, name, [this](const PolicyImageName& entry, const std::string& key) {
+        return strcmp(strings + entry.name, key.c_str()) < 0;
+    });
+
+    if (it != end && name == strings + it->name) {
+        return it;
+    }
+    return nullptr;
+}
+
+bool write_policy_image(const PolicyTable& table, const std::string& path) {
+    std::string strings(1, '\0');
+    std::map<std::string, uint32_t> interned;
+    std::vector<std::pair<std::string, bool>> table_names;
+    std::vector<PolicyImageName> image_names;
+    std::vector<PolicyImageRule> image_rules;
+
+    auto intern = [&](const std::string& s) -> uint32_t {
+        if (s.empty()) {
+            return 0;
+        }
+        auto [it, inserted] = interned.try_emplace(s, static_cast<uint32_t>(strings.size()));
+        if (inserted) {
+            strings.append(s);
+            strings.push_back('\0');
+        }
+        return it->second;
+    };
+
+    table.for_each_name([&](const std::string& name, bool subtree) {
+        table_names.emplace_back(name, subtree);
+    });
+    std::sort(table_names.begin(), table_names.end());
+
+    for (auto &[name, subtree] : table_names) {
+        PolicyImageName entry = {};
+        entry.name = intern(name);
+        entry.first_rule = static_cast<uint32_t>(image_rules.size());
+        entry.flags = subtree ? POLICY_IMAGE_NAME_SUBTREE : 0;
+
+        for (auto *filter : *table.find(name)) {
+            PolicyImageRule rule = {};
+            rule.path = intern(filter->path);
+            rule.interface = intern(filter->interface);
+            rule.member = intern(filter->member);
+            rule.policy = static_cast<uint8_t>(filter->policy);
+            rule.types = static_cast<uint8_t>(filter->types);
+            rule.name_is_subtree = filter->name_is_subtree;
+            rule.path_is_subtree = filter->path_is_subtree;
+            image_rules.push_back(rule);
+        }
+
+        entry.n_rules = static_cast<uint32_t>(image_rules.size()) - entry.first_rule;
+        image_names.push_back(entry);
+    }
+
+    PolicyImageHeader header = {};
+    memcpy(header.magic, POLICY_IMAGE_MAGIC, sizeof(header.magic));
+    header.byte_order_mark = POLICY_IMAGE_BYTE_ORDER_MARK;
+    header.n_names = static_cast<uint32_t>(image_names.size());
+    header.n_rules = static_cast<uint32_t>(image_rules.size());
+    header.names_offset = sizeof(PolicyImageHeader);
+
+    uint64_t rules_offset = header.names_offset + image_names.size() * sizeof(PolicyImageName);
+    uint64_t strings_offset = rules_offset + image_rules.size() * sizeof(PolicyImageRule);
+    if (strings_offset + strings.size() > UINT32_MAX) {
+        std::cerr << "Policy is too large to compile\n";
+        return false;
+    }
+    header.rules_offset = static_cast<uint32_t>(rules_offset);
+    header.strings_offset = static_cast<uint32_t>(strings_offset);
+    header.strings_size = static_cast<uint32_t>(strings.size());
+
+    std::string tmp_path = path + ".tmp";
+    FILE *file = fopen(tmp_path.c_str(), "wbe");
+    if (file == nullptr) {
+        std::cerr << "Failed to create " << tmp_path << ": " << strerror(errno) << "\n";
+        return false;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(image_names.data(), sizeof(PolicyImageName), image_names.size(), file) == image_names.size() &&
+              fwrite(image_rules.data(), sizeof(PolicyImageRule), image_rules.size(), file) == image_rules.size() &&
+              fwrite(strings.data(), 1, strings.size(), file) == strings.size();
+    ok = (fclose(file) == 0) && ok;
+
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::cerr << "Failed to write " << path << ": " << strerror(errno) << "\n";
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
@@ -1,5 +1,6 @@
 #include "../headers/flatpak-proxy-client.h"
 #include "../headers/utils.h"
+#include <unistd.h>
 
 ProxySide::ProxySide() : 
     client(nullptr),
@@ -11,9 +12,7 @@ ProxySide::ProxySide() :
     in_source(nullptr),
     out_source(nullptr) {
     
-    header_buffer = new Buffer(16, nullptr);
-    current_read_buffer = header_buffer;
-    std::cerr << "ProxySide(): created with header_buffer=" << header_buffer << "\n";
+    std::cerr << "ProxySide(): created\n";
 }
 
 ProxySide::ProxySide(std::shared_ptr<FlatpakProxyClient> client, bool is_bus_side) :
@@ -26,10 +25,8 @@ ProxySide::ProxySide(std::shared_ptr<FlatpakProxyClient> client, bool is_bus_sid
     in_source(nullptr),
     out_source(nullptr) {
     
-    header_buffer = new Buffer(16, nullptr);
-    current_read_buffer = header_buffer;
-    std::cerr << "ProxySide(client): created with header_buffer=" << header_buffer 
-              << " for " << (is_bus_side ? "BUS" : "CLIENT") << " side\n";
+    // The header buffer is allocated by the first read after auth.
+    std::cerr << "ProxySide(client): created for " << (is_bus_side ? "BUS" : "CLIENT") << " side\n";
 }
 
 // Конструктор перемещения
@@ -40,10 +37,19 @@ ProxySide::ProxySide(ProxySide&& other) noexcept :
     header_buffer(other.header_buffer),
     closed(other.closed),
     got_first_byte(other.got_first_byte),
-    extra_input_data(std::move(other.extra_input_data)),
-    control_messages(std::move(other.control_messages)),
+    auth_scratch(std::move(other.auth_scratch)),
+    auth_scratch_start(other.auth_scratch_start),
+    auth_scratch_end(other.auth_scratch_end),
+    fds(std::move(other.fds)),
     expected_replies(std::move(other.expected_replies)),
     buffers(std::move(other.buffers)),
+    queued_bytes(other.queued_bytes),
+    read_paused(other.read_paused),
+    cut_through_size(other.cut_through_size),
+    stream_remaining(other.stream_remaining),
+    paused_since(other.paused_since),
+    paused_time(other.paused_time),
+    pause_count(other.pause_count),
     in_source(other.in_source),
     out_source(other.out_source) {
     
@@ -70,10 +76,19 @@ ProxySide& ProxySide::operator=(ProxySide&& other) noexcept {
         header_buffer = other.header_buffer;
         closed = other.closed;
         got_first_byte = other.got_first_byte;
-        extra_input_data = std::move(other.extra_input_data);
-        control_messages = std::move(other.control_messages);
+        auth_scratch = std::move(other.auth_scratch);
+        auth_scratch_start = other.auth_scratch_start;
+        auth_scratch_end = other.auth_scratch_end;
+        fds = std::move(other.fds);
         expected_replies = std::move(other.expected_replies);
         buffers = std::move(other.buffers);
+        queued_bytes = other.queued_bytes;
+        read_paused = other.read_paused;
+        cut_through_size = other.cut_through_size;
+        stream_remaining = other.stream_remaining;
+        paused_since = other.paused_since;
+        paused_time = other.paused_time;
+        pause_count = other.pause_count;
         in_source = other.in_source;
         out_source = other.out_source;
         
@@ -95,22 +110,25 @@ void ProxySide::cleanup() {
         connection = nullptr;
     }
 
+    if (current_read_buffer && current_read_buffer != header_buffer) {
+        current_read_buffer->unref();
+    }
+    current_read_buffer = nullptr;
+
     if (header_buffer) {
         header_buffer->unref();
         header_buffer = nullptr;
     }
 
-    extra_input_data.clear();
+    release_auth_scratch();
 
-    for (auto buffer : buffers) {
-        buffer->unref();
-    }
     buffers.clear();
+    queued_bytes = 0;
 
-    for (auto msg : control_messages) {
-        g_object_unref(msg);
+    for (int fd : fds) {
+        close(fd);
     }
-    control_messages.clear();
+    fds.clear();
 
     if (in_source) {
         g_source_destroy(in_source);
@@ -149,7 +167,11 @@ void ProxySide::side_closed() {
     }
 
     if (other_side->closed) {
-        client.reset();
+        std::shared_ptr<FlatpakProxyClient> self = std::move(client);
+        other_side->client.reset();
+        if (self->proxy) {
+            self->proxy->release_client(std::move(self));
+        }
     } else {
         GError *error = nullptr;
         if (!g_socket_shutdown(other_socket, TRUE, FALSE, &error)) {
@@ -167,6 +189,23 @@ void ProxySide::got_buffer_from_side(Buffer *buffer) {
     }
 }
 
+void ProxySide::release_auth_scratch() {
+    std::vector<uint8_t>().swap(auth_scratch);
+    auth_scratch_start = 0;
+    auth_scratch_end = 0;
+}
+
+// Gives back what an idle side holds between messages. The header buffer
+// is only dropped at a message boundary, when it carries nothing.
+void ProxySide::trim() {
+    if (header_buffer && current_read_buffer == header_buffer && header_buffer->pos == 0) {
+        header_buffer->unref();
+        header_buffer = nullptr;
+        current_read_buffer = nullptr;
+    }
+    expected_replies.trim();
+}
+
 ProxySide *ProxySide::get_other_side() {
     FlatpakProxyClient *client_ptr = client.get();
     if (this == &client_ptr->client_side) {
@@ -176,6 +215,10 @@ ProxySide *ProxySide::get_other_side() {
 }
 
 void ProxySide::start_reading() {
+    if (in_source || read_paused) {
+        return;
+    }
+
     GSocket *socket = g_socket_connection_get_socket(connection);
     if (!G_IS_SOCKET(socket)) {
         std::cerr << "[start_reading] invalid socket\n";
@@ -193,4 +236,31 @@ void ProxySide::stop_reading() {
         g_source_destroy(in_source);
         in_source = nullptr;
     }
-}
\ No newline at end of file
+}
+
+// Backpressure: the other side's output queue went over the high watermark,
+// stop producing into it until it drains below the low watermark.
+void ProxySide::pause_reading() {
+    if (read_paused) {
+        return;
+    }
+
+    stop_reading();
+    read_paused = true;
+    paused_since = g_get_monotonic_time();
+    ++pause_count;
+}
+
+void ProxySide::resume_reading() {
+    if (!read_paused) {
+        return;
+    }
+
+    read_paused = false;
+    paused_time += g_get_monotonic_time() - paused_since;
+    paused_since = 0;
+
+    if (!closed) {
+        start_reading();
+    }
+}
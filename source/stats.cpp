@@ -0,0 +1,217 @@
+#include "../headers/flatpak-proxy-client.h"
+#include <gio/gunixsocketaddress.h>
+#include <cstdio>
+#include <sstream>
+#include <sys/stat.h>
+
+const char *const handler_names[N_BUS_HANDLERS] = {
+    "pass",
+    "deny",
+    "hide",
+    "filter_name_list_reply",
+    "filter_has_owner_reply",
+    "filter_get_owner_reply",
+    "validate_own",
+    "validate_see",
+    "validate_talk",
+    "validate_match",
+};
+
+void ProxyStats::add(const ProxyStats& other) {
+    messages_from_client += other.messages_from_client;
+    bytes_from_client += other.bytes_from_client;
+    messages_from_bus += other.messages_from_bus;
+    bytes_from_bus += other.bytes_from_bus;
+    for (int i = 0; i < N_BUS_HANDLERS; ++i) {
+        handler_counts[i] += other.handler_counts[i];
+    }
+    replies_rewritten += other.replies_rewritten;
+    bus_messages_withheld += other.bus_messages_withheld;
+    messages_reordered += other.messages_reordered;
+    properties_coalesced += other.properties_coalesced;
+}
+
+std::string json_escape(const std::string& s) {
+    std::string result;
+    for (char ch : s) {
+        switch (ch) {
+            case '"': result += "\\\""; break;
+            case '\\': result += "\\\\"; break;
+            default:
+                if (static_cast<unsigned char>(ch) < 0x20) {
+                    char escaped[8];
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", ch);
+                    result += escaped;
+                } else {
+                    result += ch;
+                }
+        }
+    }
+    return result;
+}
+
+size_t side_fds_in_flight(const ProxySide& side) {
+    size_t n_fds = side.fds.size();
+    side.buffers.for_each([&n_fds](Buffer *buffer) {
+        n_fds += buffer->fds.size();
+    });
+    return n_fds;
+}
+
+void write_stats(std::ostringstream& out, const ProxyStats& stats) {
+    out << "\"messages_from_client\":" << stats.messages_from_client
+        << ",\"bytes_from_client\":" << stats.bytes_from_client
+        << ",\"messages_from_bus\":" << stats.messages_from_bus
+        << ",\"bytes_from_bus\":" << stats.bytes_from_bus
+        << ",\"replies_rewritten\":" << stats.replies_rewritten
+        << ",\"bus_messages_withheld\":" << stats.bus_messages_withheld
+        << ",\"messages_reordered\":" << stats.messages_reordered
+        << ",\"properties_coalesced\":" << stats.properties_coalesced
+        << ",\"handlers\":{";
+    for (int i = 0; i < N_BUS_HANDLERS; ++i) {
+        out << (i ? "," : "") << "\"" << handler_names[i] << "\":" << stats.handler_counts[i];
+    }
+    out << "}";
+}
+
+void write_side(std::ostringstream& out, const ProxySide& side) {
+    out << "{\"queued_buffers\":" << side.buffers.size()
+        << ",\"queued_bytes\":" << side.queued_bytes
+        << ",\"expected_replies\":" << side.expected_replies.size()
+        << ",\"fds_in_flight\":" << side_fds_in_flight(side)
+        << ",\"read_paused\":" << (side.read_paused ? "true" : "false")
+        << ",\"pause_count\":" << side.pause_count
+        << ",\"paused_us\":" << side.paused_time
+        << "}";
+}
+
+std::string FlatpakProxy::stats_report() {
+    ProxyStats totals = retired_stats;
+    std::ostringstream clients_out;
+    bool first = true;
+
+    for (auto &client : clients) {
+        totals.add(client->stats);
+
+        clients_out << (first ? "" : ",")
+                    << "{\"id\":" << client->id << ","
+                    << "\"unique_name\":\"" << json_escape(client->unique_name) << "\","
+                    << "\"memory_usage\":" << client->memory_usage() << ","
+                    << "\"trimmed\":" << (client->trimmed ? "true" : "false") << ",";
+        write_stats(clients_out, client->stats);
+        clients_out << ",\"client_side\":";
+        write_side(clients_out, client->client_side);
+        clients_out << ",\"bus_side\":";
+        write_side(clients_out, client->bus_side);
+        clients_out << "}";
+        first = false;
+    }
+
+    std::ostringstream out;
+    out << "{\"socket_path\":\"" << json_escape(socket_path) << "\","
+        << "\"dbus_address\":\"" << json_escape(dbus_address) << "\","
+        << "\"n_clients\":" << clients.size() << ","
+        << "\"policy_generation\":" << policy_generation << ","
+        << "\"policy_rules\":" << policy->n_rules() << ",";
+    write_stats(out, totals);
+    out << ",\"latency\":";
+    latency.dump_json(out);
+    out << ",\"clients\":[" << clients_out.str() << "]}\n";
+    return out.str();
+}
+
+void FlatpakProxy::set_stats_socket(const std::string& path) {
+    this->stats_socket_path = path;
+}
+
+const std::string& FlatpakProxy::get_stats_socket_path() const {
+    return stats_socket_path;
+}
+
+// A report on its way to a reader. It owns everything the write needs,
+// so the proxy may be stopped before the reader takes it all.
+struct StatsReply {
+    GSocketConnection *conn;
+    std::string report;
+};
+
+static void stats_sent_cb(GObject *source, GAsyncResult *res, gpointer data) {
+    auto reply = static_cast<StatsReply *>(data);
+    GError *error = nullptr;
+
+    if (!g_output_stream_write_all_finish(G_OUTPUT_STREAM(source), res, nullptr, &error)) {
+        std::cerr << "Failed to send stats: " << error->message << "\n";
+        g_error_free(error);
+    }
+
+    g_io_stream_close(G_IO_STREAM(reply->conn), nullptr, nullptr);
+    g_object_unref(reply->conn);
+    delete reply;
+}
+
+// Written asynchronously: a reader that doesn't read must not stall the
+// clients of every proxy in the process.
+void FlatpakProxy::send_stats(GSocketConnection *conn) {
+    auto reply = new StatsReply{G_SOCKET_CONNECTION(g_object_ref(conn)), stats_report()};
+    GOutputStream *stream = g_io_stream_get_output_stream(G_IO_STREAM(conn));
+
+    g_output_stream_write_all_async(stream, reply->report.data(), reply->report.size(),
+                                    G_PRIORITY_DEFAULT, nullptr, stats_sent_cb, reply);
+}
+
+bool FlatpakProxy::start_stats() {
+    std::filesystem::remove(stats_socket_path);
+
+    GError *error = nullptr;
+    GSocketAddress *s_address = g_unix_socket_address_new(stats_socket_path.c_str());
+    stats_service = g_socket_service_new();
+
+    // The report lists the clients' unique names and traffic, so only our
+    // user may read it.
+    mode_t old_umask = umask(0077);
+    bool res = g_socket_listener_add_address(
+        G_SOCKET_LISTENER(stats_service),
+        s_address,
+        G_SOCKET_TYPE_STREAM,
+        G_SOCKET_PROTOCOL_DEFAULT,
+        nullptr,
+        nullptr,
+        &error
+    );
+    umask(old_umask);
+
+    g_object_unref(s_address);
+    stats_socket_bound = res;
+
+    if (!res) {
+        if (error) {
+            std::cerr << "Failed to start stats socket: " << error->message << "\n";
+            g_error_free(error);
+        }
+        return false;
+    }
+
+    g_signal_connect(
+        stats_service,
+        "incoming",
+        G_CALLBACK(+[](GSocketService *, GSocketConnection *conn, GObject *, gpointer data) -> gboolean {
+            auto *proxy = static_cast<FlatpakProxy *>(data);
+            proxy->send_stats(conn);
+            return TRUE;
+        }),
+        this
+    );
+
+    g_socket_service_start(stats_service);
+    return true;
+}
+
+void FlatpakProxy::stop_stats() {
+    if (stats_service) {
+        g_socket_service_stop(stats_service);
+    }
+    if (stats_socket_bound) {
+        std::filesystem::remove(stats_socket_path);
+        stats_socket_bound = false;
+    }
+}
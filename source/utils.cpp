@@ -1,10 +1,14 @@
 #include "../headers/utils.h"
 #include "../headers/flatpak-proxy-client.h"
+#include "../headers/probes.h"
+#include <unistd.h>
+
+void queue_outgoing_buffer(ProxySide *side, Buffer *buffer);
+void queue_outgoing_chunk(ProxySide *side, Buffer *buffer, bool message_continues);
 
 #define AUTH_LINE_SENTINEL "\r\n"
 #define AUTH_BEGIN "BEGIN"
-#define FIND_AUTH_END_CONTINUE -1
-#define FIND_AUTH_END_ABORT -2
+
 
 uint32_t read_uint32(Header *header, uint8_t *ptr) {
     return header->big_endian
@@ -12,6 +16,10 @@ uint32_t read_uint32(Header *header, uint8_t *ptr) {
            : GUINT32_FROM_LE(*(guint32 *) ptr);
 }
 
+void write_uint32(Header *header, uint8_t *ptr, uint32_t value) {
+    *(guint32 *) ptr = header->big_endian ? GUINT32_TO_BE(value) : GUINT32_TO_LE(value);
+}
+
 uint32_t align_by_8(uint32_t offset) {
     return (offset + 8 - 1) & ~(8 - 1);
 }
@@ -20,8 +28,8 @@ uint32_t align_by_4(uint32_t offset) {
     return (offset + 4 - 1) & ~(4 - 1);
 }
 
-bool auth_line_is_begin(const std::string& line) {
-    const std::string auth_begin = "BEGIN";
+bool auth_line_is_begin(std::string_view line) {
+    const std::string_view auth_begin = AUTH_BEGIN;
     if (!line.starts_with(auth_begin)) 
         return false;
     
@@ -34,7 +42,7 @@ bool auth_line_is_begin(const std::string& line) {
 
 #define _DBUS_ISASCII(c) ((c) != '\0' && (((c) & ~0x7f) == 0))
 
-bool auth_line_is_valid(const std::string& line) {
+bool auth_line_is_valid(std::string_view line) {
     if (line.empty())
         return false;
         
@@ -51,50 +59,202 @@ bool auth_line_is_valid(const std::string& line) {
     return true;
 }
 
-size_t find_auth_line_end(const std::vector<uint8_t> &buffer, size_t offset = 0) {
-    const std::string sentinel = AUTH_LINE_SENTINEL;
-    auto it = std::search(buffer.begin() + offset, buffer.end(), 
-                         sentinel.begin(), sentinel.end());
-    return (it != buffer.end()) ? std::distance(buffer.begin(), it) : std::string::npos;
+size_t find_auth_line_end(const uint8_t *data, size_t from, size_t end) {
+    const std::string_view sentinel = AUTH_LINE_SENTINEL;
+    const uint8_t *it = std::search(data + from, data + end, sentinel.begin(), sentinel.end());
+    return (it != data + end) ? static_cast<size_t>(it - data) : std::string::npos;
 }
 
-ssize_t find_auth_end(FlatpakProxyClient *client, Buffer *buffer, size_t *out_lines_skipped) {
-    size_t offset = 0;
-    size_t original_size = client->auth_buffer.size();
-    size_t lines_skipped = 0;
-    
-    client->auth_buffer.insert(client->auth_buffer.end(), 
-                              buffer->data.begin(), 
-                              buffer->data.begin() + buffer->pos);
-    
-    while (true) {
-        size_t line_end = find_auth_line_end(client->auth_buffer, offset);
-        if (line_end != std::string::npos) {
-            std::string line(reinterpret_cast<char *>(client->auth_buffer.data() + offset),
-                           line_end - offset);
-            
-            if (!auth_line_is_valid(line))
-                return FIND_AUTH_END_ABORT;
-            
-            offset = line_end + strlen(AUTH_LINE_SENTINEL);
-            
-            if (auth_line_is_begin(line)) {
-                *out_lines_skipped = lines_skipped;
-                return static_cast<ssize_t>(offset - original_size);
+// Reads whatever is available into the side's auth scratch region. Only a
+// pending partial line is ever moved, and it is bounded by the region size.
+bool read_auth_data(FlatpakProxyClient *client, ProxySide *side, GSocket *socket) {
+    if (client->auth_state == AUTH_WAITING_FOR_BACKLOG && side == &client->client_side) {
+        return false;
+    }
+
+    if (side->auth_scratch.empty()) {
+        side->auth_scratch.resize(AUTH_SCRATCH_SIZE);
+    }
+
+    if (side->auth_scratch_end == side->auth_scratch.size()) {
+        if (side->auth_scratch_start == 0) {
+            if (client->proxy->log_messages) {
+                std::cerr << "AUTH line too long, aborting\n";
+            }
+            side->side_closed();
+            return false;
+        }
+
+        std::memmove(side->auth_scratch.data(),
+                     side->auth_scratch.data() + side->auth_scratch_start,
+                     side->auth_scratch_end - side->auth_scratch_start);
+        side->auth_scratch_end -= side->auth_scratch_start;
+        side->auth_scratch_start = 0;
+    }
+
+    GError *error = nullptr;
+    gssize res = g_socket_receive(
+        socket,
+        reinterpret_cast<gchar *>(side->auth_scratch.data() + side->auth_scratch_end),
+        side->auth_scratch.size() - side->auth_scratch_end,
+        nullptr, &error
+    );
+
+    if (res < 0 && g_error_matches(error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+        g_error_free(error);
+        return false;
+    }
+
+    if (res <= 0) {
+        if (res != 0 && error) {
+            std::cerr << "Socket error during auth: " << error->message << "\n";
+            g_error_free(error);
+        }
+        side->side_closed();
+        return false;
+    }
+
+    side->auth_scratch_end += static_cast<size_t>(res);
+    return true;
+}
+
+// Hands the scratch bytes up to `upto` to the other side as one buffer.
+void forward_auth_bytes(ProxySide *side, size_t upto) {
+    size_t len = upto - side->auth_scratch_start;
+    if (len == 0)
+        return;
+
+    Buffer *buffer = new Buffer(len);
+    std::copy_n(side->auth_scratch.begin() + side->auth_scratch_start, len, buffer->data.begin());
+    buffer->pos = len;
+
+    side->auth_scratch_start = upto;
+    if (side->auth_scratch_start == side->auth_scratch_end) {
+        side->auth_scratch_start = side->auth_scratch_end = 0;
+    }
+
+    side->got_buffer_from_side(buffer);
+}
+
+// Forwards complete client auth lines to the bus, stopping after BEGIN.
+// Anything pipelined after BEGIN stays in the scratch region for the framer.
+bool relay_client_auth_lines(FlatpakProxyClient *client, ProxySide *side, size_t scan_from) {
+    const uint8_t *data = side->auth_scratch.data();
+    size_t line_start = side->auth_scratch_start;
+    AuthState new_auth_state = client->auth_state;
+
+    while (new_auth_state == AUTH_WAITING_FOR_BEGIN) {
+        size_t line_end = find_auth_line_end(data, std::max(line_start, scan_from), side->auth_scratch_end);
+        if (line_end == std::string::npos)
+            break;
+
+        std::string_view line(reinterpret_cast<const char *>(data + line_start), line_end - line_start);
+        if (!auth_line_is_valid(line)) {
+            if (client->proxy->log_messages) {
+                std::cerr << "Invalid AUTH line, aborting\n";
             }
-            
-            ++lines_skipped;
+            side->side_closed();
+            return false;
+        }
+
+        line_start = line_end + strlen(AUTH_LINE_SENTINEL);
+
+        if (auth_line_is_begin(line)) {
+            new_auth_state = (client->auth_replies == client->auth_requests)
+                             ? AUTH_COMPLETE
+                             : AUTH_WAITING_FOR_BACKLOG;
         } else {
-            *out_lines_skipped = lines_skipped;
-            client->auth_buffer.erase(client->auth_buffer.begin(), 
-                                    client->auth_buffer.begin() + offset);
+            ++client->auth_requests;
+        }
+    }
+
+    forward_auth_bytes(side, line_start);
+    client->auth_state = new_auth_state;
+    if (new_auth_state == AUTH_COMPLETE) {
+        PROXY_PROBE1(auth_complete, client);
+    }
+    return true;
+}
+
+// Forwards complete bus auth replies to the client. Once the last reply the
+// client is waiting for has passed, the remaining bytes belong to the framer.
+bool relay_bus_auth_lines(FlatpakProxyClient *client, ProxySide *side, size_t scan_from,
+                          bool *wake_client_reader) {
+    const uint8_t *data = side->auth_scratch.data();
+    size_t line_start = side->auth_scratch_start;
 
-            if (client->auth_buffer.size() >= 16 * 1024)
-                return FIND_AUTH_END_ABORT;
+    while (true) {
+        size_t line_end = find_auth_line_end(data, std::max(line_start, scan_from), side->auth_scratch_end);
+        if (line_end == std::string::npos)
+            break;
 
-            return FIND_AUTH_END_CONTINUE;
+        if (client->auth_replies == client->auth_requests) {
+            if (client->proxy->log_messages) {
+                std::cerr << "Unexpected auth reply line from bus, aborting\n";
+            }
+            side->side_closed();
+            return false;
+        }
+
+        ++client->auth_replies;
+        line_start = line_end + strlen(AUTH_LINE_SENTINEL);
+
+        if (client->auth_state == AUTH_WAITING_FOR_BACKLOG &&
+            client->auth_replies == client->auth_requests) {
+            forward_auth_bytes(side, line_start);
+            client->auth_state = AUTH_COMPLETE;
+            PROXY_PROBE1(auth_complete, client);
+            *wake_client_reader = true;
+            return true;
         }
     }
+
+    forward_auth_bytes(side, line_start);
+    return true;
+}
+
+bool relay_auth_data(FlatpakProxyClient *client, ProxySide *side, GSocket *socket, bool *wake_client_reader) {
+    // A CRLF may straddle two reads, so only the last old byte is rescanned.
+    // Offsets are kept relative to the start since reading may compact.
+    size_t pending = side->auth_scratch_end - side->auth_scratch_start;
+    size_t rescan = (pending > 0) ? pending - 1 : 0;
+
+    if (!read_auth_data(client, side, socket))
+        return false;
+
+    size_t scan_from = side->auth_scratch_start + rescan;
+
+    if (side == &client->client_side)
+        return relay_client_auth_lines(client, side, scan_from);
+
+    return relay_bus_auth_lines(client, side, scan_from, wake_client_reader);
+}
+
+// For a message of `required` bytes whose fixed header is in
+// `header_buffer`: the size of its header including the fields, if the body
+// may be streamed once the header has been judged, else 0. Capture records
+// whole messages, so it keeps every message store-and-forward.
+static size_t cut_through_head_size(FlatpakProxyClient *client, Buffer *header_buffer, size_t required) {
+    size_t threshold = client->proxy->cut_through_threshold;
+    if (threshold == 0 || required < threshold || client->proxy->capture) {
+        return 0;
+    }
+
+    Header header;
+    header.big_endian = header_buffer->data[0] == 'B';
+    size_t head_size = align_by_8(16 + read_uint32(&header, &header_buffer->data[12]));
+    return head_size < required ? head_size : 0;
+}
+
+// Points the side at the buffer for its next read: the next body chunk of
+// a cut-through message, or the header of the next message.
+static void next_read_buffer(ProxySide *side) {
+    if (side->stream_remaining > 0) {
+        side->current_read_buffer = new Buffer(std::min<size_t>(side->stream_remaining, CUT_THROUGH_CHUNK));
+    } else {
+        side->header_buffer->pos = 0;
+        side->current_read_buffer = side->header_buffer;
+    }
 }
 
 gboolean side_in_cb(GSocket *socket, GIOCondition, gpointer user_data) {
@@ -118,9 +278,14 @@ gboolean side_in_cb(GSocket *socket, GIOCondition, gpointer user_data) {
             buffer = new Buffer(1);
             std::cerr << "SIDE_IN_CB: Created first byte buffer\n";
         } else if (client->auth_state != AUTH_COMPLETE) {
-            buffer = new Buffer(256);
-            std::cerr << "SIDE_IN_CB: Created auth buffer\n";
+            if (!relay_auth_data(client.get(), side, socket, &wake_client_reader))
+                break;
+            continue;
         } else {
+            if (!side->current_read_buffer) {
+                side->header_buffer = new Buffer(16, nullptr);
+                side->current_read_buffer = side->header_buffer;
+            }
             buffer = side->current_read_buffer;
             std::cerr << "SIDE_IN_CB: Using current_read_buffer=" << buffer 
                       << " (id=" << (buffer ? buffer->buffer_id : -1) << ")\n";
@@ -140,90 +305,28 @@ gboolean side_in_cb(GSocket *socket, GIOCondition, gpointer user_data) {
             break;
         }
 
-        if (client->auth_state != AUTH_COMPLETE) {
-            if (buffer->pos == 0) {
-                buffer->unref();
-                continue;
-            }
-
-            AuthState new_auth_state = client->auth_state;
+        if (!side->got_first_byte) {
             buffer->size = buffer->pos;
-            
-            if (!side->got_first_byte) {
-                buffer->send_credentials = true;
-                side->got_first_byte = true;
-            } else if (side == &client->client_side && client->auth_state == AUTH_WAITING_FOR_BEGIN) {
-                size_t lines_skipped = 0;
-                ssize_t auth_end = find_auth_end(client.get(), buffer, &lines_skipped);
-                
-                client->auth_requests += lines_skipped;
-                
-                if (auth_end >= 0) {
-                    if (client->auth_replies == client->auth_requests) {
-                        new_auth_state = AUTH_COMPLETE;
-                    } else {
-                        new_auth_state = AUTH_WAITING_FOR_BACKLOG;
-                    }
-
-                    size_t extra_data = buffer->pos - static_cast<size_t>(auth_end);
-                    buffer->size = buffer->pos = static_cast<size_t>(auth_end);
-                    
-                    if (extra_data > 0) {
-                        side->extra_input_data.assign(buffer->data.begin() + auth_end,
-                                                    buffer->data.begin() + buffer->pos + extra_data);
-                    }
-                } else if (auth_end == FIND_AUTH_END_ABORT) {
-                    buffer->unref();
-                    if (client->proxy->log_messages) {
-                        std::cerr << "Invalid AUTH line, aborting\n";
-                    }
-                    side->side_closed();
-                    break;
-                }
-            } else if (side == &client->bus_side) {
-                size_t remaining = buffer->pos;
-                uint8_t *line_start = buffer->data.data();
-                
-                while (remaining > 0) {
-                    if (client->auth_replies == client->auth_requests) {
-                        buffer->unref();
-                        if (client->proxy->log_messages) {
-                            std::cerr << "Unexpected auth reply line from bus, aborting\n";
-                        }
-                        side->side_closed();
-                        break;
-                    }
-
-                    std::vector<uint8_t> temp_buffer(line_start, line_start + remaining);
-                    size_t line_end = find_auth_line_end(temp_buffer);
-                    
-                    if (line_end == std::string::npos) {
-                        line_end = remaining;
-                    } else {
-                        line_end += strlen(AUTH_LINE_SENTINEL);
-                        client->auth_replies++;
-                    }
-
-                    remaining -= line_end;
-                    line_start += line_end;
-
-                    if (client->auth_state == AUTH_WAITING_FOR_BACKLOG &&
-                        client->auth_replies == client->auth_requests) {
-                        new_auth_state = AUTH_COMPLETE;
-                        wake_client_reader = true;
-
-                        buffer->pos = buffer->size = line_start - buffer->data.data();
-
-                        if (remaining > 0) {
-                            side->extra_input_data.assign(line_start, line_start + remaining);
-                        }
-                        break;
-                    }
+            buffer->send_credentials = true;
+            side->got_first_byte = true;
+            side->got_buffer_from_side(buffer);
+        } else if (side->stream_remaining > 0) {
+            // Body bytes of an allowed message go out as they arrive. The
+            // fds it declares came with its head; any sent alongside the
+            // body are undeclared and closed, as for a whole message.
+            buffer->size = buffer->pos;
+            side->stream_remaining -= buffer->size;
+            if (!buffer->fds.empty()) {
+                side->fds.insert(side->fds.end(), buffer->fds.begin(), buffer->fds.end());
+                buffer->fds.clear();
+                std::cerr << "Closing " << side->fds.size() << " undeclared fds\n";
+                for (int fd : side->fds) {
+                    close(fd);
                 }
+                side->fds.clear();
             }
-
-            side->got_buffer_from_side(buffer);
-            client->auth_state = new_auth_state;
+            queue_outgoing_chunk(side->get_other_side(), buffer, side->stream_remaining > 0);
+            next_read_buffer(side);
         } else if (buffer->pos == buffer->size) {
             if (buffer == side->header_buffer) {
                 GError *error = nullptr;
@@ -236,18 +339,49 @@ gboolean side_in_cb(GSocket *socket, GIOCondition, gpointer user_data) {
                 } else if (required == 0 || required > 1000000) {
                     std::cerr << "Invalid message size: " << required << "\n";
                     side->current_read_buffer = new Buffer(16, buffer);
+                } else if (size_t head_size = cut_through_head_size(client.get(), buffer, static_cast<size_t>(required))) {
+                    side->cut_through_size = static_cast<size_t>(required);
+                    side->current_read_buffer = new Buffer(head_size, buffer);
                 } else {
                     std::cerr << "SIDE_IN_CB: Creating message buffer of size " << required << "\n";
                     side->current_read_buffer = new Buffer(static_cast<size_t>(required), buffer);
                 }
+            } else if (side->cut_through_size > 0) {
+                // The header of a large message is in; if the policy can
+                // be decided from it, it is forwarded and the body follows.
+                size_t total_size = std::exchange(side->cut_through_size, 0);
+                if (client->start_cut_through(side, buffer, total_size)) {
+                    // The head is no longer ours, and may be gone with the
+                    // side closed.
+                    side->current_read_buffer = nullptr;
+                    if (!side->closed) {
+                        next_read_buffer(side);
+                    }
+                } else {
+                    side->current_read_buffer = new Buffer(total_size, buffer);
+                    buffer->unref();
+                }
             } else {
                 std::cerr << "SIDE_IN_CB: Message complete, processing\n";
+                buffer->framed_at = monotonic_ns();
+                PROXY_PROBE3(message_framed, client.get(), side == &client->bus_side, buffer->size);
+                if (client->proxy->capture) {
+                    client->proxy->capture->record(client->id,
+                                                   side == &client->bus_side ? CAPTURE_FROM_BUS : CAPTURE_FROM_CLIENT,
+                                                   buffer->data.data(), buffer->size,
+                                                   buffer->fds.size());
+                }
                 side->got_buffer_from_side(buffer);
-                side->header_buffer->pos = 0;
-                side->current_read_buffer = side->header_buffer;
+                next_read_buffer(side);
                 std::cerr << "SIDE_IN_CB: Reset to header_buffer\n";
             }
         }
+
+        // Paused by backpressure; bytes left over from auth are not behind a
+        // socket wakeup, so those are always drained first.
+        if (side->read_paused && side->auth_scratch_start == side->auth_scratch_end) {
+            break;
+        }
     }
 
     if (side->closed) {
@@ -266,12 +400,19 @@ gboolean side_in_cb(GSocket *socket, GIOCondition, gpointer user_data) {
 bool send_outgoing_buffers(GSocket *socket, ProxySide *side) {
     bool all_done = false;
 
-    while (!side->buffers.empty()) {
-        Buffer *buffer = side->buffers.front();
-        
+    while (Buffer *buffer = side->buffers.next()) {
         if (buffer->write(side, socket)) {
             if (buffer->sent == buffer->size) {
-                side->buffers.pop_front();
+                if (buffer->framed_at != 0 && buffer->size >= 16) {
+                    LatencyDirection direction = (side == &side->client->bus_side) ? LATENCY_TO_BUS : LATENCY_TO_CLIENT;
+                    side->client->proxy->latency.record_forwarding(direction, buffer->data[1],
+                                                                   monotonic_ns() - buffer->framed_at);
+                }
+                PROXY_PROBE3(buffer_written, side->client.get(), side == &side->client->bus_side, buffer->size);
+                if (side->buffers.pop()) {
+                    ++side->client->stats.messages_reordered;
+                }
+                side->queued_bytes -= buffer->size;
                 buffer->unref();
             }
         } else {
@@ -279,8 +420,23 @@ bool send_outgoing_buffers(GSocket *socket, ProxySide *side) {
         }
     }
 
-    if (side->buffers.empty()) {
-        ProxySide *other_side = side->get_other_side();
+    // Resume reading once the queue has drained, or as soon as nothing in
+    // it can be written: the writer then waits on the next chunk of a
+    // streamed message, which only the paused side can supply.
+    ProxySide *other_side = side->get_other_side();
+    if (other_side->read_paused &&
+        (side->queued_bytes <= side->client->proxy->low_watermark || side->buffers.next() == nullptr)) {
+        other_side->resume_reading();
+        if (side->client->proxy->log_messages) {
+            std::cerr << "Output queue at " << side->queued_bytes << " bytes, resumed "
+                      << (other_side == &side->client->client_side ? "client" : "bus")
+                      << " side (paused " << other_side->paused_time << "us total)\n";
+        }
+    }
+
+    // Also done while a streamed message waits for its next chunk, which
+    // queues the side again.
+    if (side->buffers.next() == nullptr) {
         all_done = true;
 
         if (other_side->closed) {
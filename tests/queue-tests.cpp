@@ -0,0 +1,408 @@
+#include "../headers/flatpak-proxy-client.h"
+#include "../headers/output-queue.h"
+#include "../headers/serial-table.h"
+#include <cstdio>
+#include <map>
+#include <random>
+
+// Checks the ordering rules of OutputQueue and the deletion and expiry of
+// SerialTable, the two structures whose mistakes would reorder or lose
+// messages rather than crash. The proxy's debug logging is silenced in
+// main(), so failures are reported with fprintf.
+
+static int failures = 0;
+
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+            ++failures;                                                     \
+        }                                                                   \
+    } while (0)
+
+// Pops the buffer next() returns, as send_outgoing_buffers() does once it
+// is fully written, and says whether it overtook an older one.
+static Buffer *drain_one(OutputQueue &queue, bool *overtook = nullptr) {
+    Buffer *buffer = queue.next();
+    if (buffer) {
+        buffer->sent = buffer->size;
+        bool reordered = queue.pop();
+        if (overtook) {
+            *overtook = reordered;
+        }
+    }
+    return buffer;
+}
+
+static void test_replies_overtake_other_senders() {
+    OutputQueue queue;
+    std::string a = ":1.1";
+    std::string b = ":1.2";
+    Buffer *signal_a = new Buffer(16);
+    Buffer *reply_a = new Buffer(16);
+    Buffer *reply_b = new Buffer(16);
+
+    queue.push(signal_a, OUTPUT_LANE_SIGNAL, &a);
+    queue.push(reply_a, OUTPUT_LANE_REPLY, &a);
+    queue.push(reply_b, OUTPUT_LANE_REPLY, &b);
+
+    // B's reply has nothing of B's ahead of it; A's must wait for A's signal.
+    bool overtook = false;
+    CHECK(drain_one(queue, &overtook) == reply_b);
+    CHECK(overtook);
+    CHECK(drain_one(queue, &overtook) == signal_a);
+    CHECK(!overtook);
+    CHECK(drain_one(queue) == reply_a);
+    CHECK(queue.empty());
+
+    for (Buffer *buffer : {signal_a, reply_a, reply_b}) {
+        buffer->unref();
+    }
+}
+
+static void test_unclassified_is_a_barrier() {
+    OutputQueue queue;
+    std::string a = ":1.1";
+    Buffer *auth_line = new Buffer(16);
+    Buffer *reply = new Buffer(16);
+
+    queue.push(auth_line);
+    queue.push(reply, OUTPUT_LANE_REPLY, &a);
+
+    CHECK(drain_one(queue) == auth_line);
+    CHECK(drain_one(queue) == reply);
+
+    auth_line->unref();
+    reply->unref();
+}
+
+// Random pushes and drains from a few senders: every sender's messages
+// must come out in the order they went in, whatever lanes they used.
+static void test_per_sender_order() {
+    OutputQueue queue;
+    std::mt19937 rng(1);
+    std::string senders[] = {":1.1", ":1.2", ":1.3", "org.freedesktop.DBus"};
+    std::map<Buffer *, std::pair<int, int>> pushed;   // sender, sequence
+    int next_sequence[4] = {};
+    int last_drained[4] = {-1, -1, -1, -1};
+
+    auto drain = [&](Buffer *buffer) {
+        auto [sender, sequence] = pushed.at(buffer);
+        CHECK(sequence == last_drained[sender] + 1);
+        last_drained[sender] = sequence;
+        pushed.erase(buffer);
+        buffer->unref();
+    };
+
+    for (int round = 0; round < 10000; ++round) {
+        if (rng() % 3 != 0) {
+            int sender = static_cast<int>(rng() % 4);
+            auto lane = static_cast<OutputLane>(rng() % N_OUTPUT_LANES);
+            Buffer *buffer = new Buffer(16);
+            pushed[buffer] = {sender, next_sequence[sender]++};
+            queue.push(buffer, lane, &senders[sender]);
+        } else if (Buffer *buffer = drain_one(queue)) {
+            drain(buffer);
+        }
+    }
+    while (Buffer *buffer = drain_one(queue)) {
+        drain(buffer);
+    }
+
+    CHECK(pushed.empty());
+    CHECK(queue.empty());
+}
+
+// A streamed message's chunks follow its head in its lane, and nothing
+// is written between the head and its last chunk.
+static void test_chunks_stay_contiguous() {
+    OutputQueue queue;
+    std::string a = ":1.1";
+    std::string b = ":1.2";
+    Buffer *signal = new Buffer(16);
+    Buffer *head = new Buffer(16);
+    Buffer *chunk = new Buffer(16);
+    Buffer *last_chunk = new Buffer(16);
+    Buffer *reply = new Buffer(16);
+
+    queue.push(signal, OUTPUT_LANE_SIGNAL, &b);
+    queue.push(head, OUTPUT_LANE_REPLY, &a, true);
+    queue.push_chunk(chunk, true);
+
+    CHECK(drain_one(queue) == head);
+    CHECK(drain_one(queue) == chunk);
+    // The last chunk has not arrived: the signal must not slip in.
+    CHECK(queue.next() == nullptr);
+
+    // Nor may anything pushed meanwhile land inside the message.
+    queue.push(reply, OUTPUT_LANE_REPLY, &b);
+    CHECK(queue.next() == nullptr);
+    CHECK(queue.size() == 2);
+
+    queue.push_chunk(last_chunk, false);
+    CHECK(drain_one(queue) == last_chunk);
+    CHECK(drain_one(queue) == signal);
+    CHECK(drain_one(queue) == reply);
+    CHECK(queue.empty());
+
+    for (Buffer *buffer : {signal, head, chunk, last_chunk, reply}) {
+        buffer->unref();
+    }
+}
+
+static void test_partial_write_holds_lane() {
+    OutputQueue queue;
+    std::string a = ":1.1";
+    std::string b = ":1.2";
+    Buffer *signal = new Buffer(16);
+    Buffer *reply = new Buffer(16);
+
+    queue.push(signal, OUTPUT_LANE_SIGNAL, &a);
+    CHECK(queue.next() == signal);
+    signal->sent = 4;
+
+    queue.push(reply, OUTPUT_LANE_REPLY, &b);
+    CHECK(queue.next() == signal);
+    CHECK(drain_one(queue) == signal);
+    CHECK(drain_one(queue) == reply);
+
+    signal->unref();
+    reply->unref();
+}
+
+static void test_coalesce_take_back() {
+    OutputQueue queue;
+    std::string a = ":1.1";
+    std::string key = "props";
+    Buffer *first = new Buffer(16);
+    Buffer *other = new Buffer(16);
+    Buffer *second = new Buffer(16);
+
+    queue.push(first, OUTPUT_LANE_SIGNAL, &a, false, &key);
+    queue.push(other, OUTPUT_LANE_SIGNAL, &a);
+    CHECK(queue.find_coalescable(key) == first);
+
+    queue.take_coalescable(key);
+    CHECK(queue.size() == 1);
+    CHECK(queue.find_coalescable(key) == nullptr);
+    first->unref();
+
+    queue.push(second, OUTPUT_LANE_SIGNAL, &a, false, &key);
+    CHECK(drain_one(queue) == other);
+    CHECK(queue.find_coalescable(key) == second);
+
+    // Once writing has started it can no longer be taken back.
+    CHECK(queue.next() == second);
+    second->sent = 1;
+    CHECK(queue.find_coalescable(key) == nullptr);
+    CHECK(drain_one(queue) == second);
+    CHECK(queue.empty());
+
+    other->unref();
+    second->unref();
+}
+
+static void test_coalesce_key_moves_to_newest() {
+    OutputQueue queue;
+    std::string a = ":1.1";
+    std::string key = "props";
+    Buffer *first = new Buffer(16);
+    Buffer *second = new Buffer(16);
+
+    queue.push(first, OUTPUT_LANE_SIGNAL, &a, false, &key);
+    queue.push(second, OUTPUT_LANE_SIGNAL, &a, false, &key);
+    CHECK(queue.find_coalescable(key) == second);
+
+    // Writing the older one must not drop the newer one's claim.
+    CHECK(drain_one(queue) == first);
+    CHECK(queue.find_coalescable(key) == second);
+
+    queue.clear();
+    CHECK(queue.empty());
+    first->unref();
+}
+
+// Mirrors SerialTable::home(), to pick serials that collide on purpose.
+static size_t serial_home(uint32_t serial, size_t table_size) {
+    int bits = __builtin_ctzll(table_size);
+    return static_cast<uint32_t>(serial * 2654435769u) >> (32 - bits);
+}
+
+// Serials hashing to the last slot of a 16-slot table and to slot 0, so
+// their probe chains wrap around the end of the table.
+static std::vector<uint32_t> wrapping_serials() {
+    std::vector<uint32_t> last;
+    std::vector<uint32_t> first;
+
+    for (uint32_t serial = 1; last.size() < 3 || first.size() < 2; ++serial) {
+        size_t home = serial_home(serial, 16);
+        if (home == 15 && last.size() < 3) {
+            last.push_back(serial);
+        } else if (home == 0 && first.size() < 2) {
+            first.push_back(serial);
+        }
+    }
+
+    return {last[0], first[0], last[1], last[2], first[1]};
+}
+
+static void test_removal_with_wrapped_chains() {
+    std::vector<uint32_t> serials = wrapping_serials();
+
+    // Remove each serial in turn from a freshly filled table; the others
+    // must all still be found, whichever part of the chain moved back.
+    for (size_t removed = 0; removed < serials.size(); ++removed) {
+        SerialTable<int> table;
+        for (size_t i = 0; i < serials.size(); ++i) {
+            table.insert(serials[i], static_cast<int>(i), SERIAL_TABLE_NO_EXPIRY);
+        }
+
+        int value = -1;
+        CHECK(table.steal(serials[removed], &value));
+        CHECK(value == static_cast<int>(removed));
+        CHECK(table.find(serials[removed]) == nullptr);
+        CHECK(table.size() == serials.size() - 1);
+
+        for (size_t i = 0; i < serials.size(); ++i) {
+            if (i != removed) {
+                int *found = table.find(serials[i]);
+                CHECK(found && *found == static_cast<int>(i));
+            }
+        }
+    }
+}
+
+// Random inserts and steals over a small serial range, so chains are
+// long and collide, checked against a std::map.
+static void test_table_matches_map() {
+    SerialTable<uint32_t> table;
+    std::map<uint32_t, uint32_t> expected;
+    std::mt19937 rng(2);
+
+    for (int round = 0; round < 20000; ++round) {
+        uint32_t serial = 1 + rng() % 300;
+        if (rng() % 2) {
+            table.insert(serial, serial * 7, SERIAL_TABLE_NO_EXPIRY);
+            expected[serial] = serial * 7;
+        } else {
+            uint32_t value = 0;
+            bool stolen = table.steal(serial, &value);
+            CHECK(stolen == (expected.erase(serial) == 1));
+            CHECK(!stolen || value == serial * 7);
+        }
+        if (round % 1000 == 0) {
+            table.trim();
+        }
+    }
+
+    CHECK(table.size() == expected.size());
+    for (auto &[serial, value] : expected) {
+        uint32_t *found = table.find(serial);
+        CHECK(found && *found == value);
+    }
+}
+
+static void test_wheel_expiry() {
+    SerialTable<int> table;
+    std::vector<uint32_t> expired;
+    auto on_expired = [&](uint32_t serial, int &) { expired.push_back(serial); };
+
+    table.insert(1, 0, 5);
+    table.insert(2, 0, 5);
+    table.insert(3, 0, SERIAL_TABLE_NO_EXPIRY);
+
+    for (uint32_t tick = 6; tick < 5 + REPLY_WHEEL_SLOTS; ++tick) {
+        CHECK(table.expire(tick, on_expired) == 0);
+        if (tick == 6) {
+            table.insert(4, 0, 6);
+        }
+    }
+
+    int value;
+    CHECK(table.steal(2, &value));
+
+    // The wheel comes back to tick 5's slot: only what is left of it goes.
+    CHECK(table.expire(5 + REPLY_WHEEL_SLOTS, on_expired) == 1);
+    CHECK(expired == std::vector<uint32_t>{1});
+    CHECK(table.find(4) != nullptr);
+    CHECK(table.expire(6 + REPLY_WHEEL_SLOTS, on_expired) == 1);
+    CHECK((expired == std::vector<uint32_t>{1, 4}));
+    CHECK(table.find(3) != nullptr);
+    CHECK(table.size() == 1);
+}
+
+static void test_trim() {
+    SerialTable<int> table;
+    for (uint32_t serial = 1; serial <= 1000; ++serial) {
+        table.insert(serial, static_cast<int>(serial), SERIAL_TABLE_NO_EXPIRY);
+    }
+    size_t full = table.footprint();
+
+    int value;
+    for (uint32_t serial = 1; serial <= 990; ++serial) {
+        CHECK(table.steal(serial, &value));
+    }
+    table.trim();
+    CHECK(table.footprint() < full);
+    for (uint32_t serial = 991; serial <= 1000; ++serial) {
+        int *found = table.find(serial);
+        CHECK(found && *found == static_cast<int>(serial));
+    }
+
+    for (uint32_t serial = 991; serial <= 1000; ++serial) {
+        CHECK(table.steal(serial, &value));
+    }
+    table.trim();
+    CHECK(table.empty());
+    CHECK(table.footprint() == 0);
+    CHECK(table.find(991) == nullptr);
+}
+
+// Serial 0 is the empty-slot marker, so a peer sending reply_serial 0 must
+// never match a slot, shrink the count or fill the table.
+static void test_serial_zero() {
+    SerialTable<int> table;
+    int value = 7;
+    CHECK(table.find(0) == nullptr);
+    CHECK(!table.steal(0, &value));
+
+    for (uint32_t serial = 1; serial <= 5; ++serial) {
+        table.insert(serial, static_cast<int>(serial), SERIAL_TABLE_NO_EXPIRY);
+    }
+    table.insert(0, 100, SERIAL_TABLE_NO_EXPIRY);
+    CHECK(table.size() == 5);
+
+    for (int i = 0; i < 100; ++i) {
+        CHECK(table.find(0) == nullptr);
+        CHECK(!table.steal(0, &value));
+    }
+    CHECK(table.size() == 5);
+    CHECK(value == 7);
+    for (uint32_t serial = 1; serial <= 5; ++serial) {
+        CHECK(table.steal(serial, &value) && value == static_cast<int>(serial));
+    }
+    CHECK(table.empty());
+}
+
+int main() {
+    std::cerr.setstate(std::ios::badbit);
+
+    test_replies_overtake_other_senders();
+    test_unclassified_is_a_barrier();
+    test_per_sender_order();
+    test_chunks_stay_contiguous();
+    test_partial_write_holds_lane();
+    test_coalesce_take_back();
+    test_coalesce_key_moves_to_newest();
+    test_removal_with_wrapped_chains();
+    test_table_matches_map();
+    test_wheel_expiry();
+    test_trim();
+    test_serial_zero();
+
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
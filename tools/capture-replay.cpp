@@ -0,0 +1,335 @@
+#include "../headers/flatpak-proxy-client.h"
+#include "../headers/capture.h"
+#include "../headers/policy-args.h"
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <sstream>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+// Feeds a --capture file back through the proxy's message pipeline without
+// a bus. Every captured client gets a FlatpakProxyClient whose two sides
+// are connected to socketpairs; captured messages are handed to
+// got_buffer_from_client/got_buffer_from_bus exactly as side_in_cb would,
+// and whatever the proxy forwards is read back and discarded.
+
+#define DRAIN_CHUNK (64 * 1024)
+#define DRAIN_MAX_FDS 64
+
+std::string json_escape(const std::string& s);
+
+struct ReplayOptions {
+    std::string capture_path;
+    std::string output;
+    bool original_pacing = false;
+    size_t loops = 1;
+    bool verbose = false;
+};
+
+struct ReplayClient {
+    std::shared_ptr<FlatpakProxyClient> client;
+    int client_peer = -1;
+    int bus_peer = -1;
+};
+
+struct ReplayResult {
+    size_t messages = 0;
+    size_t bytes = 0;
+    size_t clients = 0;
+    size_t clients_closed = 0;
+    size_t skipped = 0;
+    size_t forwarded_bytes = 0;
+    int64_t elapsed_ns = 0;
+};
+
+static void usage(const char *argv0, int ecode) {
+    (ecode == EXIT_SUCCESS ? std::cout : std::cerr)
+        << "usage: " << argv0 << " [OPTIONS...] CAPTURE\n\n"
+        << "    --pacing=fast|original   Replay as fast as possible (default) or at captured pace\n"
+        << "    --loops=N                Replay the capture N times\n"
+        << "    --output=FILE            Append the JSON result to FILE\n"
+        << "    --verbose                Keep the proxy's debug output\n\n"
+        << "Policy options are the proxy's own: --filter, --sloppy-names, --see=NAME,\n"
+        << "--talk=NAME, --own=NAME, --call=NAME=RULE and --broadcast=NAME=RULE.\n";
+    exit(ecode);
+}
+
+static bool parse_args(int argc, char *argv[], FlatpakProxy *proxy, ReplayOptions *options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+
+        if (arg == "--help") {
+            usage(argv[0], EXIT_SUCCESS);
+        } else if (arg == "--pacing=fast") {
+            options->original_pacing = false;
+        } else if (arg == "--pacing=original") {
+            options->original_pacing = true;
+        } else if (arg.starts_with("--loops=")) {
+            char *endptr = nullptr;
+            options->loops = strtoul(arg.c_str() + strlen("--loops="), &endptr, 10);
+            if (*endptr != '\0' || options->loops == 0) {
+                std::cerr << "Invalid loop count " << arg << "\n";
+                return false;
+            }
+        } else if (arg.starts_with("--output=")) {
+            options->output = arg.substr(strlen("--output="));
+        } else if (arg == "--verbose") {
+            options->verbose = true;
+        } else if (arg[0] != '-') {
+            options->capture_path = arg;
+        } else {
+            PolicyArgResult res = apply_policy_arg(proxy, arg);
+            if (res == POLICY_ARG_INVALID) {
+                return false;
+            } else if (res == POLICY_ARG_UNKNOWN) {
+                std::cerr << "Unknown argument " << arg << "\n";
+                return false;
+            }
+        }
+    }
+
+    if (options->capture_path.empty()) {
+        std::cerr << "No capture file given\n";
+        return false;
+    }
+    return true;
+}
+
+static GSocketConnection *connection_for_fd(int fd) {
+    GError *error = nullptr;
+    GSocket *socket = g_socket_new_from_fd(fd, &error);
+    if (socket == nullptr) {
+        std::cerr << "Failed to wrap socket: " << error->message << "\n";
+        g_error_free(error);
+        close(fd);
+        return nullptr;
+    }
+
+    g_socket_set_blocking(socket, FALSE);
+    GSocketConnection *connection = g_socket_connection_factory_create_connection(socket);
+    g_object_unref(socket);
+    return connection;
+}
+
+// Sets up a client that has already authenticated, as if side_in_cb had
+// relayed SASL and the first byte.
+static bool start_client(FlatpakProxy *proxy, uint32_t id, ReplayClient *replay) {
+    int client_pair[2];
+    int bus_pair[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, client_pair) < 0) {
+        return false;
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, bus_pair) < 0) {
+        close(client_pair[0]);
+        close(client_pair[1]);
+        return false;
+    }
+
+    GSocketConnection *client_conn = connection_for_fd(client_pair[0]);
+    GSocketConnection *bus_conn = connection_for_fd(bus_pair[0]);
+    if (client_conn == nullptr || bus_conn == nullptr) {
+        if (client_conn) g_object_unref(client_conn);
+        if (bus_conn) g_object_unref(bus_conn);
+        close(client_pair[1]);
+        close(bus_pair[1]);
+        return false;
+    }
+
+    auto client = std::make_shared<FlatpakProxyClient>(proxy, client_conn);
+    client->id = id;
+    client->init_side(client, client_conn);
+    g_object_unref(client_conn);
+    client->bus_side.connection = bus_conn;
+    client->client_side.got_first_byte = true;
+    client->bus_side.got_first_byte = true;
+    client->auth_state = AUTH_COMPLETE;
+
+    fcntl(client_pair[1], F_SETFL, O_NONBLOCK);
+    fcntl(bus_pair[1], F_SETFL, O_NONBLOCK);
+
+    replay->client = client;
+    replay->client_peer = client_pair[1];
+    replay->bus_peer = bus_pair[1];
+    return true;
+}
+
+// Breaks the sides' references back to the client and drops it from the
+// proxy, so its destructor runs and its counters land in retired_stats.
+static void finish_client(FlatpakProxy *proxy, ReplayClient *replay) {
+    if (replay->client) {
+        proxy->clients.remove(replay->client);
+        replay->client->client_side.client.reset();
+        replay->client->bus_side.client.reset();
+        replay->client.reset();
+    }
+    if (replay->client_peer >= 0) {
+        close(replay->client_peer);
+        replay->client_peer = -1;
+    }
+    if (replay->bus_peer >= 0) {
+        close(replay->bus_peer);
+        replay->bus_peer = -1;
+    }
+}
+
+// Reads and discards everything the proxy wrote to `fd`, closing any fds
+// passed along with it.
+static size_t drain_peer(int fd) {
+    uint8_t chunk[DRAIN_CHUNK];
+    alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int) * DRAIN_MAX_FDS)];
+    size_t total = 0;
+
+    while (fd >= 0) {
+        struct iovec iov = { chunk, sizeof(chunk) };
+        struct msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t res = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+        if (res <= 0) {
+            break;
+        }
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                size_t n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                const int *fds = reinterpret_cast<const int *>(CMSG_DATA(cmsg));
+                for (size_t i = 0; i < n_fds; ++i) {
+                    close(fds[i]);
+                }
+            }
+        }
+        total += static_cast<size_t>(res);
+    }
+    return total;
+}
+
+static void replay_capture(FlatpakProxy *proxy, CaptureReader *reader,
+                           const ReplayOptions& options, ReplayResult *result) {
+    std::unordered_map<uint32_t, ReplayClient> clients;
+    int64_t start = monotonic_ns();
+    int64_t first_timestamp = -1;
+
+    while (const CaptureRecord *record = reader->next()) {
+        if (options.original_pacing) {
+            if (first_timestamp < 0) {
+                first_timestamp = static_cast<int64_t>(record->timestamp_ns);
+            }
+            int64_t due = start + static_cast<int64_t>(record->timestamp_ns) - first_timestamp;
+            int64_t now = monotonic_ns();
+            if (due > now) {
+                std::this_thread::sleep_for(std::chrono::nanoseconds(due - now));
+            }
+        }
+
+        auto [it, inserted] = clients.try_emplace(record->client_id);
+        ReplayClient &replay = it->second;
+        if (inserted) {
+            if (!start_client(proxy, record->client_id, &replay)) {
+                std::cerr << "Failed to set up client " << record->client_id << "\n";
+                ++result->skipped;
+                continue;
+            }
+            ++result->clients;
+        }
+
+        FlatpakProxyClient *client = replay.client.get();
+        if (client == nullptr || client->client_side.closed || client->bus_side.closed) {
+            ++result->skipped;
+            continue;
+        }
+
+        Buffer *buffer = new Buffer(record->length);
+        memcpy(buffer->data.data(), CaptureReader::message_data(record), record->length);
+        buffer->pos = record->length;
+        buffer->framed_at = monotonic_ns();
+        // Stand-ins for the fds that came with the captured message, so
+        // update_socket_messages finds as many as the header declares.
+        for (uint32_t i = 0; i < record->n_fds; ++i) {
+            buffer->fds.push_back(open("/dev/null", O_RDONLY | O_CLOEXEC));
+        }
+
+        if (record->direction == CAPTURE_FROM_BUS) {
+            client->got_buffer_from_bus(buffer);
+        } else {
+            client->got_buffer_from_client(buffer);
+        }
+        ++result->messages;
+        result->bytes += record->length;
+
+        while (g_main_context_iteration(nullptr, FALSE)) {
+        }
+        result->forwarded_bytes += drain_peer(replay.client_peer) + drain_peer(replay.bus_peer);
+
+        if (client->client_side.closed || client->bus_side.closed) {
+            ++result->clients_closed;
+        }
+    }
+
+    for (auto &[id, replay] : clients) {
+        finish_client(proxy, &replay);
+    }
+
+    result->elapsed_ns += monotonic_ns() - start;
+}
+
+int main(int argc, char *argv[]) {
+    Glib::init();
+    Gio::init();
+
+    FlatpakProxy proxy("unix:path=/nonexistent", "");
+    ReplayOptions options;
+    if (!parse_args(argc, argv, &proxy, &options)) {
+        usage(argv[0], EXIT_FAILURE);
+    }
+
+    if (!options.verbose) {
+        std::cerr.setstate(std::ios::badbit);
+    }
+
+    CaptureReader reader;
+    if (!reader.open(options.capture_path)) {
+        return EXIT_FAILURE;
+    }
+
+    ReplayResult result;
+    for (size_t loop = 0; loop < options.loops; ++loop) {
+        reader.rewind();
+        replay_capture(&proxy, &reader, options, &result);
+    }
+
+    double seconds = std::max(static_cast<double>(result.elapsed_ns) / 1e9, 1e-9);
+    std::string report = proxy.stats_report();
+    if (!report.empty() && report.back() == '\n') {
+        report.pop_back();
+    }
+
+    std::ostringstream json;
+    json << "{\"capture\":\"" << json_escape(options.capture_path) << "\""
+         << ",\"pacing\":\"" << (options.original_pacing ? "original" : "fast") << "\""
+         << ",\"loops\":" << options.loops
+         << ",\"messages\":" << result.messages
+         << ",\"bytes\":" << result.bytes
+         << ",\"forwarded_bytes\":" << result.forwarded_bytes
+         << ",\"clients\":" << result.clients
+         << ",\"clients_closed\":" << result.clients_closed
+         << ",\"skipped\":" << result.skipped
+         << ",\"seconds\":" << seconds
+         << ",\"messages_per_second\":" << static_cast<double>(result.messages) / seconds
+         << ",\"mb_per_second\":" << static_cast<double>(result.bytes) / seconds / (1024.0 * 1024.0)
+         << ",\"proxy\":" << report
+         << "}\n";
+
+    std::cout << json.str();
+    if (!options.output.empty()) {
+        std::ofstream(options.output, std::ios::app) << json.str();
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,64 @@
+#include "../headers/flatpak-proxy-client.h"
+#include "../headers/policy-args.h"
+#include "../headers/policy-image.h"
+#include <sys/stat.h>
+
+// Compiles policy rules into the binary image --policy-file maps. Rules
+// are given exactly as to the proxy, on the command line or in
+// --policy-args files, and the result is checked by mapping it back.
+
+static void usage(const char *argv0, int ecode) {
+    (ecode == EXIT_SUCCESS ? std::cout : std::cerr)
+        << "usage: " << argv0 << " [OPTIONS...] --output=FILE\n\n"
+        << "    --output=FILE            Write the compiled policy to FILE\n"
+        << "    --policy-args=FILE       Read rules from FILE (NUL or newline separated)\n"
+        << "    --see=NAME, --talk=NAME, --own=NAME, --call=NAME=RULE, --broadcast=NAME=RULE\n"
+        << "                             Add a rule, as for xdg-dbus-proxy\n";
+    exit(ecode);
+}
+
+int main(int argc, char *argv[]) {
+    PolicyTable table;
+    std::string output;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+
+        if (arg == "--help") {
+            usage(argv[0], EXIT_SUCCESS);
+        } else if (arg.starts_with("--output=")) {
+            output = arg.substr(strlen("--output="));
+        } else if (arg.starts_with("--policy-args=")) {
+            if (!load_policy_rules(arg.substr(strlen("--policy-args=")), &table)) {
+                return EXIT_FAILURE;
+            }
+        } else {
+            PolicyArgResult res = apply_policy_rule(&table, arg);
+            if (res == POLICY_ARG_INVALID) {
+                return EXIT_FAILURE;
+            } else if (res == POLICY_ARG_UNKNOWN) {
+                std::cerr << "Unknown argument " << arg << "\n";
+                usage(argv[0], EXIT_FAILURE);
+            }
+        }
+    }
+
+    if (output.empty()) {
+        std::cerr << "No output file given\n";
+        usage(argv[0], EXIT_FAILURE);
+    }
+
+    if (!write_policy_image(table, output)) {
+        return EXIT_FAILURE;
+    }
+
+    PolicyImage image;
+    struct stat st;
+    if (!image.open(output) || stat(output.c_str(), &st) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    std::cout << output << ": " << image.n_names() << " names, " << image.n_rules() << " rules, "
+              << st.st_size << " bytes\n";
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,540 @@
+#include "../headers/flatpak-proxy-client.h"
+#include "../headers/capture.h"
+#include "../headers/policy-args.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <sstream>
+
+// Offline policy simulator. Loads the proxy's policy options, then runs a
+// stream of message headers through the same decision code the proxy uses
+// (get_dbus_method_handler for client messages, the broadcast check from
+// got_buffer_from_bus for signals) with no sockets or bus involved. The
+// headers come from a --capture file or are generated from the policy
+// itself, and are parsed up front so only the decisions are timed.
+//
+// A first pass is timed; a second, untimed pass attributes every decision
+// to the rules that produced it, so the per-rule hit counts cost nothing
+// in decisions/s.
+
+std::string json_escape(const std::string& s);
+BusHandler get_dbus_method_handler(FlatpakProxyClient *client, Header *header, FlatpakPolicy *policy_out);
+bool filter_matches(Filter *filter, FilterTypeMask type, const std::string& path,
+                    const std::string& interface, const std::string& member);
+bool message_is_name_owner_changed(Header *header);
+bool should_filter_name_owner_changed(FlatpakProxyClient *client, Buffer *buffer, Header *header);
+void queue_expected_reply(ProxySide *side, uint32_t serial, ExpectedReplyType type);
+Buffer *message_to_buffer(GDBusMessage *message);
+
+static const char *policy_names[FLATPAK_POLICY_OWN + 1] = {
+    "none",
+    "see",
+    "talk",
+    "own",
+};
+
+struct SimOptions {
+    std::string capture_path;
+    std::string output;
+    size_t generate = 0;
+    unsigned int seed = 1;
+    size_t loops = 1;
+    size_t top = 0;
+    bool verbose = false;
+};
+
+struct SimMessage {
+    std::unique_ptr<Header> header;
+    uint32_t client_id = 0;
+    CaptureDirection direction = CAPTURE_FROM_CLIENT;
+};
+
+struct SimWorkload {
+    std::vector<SimMessage> messages;
+    // Unique names that own well-known names from the start, for generated
+    // traffic; a capture teaches them through NameOwnerChanged instead.
+    std::vector<std::pair<std::string, std::string>> owners;
+    size_t invalid = 0;
+};
+
+struct SimResult {
+    size_t decisions = 0;
+    size_t calls[N_BUS_HANDLERS] = {};
+    size_t replies_passed = 0;
+    size_t replies_denied = 0;
+    size_t broadcasts_passed = 0;
+    size_t broadcasts_filtered = 0;
+    size_t name_owner_changes_passed = 0;
+    size_t name_owner_changes_filtered = 0;
+    size_t skipped = 0;
+    int64_t elapsed_ns = 0;
+};
+
+struct RuleHits {
+    size_t matched = 0;
+    size_t allowed = 0;
+};
+
+typedef std::unordered_map<Filter *, RuleHits> RuleHitTable;
+
+static void usage(const char *argv0, int ecode) {
+    (ecode == EXIT_SUCCESS ? std::cout : std::cerr)
+        << "usage: " << argv0 << " [OPTIONS...] [CAPTURE]\n\n"
+        << "    --generate=N             Simulate N messages generated from the policy\n"
+        << "    --seed=N                 Seed for generated messages (default 1)\n"
+        << "    --loops=N                Run the timed pass N times\n"
+        << "    --top=N                  Only report the N most used rules\n"
+        << "    --output=FILE            Append the JSON result to FILE\n"
+        << "    --verbose                Keep the proxy's debug output\n\n"
+        << "Policy options are the proxy's own: --filter, --sloppy-names, --see=NAME,\n"
+        << "--talk=NAME, --own=NAME, --call=NAME=RULE, --broadcast=NAME=RULE,\n"
+        << "--policy-args=FILE and --policy-file=FILE.\n";
+    exit(ecode);
+}
+
+static bool parse_count(const std::string& arg, const char *prefix, size_t *value) {
+    char *endptr = nullptr;
+    *value = strtoul(arg.c_str() + strlen(prefix), &endptr, 10);
+    if (*endptr != '\0') {
+        std::cerr << "Invalid value in " << arg << "\n";
+        return false;
+    }
+    return true;
+}
+
+static bool parse_args(int argc, char *argv[], FlatpakProxy *proxy, SimOptions *options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        size_t value = 0;
+
+        if (arg == "--help") {
+            usage(argv[0], EXIT_SUCCESS);
+        } else if (arg.starts_with("--generate=")) {
+            if (!parse_count(arg, "--generate=", &options->generate)) {
+                return false;
+            }
+        } else if (arg.starts_with("--seed=")) {
+            if (!parse_count(arg, "--seed=", &value)) {
+                return false;
+            }
+            options->seed = static_cast<unsigned int>(value);
+        } else if (arg.starts_with("--loops=")) {
+            if (!parse_count(arg, "--loops=", &options->loops) || options->loops == 0) {
+                std::cerr << "Invalid loop count " << arg << "\n";
+                return false;
+            }
+        } else if (arg.starts_with("--top=")) {
+            if (!parse_count(arg, "--top=", &options->top)) {
+                return false;
+            }
+        } else if (arg.starts_with("--output=")) {
+            options->output = arg.substr(strlen("--output="));
+        } else if (arg == "--verbose") {
+            options->verbose = true;
+        } else if (arg.starts_with("--policy-args=")) {
+            proxy->set_policy_args(arg.substr(strlen("--policy-args=")));
+        } else if (arg.starts_with("--policy-file=")) {
+            proxy->set_policy_file(arg.substr(strlen("--policy-file=")));
+        } else if (arg[0] != '-') {
+            options->capture_path = arg;
+        } else {
+            PolicyArgResult res = apply_policy_arg(proxy, arg);
+            if (res == POLICY_ARG_INVALID) {
+                return false;
+            } else if (res == POLICY_ARG_UNKNOWN) {
+                std::cerr << "Unknown argument " << arg << "\n";
+                return false;
+            }
+        }
+    }
+
+    if (options->capture_path.empty() == (options->generate == 0)) {
+        std::cerr << "Give either a capture file or --generate=N\n";
+        return false;
+    }
+    return true;
+}
+
+static void add_message(SimWorkload *workload, Buffer *buffer, uint32_t client_id, CaptureDirection direction) {
+    auto header = std::make_unique<Header>();
+    try {
+        header->parse(buffer);
+    } catch (const std::exception& e) {
+        std::cerr << "Skipping invalid message: " << e.what() << "\n";
+        ++workload->invalid;
+        buffer->unref();
+        return;
+    }
+    buffer->unref();
+
+    SimMessage message;
+    message.header = std::move(header);
+    message.client_id = client_id;
+    message.direction = direction;
+    workload->messages.push_back(std::move(message));
+}
+
+static bool load_capture(const std::string& path, SimWorkload *workload) {
+    CaptureReader reader;
+    if (!reader.open(path)) {
+        return false;
+    }
+
+    while (const CaptureRecord *record = reader.next()) {
+        Buffer *buffer = new Buffer(record->length);
+        memcpy(buffer->data.data(), CaptureReader::message_data(record), record->length);
+        buffer->pos = record->length;
+        add_message(workload, buffer, record->client_id, static_cast<CaptureDirection>(record->direction));
+    }
+    return true;
+}
+
+// Every rule in `table`, including those of a compiled --policy-file, in
+// name order so a seed always generates the same messages.
+static std::vector<Filter *> all_rules(const PolicyTable& table) {
+    std::vector<std::string> names;
+    std::vector<Filter *> rules;
+
+    table.for_each_name([&](const std::string& name, bool) {
+        names.push_back(name);
+    });
+    std::sort(names.begin(), names.end());
+
+    for (const std::string& name : names) {
+        const std::vector<Filter *> *filters = table.find(name);
+        rules.insert(rules.end(), filters->begin(), filters->end());
+    }
+    return rules;
+}
+
+// A concrete name covered by `filter`, and an object path, interface and
+// member its rule accepts.
+static void target_for_filter(const Filter *filter, std::string *name, std::string *path,
+                              std::string *interface, std::string *member) {
+    *name = filter->name_is_subtree ? filter->name + ".Sim" : filter->name;
+
+    std::string default_path = "/" + *name;
+    std::replace(default_path.begin(), default_path.end(), '.', '/');
+
+    *path = filter->path.empty() ? default_path : filter->path;
+    if (filter->path_is_subtree) {
+        *path += (*path == "/") ? "Sim" : "/Sim";
+    }
+    *interface = filter->interface.empty() ? *name : filter->interface;
+    *member = filter->member.empty() ? "Method" : filter->member;
+}
+
+// Generated traffic, roughly the mix a desktop client sends: mostly calls
+// to names the policy covers, some to names it does not, bus calls, and
+// broadcasts from the owners of covered names.
+static void generate_workload(FlatpakProxy *proxy, size_t count, unsigned int seed, SimWorkload *workload) {
+    static const char *bus_methods[] = {
+        "AddMatch", "GetNameOwner", "NameHasOwner", "ListNames", "RequestName", "GetConnectionUnixProcessID",
+    };
+
+    std::vector<const Filter *> targets;
+    std::unordered_map<std::string, std::string> owner_of;
+    for (Filter *filter : all_rules(*proxy->policy)) {
+        if (filter->name != "org.freedesktop.DBus") {
+            targets.push_back(filter);
+        }
+    }
+
+    for (const Filter *filter : targets) {
+        std::string name, path, interface, member;
+        target_for_filter(filter, &name, &path, &interface, &member);
+        if (owner_of.try_emplace(name, ":1." + std::to_string(owner_of.size() + 100)).second) {
+            workload->owners.emplace_back(owner_of[name], name);
+        }
+    }
+
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<int> percent(0, 99);
+
+    for (size_t i = 0; i < count; ++i) {
+        int roll = percent(rng);
+        GDBusMessage *message = nullptr;
+        CaptureDirection direction = CAPTURE_FROM_CLIENT;
+
+        if (roll < 10) {
+            message = g_dbus_message_new_method_call(
+                "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                bus_methods[rng() % std::size(bus_methods)]);
+        } else if (targets.empty() || roll < 20) {
+            std::string name = "org.sim.Unknown" + std::to_string(rng() % 1000);
+            message = g_dbus_message_new_method_call(name.c_str(), "/org/sim/Unknown", name.c_str(), "Method");
+        } else {
+            const Filter *filter = targets[rng() % targets.size()];
+            std::string name, path, interface, member;
+            target_for_filter(filter, &name, &path, &interface, &member);
+
+            if (roll < 75) {
+                const std::string& destination = (rng() & 1) ? owner_of[name] : name;
+                message = g_dbus_message_new_method_call(
+                    destination.c_str(), path.c_str(), interface.c_str(), member.c_str());
+            } else {
+                message = g_dbus_message_new_signal(path.c_str(), interface.c_str(), member.c_str());
+                g_dbus_message_set_sender(message, owner_of[name].c_str());
+                direction = CAPTURE_FROM_BUS;
+            }
+        }
+
+        g_dbus_message_set_serial(message, static_cast<guint32>(i + 1));
+        Buffer *buffer = message_to_buffer(message);
+        g_object_unref(message);
+        add_message(workload, buffer, 0, direction);
+    }
+}
+
+static std::shared_ptr<FlatpakProxyClient> new_sim_client(FlatpakProxy *proxy, const SimWorkload& workload) {
+    auto client = std::make_shared<FlatpakProxyClient>(proxy, nullptr);
+    client->client_side = ProxySide(client, false);
+    client->bus_side = ProxySide(client, true);
+    client->auth_state = AUTH_COMPLETE;
+
+    for (auto &[unique_id, name] : workload.owners) {
+        client->add_unique_id_owned_name(unique_id, name);
+    }
+    return client;
+}
+
+static void finish_sim_client(std::shared_ptr<FlatpakProxyClient>& client) {
+    client->client_side.client.reset();
+    client->bus_side.client.reset();
+    client.reset();
+}
+
+// Credits `filters`, as returned by get_max_policy_and_matched, with a
+// match, and the first of them that lets the message through of `type`
+// with an allow. The proxy's implicit match-all filters are not rules and
+// are not in `hits`.
+static void record_hits(RuleHitTable *hits, const std::vector<Filter *>& filters, FlatpakPolicy policy,
+                        FilterTypeMask type, Header *header, bool allowed) {
+    Filter *allowed_by = nullptr;
+
+    for (auto *filter : filters) {
+        auto it = hits->find(filter);
+        if (it == hits->end()) {
+            continue;
+        }
+        ++it->second.matched;
+
+        if (allowed && allowed_by == nullptr &&
+            ((policy >= FLATPAK_POLICY_TALK && filter->policy == policy && filter->types == FILTER_TYPE_ALL) ||
+             filter_matches(filter, type, header->path, header->interface, header->member))) {
+            allowed_by = filter;
+            ++it->second.allowed;
+        }
+    }
+}
+
+static void simulate_from_client(FlatpakProxyClient *client, Header *header, SimResult *result, RuleHitTable *hits) {
+    FlatpakPolicy policy = FLATPAK_POLICY_NONE;
+    BusHandler handler = get_dbus_method_handler(client, header, &policy);
+
+    if (header->has_reply_serial) {
+        ++(handler == HANDLE_PASS ? result->replies_passed : result->replies_denied);
+    } else {
+        ++result->calls[handler];
+        if (hits) {
+            std::vector<Filter *> filters;
+            client->get_max_policy_and_matched(header->destination, &filters);
+            record_hits(hits, filters, policy, FILTER_TYPE_CALL, header, handler != HANDLE_DENY && handler != HANDLE_HIDE);
+        }
+    }
+    ++result->decisions;
+}
+
+static void simulate_from_bus(FlatpakProxyClient *client, Header *header, SimResult *result, RuleHitTable *hits) {
+    if (header->has_reply_serial) {
+        ++result->skipped;
+        return;
+    }
+
+    if (message_is_name_owner_changed(header)) {
+        bool filtered = should_filter_name_owner_changed(client, header->buffer, header);
+        ++(filtered ? result->name_owner_changes_filtered : result->name_owner_changes_passed);
+        ++result->decisions;
+        return;
+    }
+
+    if (header->type != G_DBUS_MESSAGE_TYPE_SIGNAL || !header->destination.empty()) {
+        // Method calls from the bus reach the client unfiltered, but the
+        // client's reply is then checked against them.
+        if (header->client_message_generates_reply()) {
+            queue_expected_reply(&client->bus_side, header->serial, EXPECTED_REPLY_NORMAL);
+        }
+        ++result->skipped;
+        return;
+    }
+
+    FlatpakPolicy policy = FLATPAK_POLICY_NONE;
+    bool filtered = !client->broadcast_allowed(header, &policy);
+
+    ++(filtered ? result->broadcasts_filtered : result->broadcasts_passed);
+    ++result->decisions;
+
+    if (hits) {
+        std::vector<Filter *> filters;
+        client->get_max_policy_and_matched(header->sender, &filters);
+        record_hits(hits, filters, policy, FILTER_TYPE_BROADCAST, header, !filtered);
+    }
+}
+
+// One pass over the workload with fresh client state, so every pass learns
+// unique names and expected replies the same way.
+static void simulate(FlatpakProxy *proxy, const SimWorkload& workload, SimResult *result, RuleHitTable *hits) {
+    std::unordered_map<uint32_t, std::shared_ptr<FlatpakProxyClient>> clients;
+
+    int64_t start = monotonic_ns();
+    for (const SimMessage& message : workload.messages) {
+        auto [it, inserted] = clients.try_emplace(message.client_id);
+        if (inserted) {
+            it->second = new_sim_client(proxy, workload);
+        }
+
+        if (message.direction == CAPTURE_FROM_BUS) {
+            simulate_from_bus(it->second.get(), message.header.get(), result, hits);
+        } else {
+            simulate_from_client(it->second.get(), message.header.get(), result, hits);
+        }
+    }
+    result->elapsed_ns += monotonic_ns() - start;
+
+    for (auto &[id, client] : clients) {
+        finish_sim_client(client);
+    }
+}
+
+static std::string describe_rule(const Filter *filter) {
+    std::string rule;
+    if (filter->types == FILTER_TYPE_ALL) {
+        return rule;
+    }
+    if (!filter->interface.empty()) {
+        rule = filter->interface + "." + (filter->member.empty() ? "*" : filter->member);
+    } else if (!filter->member.empty()) {
+        rule = "*." + filter->member;
+    }
+    if (!filter->path.empty()) {
+        rule += "@" + filter->path + (filter->path_is_subtree ? "/*" : "");
+    }
+    return rule.empty() ? "*" : rule;
+}
+
+static void write_rules(std::ostream& out, const RuleHitTable& hits, size_t top) {
+    std::vector<std::pair<Filter *, RuleHits>> rules(hits.begin(), hits.end());
+    std::sort(rules.begin(), rules.end(), [](const auto& a, const auto& b) {
+        if (a.second.allowed != b.second.allowed) return a.second.allowed > b.second.allowed;
+        if (a.second.matched != b.second.matched) return a.second.matched > b.second.matched;
+        return a.first->name < b.first->name;
+    });
+    if (top > 0 && rules.size() > top) {
+        rules.resize(top);
+    }
+
+    out << "[";
+    bool first = true;
+    for (auto &[filter, rule_hits] : rules) {
+        const char *kind = filter->types == FILTER_TYPE_CALL ? "call"
+                         : filter->types == FILTER_TYPE_BROADCAST ? "broadcast"
+                         : policy_names[filter->policy];
+        out << (first ? "" : ",")
+            << "{\"name\":\"" << json_escape(filter->name) << (filter->name_is_subtree ? ".*" : "") << "\""
+            << ",\"kind\":\"" << kind << "\""
+            << ",\"rule\":\"" << json_escape(describe_rule(filter)) << "\""
+            << ",\"matched\":" << rule_hits.matched
+            << ",\"allowed\":" << rule_hits.allowed
+            << "}";
+        first = false;
+    }
+    out << "]";
+}
+
+int main(int argc, char *argv[]) {
+    Glib::init();
+    Gio::init();
+
+    FlatpakProxy proxy("unix:path=/nonexistent", "");
+    SimOptions options;
+    if (!parse_args(argc, argv, &proxy, &options)) {
+        usage(argv[0], EXIT_FAILURE);
+    }
+
+    if (proxy.has_policy_source() && !proxy.reload_policy()) {
+        return EXIT_FAILURE;
+    }
+
+    if (!options.verbose) {
+        std::cerr.setstate(std::ios::badbit);
+    }
+
+    SimWorkload workload;
+    if (!options.capture_path.empty()) {
+        if (!load_capture(options.capture_path, &workload)) {
+            return EXIT_FAILURE;
+        }
+    } else {
+        generate_workload(&proxy, options.generate, options.seed, &workload);
+    }
+
+    size_t n_rules = 0;
+    RuleHitTable hits;
+    for (Filter *filter : all_rules(*proxy.policy)) {
+        hits.emplace(filter, RuleHits());
+        ++n_rules;
+    }
+
+    SimResult timed;
+    for (size_t loop = 0; loop < options.loops; ++loop) {
+        simulate(&proxy, workload, &timed, nullptr);
+    }
+
+    SimResult attributed;
+    simulate(&proxy, workload, &attributed, &hits);
+
+    size_t unused = std::count_if(hits.begin(), hits.end(), [](const auto& entry) {
+        return entry.second.matched == 0;
+    });
+    double seconds = std::max(static_cast<double>(timed.elapsed_ns) / 1e9, 1e-9);
+
+    std::ostringstream json;
+    json << "{\"source\":";
+    if (!options.capture_path.empty()) {
+        json << "\"" << json_escape(options.capture_path) << "\"";
+    } else {
+        json << "\"generated\",\"seed\":" << options.seed;
+    }
+    json << ",\"filter\":" << (proxy.filter ? "true" : "false")
+         << ",\"rules\":" << n_rules
+         << ",\"messages\":" << workload.messages.size()
+         << ",\"invalid\":" << workload.invalid
+         << ",\"loops\":" << options.loops
+         << ",\"decisions\":" << timed.decisions
+         << ",\"seconds\":" << seconds
+         << ",\"decisions_per_second\":" << static_cast<double>(timed.decisions) / seconds
+         << ",\"ns_per_decision\":" << static_cast<double>(timed.elapsed_ns) / std::max<size_t>(timed.decisions, 1)
+         << ",\"calls\":{";
+    for (int i = 0; i < N_BUS_HANDLERS; ++i) {
+        json << (i ? "," : "") << "\"" << handler_names[i] << "\":" << attributed.calls[i];
+    }
+    json << "},\"replies\":{\"passed\":" << attributed.replies_passed
+         << ",\"denied\":" << attributed.replies_denied
+         << "},\"broadcasts\":{\"passed\":" << attributed.broadcasts_passed
+         << ",\"filtered\":" << attributed.broadcasts_filtered
+         << "},\"name_owner_changed\":{\"passed\":" << attributed.name_owner_changes_passed
+         << ",\"filtered\":" << attributed.name_owner_changes_filtered
+         << "},\"skipped\":" << attributed.skipped
+         << ",\"unused_rules\":" << unused
+         << ",\"rule_hits\":";
+    write_rules(json, hits, options.top);
+    json << "}\n";
+
+    std::cout << json.str();
+    if (!options.output.empty()) {
+        std::ofstream(options.output, std::ios::app) << json.str();
+    }
+    return EXIT_SUCCESS;
+}